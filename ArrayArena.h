@@ -0,0 +1,104 @@
+//===- ArrayArena.h - Memory for arrays computed by JIT'd code --*- C++ -*-===//
+//
+// Where JIT'd code puts the arrays it computes, e.g. `a * 2` passed to an
+// array parameter: a bump allocator per thread, with nested scopes. Code
+// that allocates calls __karena_enter at the start of its scope (a function,
+// or one iteration of a parallel for body) and __karena_leave at the end,
+// which frees everything allocated in between. Functions only return
+// numbers, so no array outlives the scope that computed it.
+//
+// Every array is 64-byte aligned, which codegen passes on to the vectorizer
+// as the alignment of what __karena_alloc returns.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KALEIDOSCOPE_ARRAYARENA_H
+#define KALEIDOSCOPE_ARRAYARENA_H
+
+#include "llvm/Support/ErrorHandling.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+namespace llvm {
+namespace orc {
+
+class ArrayArena {
+public:
+  static constexpr size_t Alignment = 64;
+  static constexpr size_t BlockSize = 1 << 20;
+
+  // The arena of the calling thread
+  static ArrayArena &get() {
+    static thread_local ArrayArena Arena;
+    return Arena;
+  }
+
+  void enter() { Marks.push_back({Cur, Used}); }
+
+  // Back to where the matching enter() was. Blocks are kept for reuse, but
+  // only the first once the outermost scope is left, so that one huge array
+  // does not stay around
+  void leave() {
+    Cur = Marks.back().Index;
+    Used = Marks.back().Used;
+    Marks.pop_back();
+    if (Marks.empty() && Blocks.size() > 1)
+      Blocks.erase(Blocks.begin() + 1, Blocks.end());
+  }
+
+  void *allocate(size_t Bytes) {
+    Bytes = (Bytes + Alignment - 1) & ~(Alignment - 1);
+    if (Cur >= Blocks.size() || Used + Bytes > Blocks[Cur].Size) {
+      // Blocks after the one in use are free; one too small is replaced
+      if (Cur < Blocks.size() && Used > 0)
+        Cur++;
+      Used = 0;
+      if (Cur >= Blocks.size() || Blocks[Cur].Size < Bytes) {
+        Blocks.erase(Blocks.begin() + std::min(Cur, Blocks.size()),
+                     Blocks.end());
+        Blocks.emplace_back(std::max(size_t(BlockSize), Bytes));
+      }
+    }
+    char *P = Blocks[Cur].Data.get() + Used;
+    Used += Bytes;
+    return P;
+  }
+
+private:
+  struct Block {
+    explicit Block(size_t Size) : Size(Size) {
+      void *P = nullptr;
+      if (posix_memalign(&P, Alignment, Size) != 0)
+        report_bad_alloc_error("out of memory for arrays");
+      Data.reset(static_cast<char *>(P));
+    }
+
+    struct Free {
+      void operator()(char *P) const { free(P); }
+    };
+    std::unique_ptr<char, Free> Data;
+    size_t Size;
+  };
+
+  // Where a scope started: the block in use then and how much of it was
+  struct Mark {
+    size_t Index, Used;
+  };
+
+  std::vector<Block> Blocks;
+  size_t Cur = 0, Used = 0;
+  std::vector<Mark> Marks;
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+// The entry points JIT'd code calls, by these names
+extern "C" void __karena_enter();
+extern "C" void __karena_leave();
+extern "C" void *__karena_alloc(int64_t Bytes);
+
+#endif // KALEIDOSCOPE_ARRAYARENA_H
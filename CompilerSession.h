@@ -0,0 +1,767 @@
+//===- CompilerSession.h - The Kaleidoscope compiler, inside ----*- C++ -*-===//
+//
+// What libkaleidoscope is made of: the lexer, the AST, and CompilerSession,
+// which holds everything one program needs while it is compiled and run.
+// This is for the kaleidoscope driver; programs embedding the language use
+// Kaleidoscope.h instead.
+//
+// Nothing in here prints or exits: errors go to CompilerSession::OnError,
+// IR and progress notes to CompilerSession::Echo, and both are off unless
+// the user of the session sets them.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KALEIDOSCOPE_COMPILERSESSION_H
+#define KALEIDOSCOPE_COMPILERSESSION_H
+
+#include "ExecutorPool.h"
+#include "KaleidoscopeJIT.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+using namespace llvm;
+
+using namespace llvm::orc;
+
+#define IRGEN true
+
+
+// ---Lexer---
+
+typedef enum {
+		// EOF
+		tok_eof = -1,
+
+		// keywords
+		tok_def = -2,
+		tok_extern = -3,
+
+		// things
+		tok_number = -4,
+		tok_identifier = -5,
+
+		tok_error = -6,
+
+		// qualifiers
+		tok_fastmath = -7,
+
+		// directives
+		tok_load = -8,
+		tok_string = -9,
+
+		// constructs
+		tok_parallel = -10
+}Token_t;
+
+// Splits the characters of a source into tokens. The text of the last
+// identifier or "string", or the value of the last number, is left in
+// IdentifierString or NumValue.
+class Lexer {
+	public:
+		// Fills Buf with up to Size more characters and returns how many;
+		// 0 at the end of the input
+		typedef std::function<size_t(char *Buf, size_t Size)> ReadFn;
+
+		// Lex Text, which must stay alive until the lexer is done with it
+		void reset(StringRef Text);
+		// Lex what Read produces, as it produces it
+		void reset(ReadFn Read);
+
+		std::string IdentifierString;
+		double NumValue;
+
+		int gettok();
+
+	private:
+		int getChar() {
+				if (Cur == End && !refill()) {
+						return EOF;
+				}
+				return (unsigned char)*Cur++;
+		}
+
+		bool refill();
+		// First character from P on, in the buffer, that is not in Class
+		const char *scan(const char *P, uint8_t Class) const;
+
+		ReadFn Read; // none for a text source
+		std::vector<char> Buf;
+		const char *Cur = nullptr, *End = nullptr;
+		char LastChar = ' ';
+		std::string NumStr; // a number token cut by the end of a read buffer
+};
+
+// How a character parses between two operands; built in (the instruction of
+// EmitBinaryOp), or defined with `def binary`, a call to "binary" and the
+// character. A character can also be a prefix operator, defined with `def
+// unary`, whatever it is between operands.
+struct OperatorInfo {
+	uint8_t Precedence = 0; // 0: not a binary operator
+	bool RightAssoc = false;
+	bool Defined = false;
+	bool Unary = false;
+};
+
+// What parsing the prototype of an operator did to the operator table, to
+// be undone if the definition does not compile
+struct OperatorChange {
+	char Op = 0; // none if the prototype is not an operator's
+	OperatorInfo Before, After;
+};
+
+// How a session compiles, fixed when it is created
+struct CompilerOptions {
+	FastMathFlags FMF; // FP semantics applied to every function
+	unsigned SpecializeLimit = 8; // Max constant-argument clones per function, 0 disables specialization
+	unsigned ExprCacheSize = 256; // Compiled top-level expression shapes kept around, 0 disables the cache
+	bool Profile = false; // Instrument definitions with call counts and cycle totals
+	bool Watch = false; // Definitions can be replaced (--watch): each has code of its own, called through a stub
+};
+
+
+
+// The different types of expressions:
+// 
+// ExprAST an expression a + f(b) + 5
+// 
+// 	NumExprAST a number 5
+//
+// 	VariableExprAST an identifier `a`
+//
+// 	CallExprAST a function call `f(b)
+//
+// 	BinaryExprAST a binary expression a + b, element-wise if a or b is an array
+//
+// 	IndexExprAST an element of an array `a[i]`
+//
+// 	ParallelForExprAST a parallel sum `parallel for i = 0, n in f(i)`
+//
+// PrototypeExprAST a function prototype f(a, b, c, d, e), f(a[] b) for an
+// array a, or an operator: binary| 5 (a b), unary!(v)
+//
+// FunctionExprAST a function declaration prototype
+// - f(a, b)
+//       a + f(b) + 5
+
+// --- AST ---
+
+class ASTVisitor;
+class CompilerSession;
+
+class ExprAST {
+		public:
+
+				virtual ~ExprAST() {} // if a base class pointer points to a derived class object
+				// when it goes out of scope, it should be
+				// deallocated properly (TODO: understand properly)
+
+				// TODO: throws "undefined reference to vtable for ExprAST" 
+				// if accept is not declared as pure virtual
+				// Why?
+				// Accept function for visitor pattern
+				virtual void accept(ASTVisitor& visitor) = 0;
+
+				// Generate code for sub-AST
+				virtual Value* codegen(CompilerSession& S) = 0; 
+};
+
+class NumExprAST;
+class VariableExprAST;
+class BinaryExprAST;
+class CallExprAST;
+class IndexExprAST;
+class ParallelForExprAST;
+class PrototypeAST;
+class FunctionAST;
+
+// Visitor class for ExprAST
+
+class ASTVisitor {
+	public:
+
+		virtual void visit(NumExprAST *p_obj) = 0;
+
+		virtual void visit(VariableExprAST *p_obj) = 0;
+
+		virtual void visit(CallExprAST *p_obj) = 0;
+
+		virtual void visit(FunctionAST *p_obj) = 0;
+
+		virtual void visit(PrototypeAST *p_obj) = 0;
+
+		virtual void visit(BinaryExprAST *p_obj) = 0;
+
+		virtual void visit(ParallelForExprAST *p_obj) = 0;
+
+		virtual void visit(IndexExprAST *p_obj) = 0;
+
+};
+
+class NumExprAST: public ExprAST {
+		private: // default access is private, be explicit
+				double Val; 
+		public:
+				NumExprAST(double Val): Val(Val) {}
+				Value* codegen(CompilerSession& S);
+				void accept(ASTVisitor& visitor) { visitor.visit(this); }
+				double GetVal() { return Val; }
+};
+
+
+
+
+class VariableExprAST: public ExprAST {
+		private:
+				std::string Name;
+		public:
+				VariableExprAST(const std::string &Name): Name(Name) {};
+				Value *codegen(CompilerSession& S);
+				void accept(ASTVisitor& visitor) { visitor.visit(this); }
+				// Reference used because the string is not going to be used later
+				// again, so why waste space? (and it's not going to be modified, so
+				// const
+				std::string& GetName() { return Name; }
+};
+
+
+
+class CallExprAST: public ExprAST {
+		private:
+				std::string Callee;
+		public:
+				// TODO: figure out a way to keep this private
+				std::vector<std::unique_ptr <ExprAST> > Args;
+
+				CallExprAST(std::string &Callee, 
+								std::vector< std::unique_ptr <ExprAST> > Args_):
+						Callee(Callee), Args(std::move(Args_)) {}
+				// TODO: figure out why I need to use move here (because vector itself
+				// is not a unique_ptr!, to get deleted before use)
+				// probably so because moving a vector does not move it's contents, just
+				// it's meta information, while moving a string moves its contents
+				Value *codegen(CompilerSession& S);
+				void accept(ASTVisitor& visitor) { visitor.visit(this); }
+				std::string& GetCallee() { return Callee; }
+};
+
+class BinaryExprAST: public ExprAST {
+		private: 
+				char Op;
+		public:
+				// TODO: figure out a way to keep these private
+				std::unique_ptr<ExprAST> LHS, RHS;
+				BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS,
+								std::unique_ptr<ExprAST> RHS):
+						Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+				Value *codegen(CompilerSession& S);
+				void accept(ASTVisitor& visitor) { visitor.visit(this); }
+				char GetOp() { return Op; }
+};
+
+// Element Index of Array (any array-valued expression), NaN if there is no
+// such element
+class IndexExprAST: public ExprAST {
+		public:
+				std::unique_ptr<ExprAST> Array, Index;
+				IndexExprAST(std::unique_ptr<ExprAST> Array, std::unique_ptr<ExprAST> Index):
+						Array(std::move(Array)), Index(std::move(Index)) {}
+				Value *codegen(CompilerSession& S);
+				void accept(ASTVisitor& visitor) { visitor.visit(this); }
+};
+
+// The sum of Body over Var = Start, Start + 1, ... while below End. Chunks
+// of the range run on the work-stealing pool of ParallelRuntime.h; Body can
+// use the variables around it, and must not depend on the order it runs in.
+class ParallelForExprAST: public ExprAST {
+		private:
+				std::string VarName;
+		public:
+				std::unique_ptr<ExprAST> Start, End, Body;
+				ParallelForExprAST(const std::string& VarName, std::unique_ptr<ExprAST> Start,
+								std::unique_ptr<ExprAST> End, std::unique_ptr<ExprAST> Body):
+						VarName(VarName), Start(std::move(Start)), End(std::move(End)), Body(std::move(Body)) {}
+				Value *codegen(CompilerSession& S);
+				void accept(ASTVisitor& visitor) { visitor.visit(this); }
+				const std::string& GetVarName() { return VarName; }
+};
+
+// Neither a prototype, nor a function is an "expression"
+
+class PrototypeAST {
+		private:
+				std::string Name;
+				std::vector< std::string > Args;
+				std::vector<bool> ArrayArgs; // by position; missing ones are numbers
+				OperatorChange Operator; // of `def binary|` or `def unary!`, named "binary|" or "unary!"
+		public:
+				PrototypeAST(const std::string &Name, 
+								std::vector< std::string> Args, std::vector<bool> ArrayArgs = {}):
+						Name(Name), Args(std::move(Args)), ArrayArgs(std::move(ArrayArgs)) {}
+				// An array parameter is two in the IR: `double *a, i64 a.len`
+				Function* codegen(CompilerSession& S);
+
+				void accept(ASTVisitor& visitor) { visitor.visit(this); }
+				std::string& GetName() { return Name; }
+				std::vector<std::string>& GetArgs() { return Args; }
+				bool IsArrayArg(unsigned i) { return i < ArrayArgs.size() && ArrayArgs[i]; }
+				void SetOperator(const OperatorChange& Change) { Operator = Change; }
+				const OperatorChange& GetOperator() { return Operator; }
+				bool IsOperator() { return Operator.Op != 0; }
+};
+
+class FunctionAST {
+		private:
+				// this is a tree! these should be pointers to members!
+				// (a function should be an object pointing to these things, not an
+				// object *containing* these things
+		public:
+				// TODO: Figure out a way to make these
+				// unique_ptr members private, and still
+				// access them from the visitor 
+				std::unique_ptr<PrototypeAST> Proto;
+				std::unique_ptr<ExprAST> Body;
+				bool FastMath; // `def fastmath f(x) ...`: relax FP semantics for this body only
+
+				FunctionAST(std::unique_ptr<PrototypeAST> Proto, 
+								std::unique_ptr<ExprAST> Body, bool FastMath = false):
+						Proto(std::move(Proto)), Body(std::move(Body)), FastMath(FastMath) {}
+				// probably when I am getting passed a unique_ptr, the compiler sees
+				// that it will get deleted when it goes out of scope- *move* is used to
+				// indicate that I want to be a cannibal
+
+				Function* codegen(CompilerSession& S);
+
+				void accept(ASTVisitor& visitor) { visitor.visit(this); }
+};
+
+
+// -- Statistics --
+
+// Where the time of each top-level item goes. Phases nest (lexing happens
+// inside parsing, optimization inside codegen, ...): time is only ever
+// charged to the innermost phase, so the phases of an item add up.
+enum Phase { PhaseLex, PhaseParse, PhaseCodegen, PhaseOptimize, PhaseJIT, PhaseExecute, NumPhases };
+
+extern const char *PhaseNames[NumPhases];
+
+enum StatsMode { StatsOff, StatsText, StatsJSON };
+
+// Process-wide, and off unless the driver turns it on: the per item records
+// assume one session working on one item at a time
+extern StatsMode Stats;
+
+struct ItemStats {
+		std::string Kind;
+		std::string Name;
+		double Seconds[NumPhases] = {};
+		uint64_t Tokens = 0;
+		uint64_t ASTNodes = 0;
+		uint64_t IRBefore = 0; // instructions before the function passes
+		uint64_t IRAfter = 0;
+		uint64_t CodeBytes = 0;
+		uint64_t Modules = 0; // modules materialized by the JIT
+		uint64_t MMaps = 0; // system calls made for JIT memory
+		uint64_t MProtects = 0;
+
+		void add(const ItemStats& O) {
+				for (int i = 0; i < NumPhases; i++) {
+						Seconds[i] += O.Seconds[i];
+				}
+				Tokens += O.Tokens;
+				ASTNodes += O.ASTNodes;
+				IRBefore += O.IRBefore;
+				IRAfter += O.IRAfter;
+				CodeBytes += O.CodeBytes;
+				Modules += O.Modules;
+				MMaps += O.MMaps;
+				MProtects += O.MProtects;
+		}
+};
+
+typedef std::chrono::steady_clock StatsClock;
+
+extern ItemStats CurItem; // being processed
+extern std::vector<ItemStats> Items; // done
+
+void enterPhase(Phase P);
+void leavePhase();
+
+// Charges the enclosing scope to a phase; does nothing with stats off
+class TimePhase {
+		public:
+				TimePhase(Phase P) {
+						if (Stats) {
+								enterPhase(P);
+						}
+				}
+				~TimePhase() {
+						if (Stats) {
+								leavePhase();
+						}
+				}
+};
+
+void beginItem(const JITStats& JS);
+void endItem(const char *Kind, const JITStats& JS);
+
+// -- Profiling Runtime --
+
+// With CompilerOptions::Profile, every definition calls __kprof_enter(C) on
+// entry and __kprof_exit(C) before returning, C being the function's own
+// counters (its address is baked into the code, so there is no lookup).
+// Counters are shared between threads and updated atomically; the call stack
+// is per thread. The JIT must define both hooks as ProfileEnter/ProfileExit.
+
+static inline uint64_t ReadCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+struct ProfileCounters {
+	unsigned Id; // dense, indexes the per-thread recursion depths
+	std::string Name;
+	std::atomic<uint64_t> Calls{0};
+	std::atomic<uint64_t> SelfCycles{0};
+	std::atomic<uint64_t> InclusiveCycles{0}; // outermost activations only, so recursion is not counted twice
+};
+
+extern std::vector<std::unique_ptr<ProfileCounters>> ProfiledFunctions;
+
+void ProfileEnter(ProfileCounters *C);
+void ProfileExit(ProfileCounters *C);
+
+// -- Compiler Session --
+
+class CompilerSession;
+
+// A clone of a function for one set of constant arguments. If the body folded
+// away completely there is no code, and calls are replaced by Value
+struct Specialization {
+	std::string Name;
+	double Value;
+	// The function and everything folded, cloned or inlined into the clone,
+	// and into those: it is stale once any of them is redefined
+	std::set<std::string> Specialized;
+};
+
+// An array in generated code: a double * and an i64 count of elements
+struct ArrayValue {
+	Value *Data;
+	Value *Length;
+};
+
+// Code that allocates arrays in the arena (ArrayArena.h) is bracketed by
+// __karena_enter and __karena_leave: a function, from its entry block, or
+// one iteration of a parallel for body, from the top of the loop
+struct ArenaScope {
+	BasicBlock *Start = nullptr;
+	bool Used = false; // something was allocated
+};
+
+// A binary operator whose right operand is still being parsed
+struct PendingOperator {
+	std::unique_ptr<ExprAST> LHS;
+	int Op;
+	int Precedence;
+};
+
+// With CompilerOptions::Watch, what the code of a compiled function (a
+// definition, or a clone of one) was built from. Calls to a definition go
+// through its stub, so only a new signature makes its callers stale; a clone
+// is called directly, and code with a callee's body folded or cloned into it
+// goes stale with that body.
+struct CompiledFunction {
+	size_t Hash = 0; // of the definition as parsed, see DefinitionHash; none for clones
+	std::string Signature; // kinds of parameters, e.g. "(#,[])"
+	bool Clone = false;
+	std::set<std::string> Calls; // by the callee's symbol
+	std::set<std::string> Inlined; // callees specialized into this code
+	ResourceTrackerSP RT; // its code
+};
+
+// What CompilerSession::Reload did with the definitions of a program
+struct ReloadReport {
+	unsigned Reused = 0; // code kept from before
+	unsigned Rebuilt = 0; // compiled: new, changed, or stale dependents
+	unsigned Dependents = 0; // rebuilt only because what they inlined or call changed
+	unsigned Removed = 0; // gone from the program
+};
+
+// Compiled top-level expressions by shape, least recently used first out.
+// Each entry owns the resource tracker of its module, so eviction frees the code.
+class CompiledExprCache {
+	public:
+		typedef FunctionHandle<double(const double *Literals)> Thunk;
+
+		CompiledExprCache(CompilerSession& S, unsigned Capacity): S(S), Capacity(Capacity) {}
+
+		// A thunk that is not evicted while the Ref is alive, so it can be
+		// run on another thread while the cache moves on. With --executors
+		// the code is in the executors, and remote() is what to run there.
+		class Ref {
+			public:
+				Ref() = default;
+				Ref(Thunk Fn, RemoteExpr *Remote, std::atomic<unsigned> *Pins)
+						: Fn(Fn), Remote(Remote), Pins(Pins) {
+						Pins->fetch_add(1);
+				}
+				Ref(Ref&& Other) : Fn(Other.Fn), Remote(Other.Remote), Pins(Other.Pins) {
+						Other.Pins = nullptr;
+				}
+				Ref& operator=(Ref&& Other) {
+						release();
+						Fn = Other.Fn;
+						Remote = Other.Remote;
+						Pins = Other.Pins;
+						Other.Pins = nullptr;
+						return *this;
+				}
+				~Ref() { release(); }
+
+				explicit operator bool() const { return Pins != nullptr; }
+				double operator()(const double *Literals) const { return Fn(Literals); }
+				RemoteExpr *remote() const { return Pins ? Remote : nullptr; }
+
+				void release() {
+						if (Pins) {
+								Pins->fetch_sub(1);
+								Pins = nullptr;
+						}
+				}
+
+			private:
+				Thunk Fn;
+				RemoteExpr *Remote = nullptr;
+				std::atomic<unsigned> *Pins = nullptr;
+		};
+
+		unsigned Hits = 0, Misses = 0, Evictions = 0;
+
+		Ref lookup(const std::string& Shape) {
+				auto it = Index.find(Shape);
+				if (it != Index.end() && !it->second->Remote && !it->second->Fn) {
+						retire(it->second); // code was removed behind our back
+						it = Index.end();
+				}
+				if (it == Index.end()) {
+						Misses++;
+						return Ref();
+				}
+				Hits++;
+				Entries.splice(Entries.begin(), Entries, it->second);
+				return Ref(it->second->Fn, it->second->Remote.get(), &it->second->Pins);
+		}
+
+		// Code in this process under RT, or in the executors as Remote
+		Ref insert(const std::string& Shape, const std::string& Name, Thunk Fn,
+						ResourceTrackerSP RT, std::unique_ptr<RemoteExpr> Remote,
+						std::set<std::string> Callees) {
+				Entries.emplace_front(Shape, Name, Fn, std::move(RT), std::move(Remote),
+								std::move(Callees));
+				Index[Shape] = Entries.begin();
+				Ref Pinned(Fn, Entries.front().Remote.get(), &Entries.front().Pins);
+				// Least recently used first, skipping thunks that are still
+				// queued to run; those go on a later insert once they are done
+				for (auto it = Entries.end(); it != Entries.begin(); ) {
+						--it;
+						if (it->Pins == 0 && (it->Stale || Entries.size() > Capacity)) {
+								it = evict(it);
+						}
+				}
+				return Pinned;
+		}
+
+		size_t size() const { return Entries.size(); }
+
+		// Drop expressions that were compiled against a definition of Callee
+		void invalidate(const std::string& Callee) {
+				for (auto it = Entries.begin(); it != Entries.end(); ) {
+						auto next = std::next(it);
+						if (it->Callees.count(Callee)) {
+								retire(it);
+						}
+						it = next;
+				}
+		}
+
+	private:
+		struct Entry {
+				Entry(std::string Shape, std::string Name, Thunk Fn, ResourceTrackerSP RT,
+								std::unique_ptr<RemoteExpr> Remote, std::set<std::string> Callees)
+						: Shape(std::move(Shape)), Name(std::move(Name)), Fn(Fn), RT(std::move(RT)),
+						  Remote(std::move(Remote)), Callees(std::move(Callees)) {}
+
+				std::string Shape;
+				std::string Name;
+				Thunk Fn;
+				ResourceTrackerSP RT;
+				std::unique_ptr<RemoteExpr> Remote;
+				std::set<std::string> Callees;
+				std::atomic<unsigned> Pins{0}; // Refs still around
+				bool Stale = false; // not in Index anymore, evict once unpinned
+		};
+
+		CompilerSession& S;
+		unsigned Capacity;
+		std::list<Entry> Entries; // most recently used first
+		std::unordered_map<std::string, std::list<Entry>::iterator> Index;
+
+		std::list<Entry>::iterator evict(std::list<Entry>::iterator it);
+
+		// Never hand this entry out again; evict it now unless it is pinned
+		void retire(std::list<Entry>::iterator it) {
+				if (it->Pins == 0) {
+						evict(it);
+						return;
+				}
+				if (!it->Stale) {
+						Index.erase(it->Shape);
+						it->Stale = true;
+				}
+				Entries.splice(Entries.end(), Entries, it);
+		}
+};
+
+// A top level expression ready to run: folded to a constant already, or
+// compiled code and the literals to call it with
+struct PreparedExpr {
+	Optional<double> Folded;
+	CompiledExprCache::Ref Cached;
+	std::vector<double> Literals;
+	FunctionHandle<double()> Fn; // not cached, runs once
+	ResourceTrackerSP RT; // removed once Fn has run
+};
+
+// Everything one program needs while it is compiled and run: lexer and parser
+// state, the module being built, the JIT holding what was built so far, and
+// the front end's caches. A process can host any number of sessions; each is
+// used by one thread at a time (or, with --stream, by one thread per stage).
+class CompilerSession {
+	public:
+		// Point Lex at the program before the first getNextToken()
+		CompilerSession(std::unique_ptr<KaleidoscopeJIT> JIT, const CompilerOptions& Opts);
+		~CompilerSession();
+
+		CompilerOptions Opts;
+
+		// Every error, as a one line message; dropped if not set. With
+		// --stream this is called from the parser and executor threads too.
+		std::function<void(const std::string&)> OnError;
+		raw_ostream *Echo = nullptr; // IR of what gets compiled, and progress notes
+
+		// Lexer and parser
+		Lexer Lex;
+		int CurTok;
+		// By character. With --stream the parser thread reads it and the
+		// compiler thread undoes the operator of a definition that failed.
+		std::atomic<OperatorInfo> Operators[256];
+		OperatorInfo operatorOf(int Tok) {
+				return Tok > 0 && Tok < 256 ? Operators[Tok].load(std::memory_order_relaxed) : OperatorInfo();
+		}
+		void UndoOperator(const OperatorChange& Change);
+		std::vector<PendingOperator> OpStack; // of every ParseExpression in progress
+
+		// Code generator
+		std::unique_ptr<LLVMContext> TheContext; 
+		std::unique_ptr<Module> TheModule; // to hold blocks, definitions? (TODO), TODO: why does this have to be a pointer?
+		std::unique_ptr<IRBuilder<>> Builder; // for creating instructions, constants, etc
+		std::unique_ptr<legacy::FunctionPassManager> TheFPM; // Function pass manager
+		std::unordered_map<std::string, Value *> Symbols; // Maps names inside function context to LLVM "values"
+		std::unordered_map<std::string, ArrayValue> ArraySymbols; // Array parameters, which are not in Symbols
+		ArenaScope Arena; // of the code being generated
+		std::unique_ptr<KaleidoscopeJIT> TheJIT; // JIT engine for Kaleidoscope
+		std::unique_ptr<ExecutorPool> Pool; // if set, code is run there, not in TheJIT
+		std::unordered_map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos; // Function Name -> PrototypeAST Node map
+		std::unordered_set<std::string> ExternFunctions; // Names bound to the host process (not redefined with `def`)
+
+		// Definitions that compiled, kept (body only, the prototype lives in
+		// FunctionProtos) so they can be cloned with constant arguments
+		std::unordered_map<std::string, std::unique_ptr<FunctionAST>> FunctionDefs;
+		std::map<std::string, Specialization> Specializations; // "callee(bound args)" -> clone
+		std::unordered_map<std::string, unsigned> SpecializationCount; // live clones made per function
+		unsigned NextClone = 0; // names clones; a name is never reused, its code may still be there
+
+		std::unique_ptr<CompiledExprCache> ExprCache; // after TheJIT and Pool: holds their code
+		unsigned NextExpr = 0; // names cached top level expressions
+
+		// With Opts.Watch: the call graph, by symbol, and the version of a
+		// definition's body compiled next (its symbol is "name.vN")
+		std::map<std::string, CompiledFunction> CallGraph;
+		unsigned NextVersion = 0;
+
+		std::unique_ptr<ExprAST> LogError(const char *Str);
+		std::unique_ptr<PrototypeAST> LogErrorP(const char *Str);
+		Value *LogErrorV(const char *Str);
+		void reportError(Error Err);
+
+		void print_tok(raw_ostream& OS);
+		int getNextToken();
+
+		std::unique_ptr<ExprAST> ParseNumberExpr();
+		std::unique_ptr<ExprAST> ParseParenExpr();
+		std::unique_ptr<ExprAST> ParseIdentifierExpr();
+		std::unique_ptr<ExprAST> ParseParallelExpr();
+		std::unique_ptr<ExprAST> ParseIndexExpr(std::unique_ptr<ExprAST> Array);
+		std::unique_ptr<ExprAST> ParsePrimary();
+		std::unique_ptr<ExprAST> ParseUnary();
+		int getTokPrecedence();
+		std::unique_ptr<ExprAST> ParseExpression();
+		std::unique_ptr<ExprAST> MakeBinary(int Op, std::unique_ptr<ExprAST> LHS, std::unique_ptr<ExprAST> RHS);
+		std::unique_ptr<PrototypeAST> ParsePrototype();
+		std::unique_ptr<FunctionAST> ParseDefinition();
+		std::unique_ptr<PrototypeAST> ParseExtern();
+		std::unique_ptr<FunctionAST> ParseTopLevelExpr();
+		std::string ParseCommand();
+		std::string ParseLoad();
+
+		void InitializeModuleAndPassManager();
+		Function *getOrCreateFunction(const std::string& Name);
+		void EmitProfileCall(const char *Hook, ProfileCounters *C);
+		void CloseArenaScope();
+		bool CommitModule(ResourceTrackerSP RT = nullptr);
+		void InvalidateSpecializations(const std::string& Callee);
+
+		Optional<PreparedExpr> PrepareCached(FunctionAST& tle);
+		Optional<PreparedExpr> PrepareTopLevel(std::unique_ptr<FunctionAST> tle);
+		double RunPrepared(PreparedExpr& E);
+		double resultOf(Expected<double> Value);
+		bool CompileDefinition(std::unique_ptr<FunctionAST> def);
+		bool CompileExtern(std::unique_ptr<PrototypeAST> extn);
+		bool LoadLibrary(const std::string& Path);
+		void DropCompiled(const std::string& Name);
+
+		// With Opts.Watch: compile Source, the whole program, again, keeping
+		// the code of definitions that neither changed nor depend on one that
+		// did. Every top level expression runs again; Results gets their
+		// values, NaN for ones that did not compile.
+		ReloadReport Reload(StringRef Source, std::vector<double>& Results);
+
+		// Parse and compile the item at CurTok; an expression is also run
+		void HandleDefinition();
+		void HandleExtern();
+		void HandleLoad();
+		Optional<double> HandleTopLevelExpression();
+};
+
+#endif // KALEIDOSCOPE_COMPILERSESSION_H
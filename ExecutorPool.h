@@ -0,0 +1,481 @@
+//===- ExecutorPool.h - Running JIT'd code in executor processes -*- C++ -*-===//
+//
+// Runs JIT'd code in kaleidoscope-executor processes instead of the
+// compiler's own, over ORC's simple remote executor protocol on a pair of
+// pipes each. Code is compiled to objects once, here; definitions are linked
+// into every executor, and an expression into whichever executor runs it
+// first, in memory the executor allocates. A crash only takes down its
+// executor: the expressions running there fail, and later ones go to the
+// executors that are left.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KALEIDOSCOPE_EXECUTORPOOL_H
+#define KALEIDOSCOPE_EXECUTORPOOL_H
+
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/EPCDynamicLibrarySearchGenerator.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/Mangling.h"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/Orc/Shared/OrcRTBridge.h"
+#include "llvm/ExecutionEngine/Orc/Shared/SimpleRemoteEPCUtils.h"
+#include "llvm/ExecutionEngine/Orc/SimpleRemoteEPC.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Process.h"
+#include <atomic>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <future>
+#include <memory>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+namespace llvm {
+namespace orc {
+
+// RuntimeDyld memory for one object, in an executor: sections are laid out in
+// local buffers and mapped to a block the executor reserves, then copied
+// there with their final protections in one call. The executor frees the
+// block when the object is removed. (EPCGenericRTDyldMemoryManager does the
+// same, but logs to errs() on every deallocation.) Unwind info is not
+// registered: Kaleidoscope code throws nothing.
+class RemoteMemoryManager : public RuntimeDyld::MemoryManager {
+public:
+  struct SymbolAddrs {
+    ExecutorAddr Instance, Reserve, Finalize, Deallocate;
+  };
+
+  static Error lookupSymbolAddrs(ExecutorProcessControl &EPC,
+                                 SymbolAddrs &SAs) {
+    return EPC.getBootstrapSymbols(
+        {{SAs.Instance, rt::SimpleExecutorMemoryManagerInstanceName},
+         {SAs.Reserve, rt::SimpleExecutorMemoryManagerReserveWrapperName},
+         {SAs.Finalize, rt::SimpleExecutorMemoryManagerFinalizeWrapperName},
+         {SAs.Deallocate,
+          rt::SimpleExecutorMemoryManagerDeallocateWrapperName}});
+  }
+
+  RemoteMemoryManager(ExecutorProcessControl &EPC, const SymbolAddrs &SAs)
+      : EPC(EPC), SAs(SAs) {}
+
+  ~RemoteMemoryManager() override {
+    if (!Base)
+      return;
+    // Nowhere to report to from here; if the executor is gone, so is the
+    // memory
+    Error Err = Error::success();
+    if (auto CallErr = EPC.callSPSWrapper<
+                       rt::SPSSimpleExecutorMemoryManagerDeallocateSignature>(
+            SAs.Deallocate, Err, SAs.Instance, std::vector<ExecutorAddr>{Base}))
+      consumeError(std::move(CallErr));
+    consumeError(std::move(Err));
+  }
+
+  uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment, unsigned,
+                               StringRef) override {
+    return allocate(Code, Size, Alignment);
+  }
+
+  uint8_t *allocateDataSection(uintptr_t Size, unsigned Alignment, unsigned,
+                               StringRef, bool IsReadOnly) override {
+    return allocate(IsReadOnly ? ROData : RWData, Size, Alignment);
+  }
+
+  void registerEHFrames(uint8_t *, uint64_t, size_t) override {}
+  void deregisterEHFrames() override {}
+
+  // Reserve the block and tell Dyld where each section will be
+  void notifyObjectLoaded(RuntimeDyld &Dyld,
+                          const object::ObjectFile &) override {
+    uint64_t PageSize = sys::Process::getPageSizeEstimate();
+    uint64_t Size = 0;
+    for (auto &Seg : Segments) {
+      Seg.Offset = Size;
+      for (auto &Sec : Seg.Sections) {
+        Seg.Size = alignTo(Seg.Size, Sec.Alignment);
+        Sec.Offset = Seg.Size;
+        Seg.Size += Sec.Size;
+      }
+      Size += alignTo(Seg.Size, PageSize);
+    }
+
+    Expected<ExecutorAddr> Reserved((ExecutorAddr()));
+    if (auto Err = EPC.callSPSWrapper<
+                   rt::SPSSimpleExecutorMemoryManagerReserveSignature>(
+            SAs.Reserve, Reserved, SAs.Instance, Size)) {
+      ErrMsg = toString(std::move(Err));
+      return;
+    }
+    if (!Reserved) {
+      ErrMsg = toString(Reserved.takeError());
+      return;
+    }
+    Base = *Reserved;
+
+    for (auto &Seg : Segments)
+      for (auto &Sec : Seg.Sections)
+        Dyld.mapSectionAddress(Sec.Local.get(),
+                               (Base + Seg.Offset + Sec.Offset).getValue());
+  }
+
+  // Copy the relocated sections over and protect them
+  bool finalizeMemory(std::string *Msg) override {
+    if (ErrMsg.empty() && !Base)
+      ErrMsg = "no memory was reserved for the object";
+    if (!ErrMsg.empty()) {
+      if (Msg)
+        *Msg = ErrMsg;
+      return true;
+    }
+
+    tpctypes::FinalizeRequest FR;
+    std::vector<std::vector<char>> Contents;
+    for (auto &Seg : Segments) {
+      if (Seg.Sections.empty())
+        continue;
+      Contents.emplace_back(Seg.Size);
+      for (auto &Sec : Seg.Sections)
+        memcpy(Contents.back().data() + Sec.Offset, Sec.Local.get(), Sec.Size);
+      FR.Segments.push_back({Seg.Prot, Base + Seg.Offset, Seg.Size,
+                             ArrayRef<char>(Contents.back())});
+    }
+
+    Error Err = Error::success();
+    if (auto CallErr = EPC.callSPSWrapper<
+                       rt::SPSSimpleExecutorMemoryManagerFinalizeSignature>(
+            SAs.Finalize, Err, SAs.Instance, std::move(FR)))
+      Err = joinErrors(std::move(CallErr), std::move(Err));
+    if (Err) {
+      if (Msg)
+        *Msg = toString(std::move(Err));
+      else
+        consumeError(std::move(Err));
+      return true;
+    }
+    return false;
+  }
+
+private:
+  struct Section {
+    std::unique_ptr<uint8_t[]> Local;
+    uint64_t Size, Alignment, Offset = 0;
+  };
+
+  struct Segment {
+    tpctypes::WireProtectionFlags Prot;
+    std::vector<Section> Sections;
+    uint64_t Offset = 0, Size = 0;
+  };
+
+  enum { Code, ROData, RWData };
+
+  ExecutorProcessControl &EPC;
+  SymbolAddrs SAs;
+  Segment Segments[3] = {
+      {tpctypes::WPF_Read | tpctypes::WPF_Exec, {}},
+      {tpctypes::WPF_Read, {}},
+      {tpctypes::WPF_Read | tpctypes::WPF_Write, {}}};
+  ExecutorAddr Base;
+  std::string ErrMsg;
+
+  uint8_t *allocate(unsigned Seg, uintptr_t Size, unsigned Alignment) {
+    Section Sec;
+    Sec.Local.reset(new uint8_t[std::max<uintptr_t>(Size, 1)]());
+    Sec.Size = Size;
+    Sec.Alignment = std::max(Alignment, 1u);
+    Segments[Seg].Sections.push_back(std::move(Sec));
+    return Segments[Seg].Sections.back().Local.get();
+  }
+};
+
+// A top level expression compiled to an object, linked into each executor
+// the first time it runs there
+class RemoteExpr {
+public:
+  RemoteExpr(std::unique_ptr<MemoryBuffer> Obj, std::string Wrapper,
+             unsigned Executors)
+      : Obj(std::move(Obj)), Wrapper(std::move(Wrapper)), Linked(Executors) {}
+
+private:
+  friend class ExecutorPool;
+
+  struct Link {
+    ResourceTrackerSP RT;
+    ExecutorAddr Fn;
+  };
+
+  std::unique_ptr<MemoryBuffer> Obj;
+  std::string Wrapper; // double-returning ORC wrapper function, see run()
+  std::vector<Link> Linked; // by executor
+};
+
+class ExecutorPool {
+public:
+  // Starts N executors from ExecutorPath
+  static Expected<std::unique_ptr<ExecutorPool>>
+  Create(StringRef ExecutorPath, unsigned N, JITTargetMachineBuilder JTMB) {
+    // Writing to an executor that died must fail, not kill us
+    signal(SIGPIPE, SIG_IGN);
+
+    auto DL = JTMB.getDefaultDataLayoutForTarget();
+    if (!DL)
+      return DL.takeError();
+
+    std::unique_ptr<ExecutorPool> Pool(
+        new ExecutorPool(std::move(JTMB), std::move(*DL)));
+    for (unsigned I = 0; I < N; I++) {
+      auto X = Pool->launch(ExecutorPath);
+      if (!X)
+        return X.takeError();
+      Pool->Executors.push_back(std::move(*X));
+    }
+    return std::move(Pool);
+  }
+
+  ~ExecutorPool() {
+    OnError = nullptr; // whoever set it may be going away too
+    for (auto &X : Executors) {
+      if (auto Err = X->ES->endSession())
+        consumeError(std::move(Err)); // the executor is gone either way
+      X->ObjLayer.reset();
+      X->ES.reset();
+      waitpid(X->Pid, nullptr, 0);
+    }
+  }
+
+  // Told about errors of the executors that no call returns, such as one of
+  // them disconnecting
+  std::function<void(Error)> OnError;
+
+  unsigned size() const { return Executors.size(); }
+
+  // Compiles M and links it into every executor, for good
+  Error addModule(Module &M) {
+    auto Obj = Compile(M);
+    if (!Obj)
+      return Obj.takeError();
+    for (auto &X : Executors) {
+      if (X->Dead)
+        continue;
+      if (auto Err = X->ObjLayer->add(
+              *X->JD, MemoryBuffer::getMemBufferCopy(
+                          (*Obj)->getBuffer(), (*Obj)->getBufferIdentifier())))
+        return Err;
+    }
+    return Error::success();
+  }
+
+  // Compiles M, which defines the wrapper function named Wrapper, to run()
+  // later
+  Expected<std::unique_ptr<RemoteExpr>> addExpression(Module &M,
+                                                      StringRef Wrapper) {
+    auto Obj = Compile(M);
+    if (!Obj)
+      return Obj.takeError();
+    return std::make_unique<RemoteExpr>(std::move(*Obj), Wrapper.str(),
+                                        Executors.size());
+  }
+
+  // Unlinks E from the executors that ran it
+  Error remove(RemoteExpr &E) {
+    Error Err = Error::success();
+    for (unsigned I = 0; I < E.Linked.size(); I++) {
+      auto &L = E.Linked[I];
+      if (L.RT && !Executors[I]->Dead)
+        Err = joinErrors(std::move(Err), L.RT->remove());
+      L.RT = nullptr;
+    }
+    return Err;
+  }
+
+  // Calls the wrapper of E with Args on the least busy executor that is
+  // alive. The wrapper has the C ABI of an ORC wrapper function and returns
+  // the double inline: {i64, i64} Wrapper(i8 *Args, i64 Size), where the
+  // result is {bits, 8}. E must stay alive until the future is ready. Only
+  // one thread at a time may call this.
+  std::future<Expected<double>> run(RemoteExpr &E, ArrayRef<double> Args) {
+    std::promise<Expected<double>> Result;
+    auto Value = Result.get_future();
+
+    int I = pick();
+    if (I < 0) {
+      Result.set_value(createStringError(inconvertibleErrorCode(),
+                                         "every executor has died"));
+      return Value;
+    }
+    Executor &X = *Executors[I];
+
+    auto &L = E.Linked[I];
+    if (!L.RT) {
+      auto Fn = link(X, E);
+      if (!Fn) {
+        Result.set_value(Fn.takeError());
+        return Value;
+      }
+      L = std::move(*Fn);
+    }
+
+    X.InFlight++;
+    X.ES->getExecutorProcessControl().callWrapperAsync(
+        ExecutorProcessControl::RunInPlace(), L.Fn,
+        [&X, I, Result = std::move(Result)](
+            shared::WrapperFunctionResult R) mutable {
+          if (const char *Msg = R.getOutOfBandError()) {
+            // Only the transport fails calls: the executor is gone. Dead
+            // before idle, so that pick() never sees it idle and alive.
+            X.Dead = true;
+            X.InFlight--;
+            Result.set_value(createStringError(inconvertibleErrorCode(),
+                                               "executor %d: %s", I, Msg));
+            return;
+          }
+          X.InFlight--;
+          if (R.size() != sizeof(double)) {
+            Result.set_value(createStringError(
+                inconvertibleErrorCode(),
+                "executor %d: expected a double, got %zu bytes", I, R.size()));
+            return;
+          }
+          double V;
+          memcpy(&V, R.data(), sizeof(V));
+          Result.set_value(V);
+        },
+        ArrayRef<char>(reinterpret_cast<const char *>(Args.data()),
+                       Args.size() * sizeof(double)));
+    return Value;
+  }
+
+private:
+  struct Executor {
+    pid_t Pid;
+    std::unique_ptr<ExecutionSession> ES;
+    std::unique_ptr<RTDyldObjectLinkingLayer> ObjLayer;
+    JITDylib *JD = nullptr;
+    std::atomic<unsigned> InFlight{0};
+    std::atomic<bool> Dead{false};
+  };
+
+  ConcurrentIRCompiler Compile;
+  DataLayout DL;
+  std::vector<std::unique_ptr<Executor>> Executors;
+  unsigned Next = 0; // where the search for the least busy one starts
+
+  ExecutorPool(JITTargetMachineBuilder JTMB, DataLayout DL)
+      : Compile(std::move(JTMB)), DL(std::move(DL)) {}
+
+  static Error errnoError(const char *What) {
+    return createStringError(std::error_code(errno, std::generic_category()),
+                             "%s: %s", What, strerror(errno));
+  }
+
+  Expected<std::unique_ptr<Executor>> launch(StringRef Path) {
+    // Close-on-exec, so that executors do not hold each other's pipes open
+    int ToExecutor[2], FromExecutor[2];
+    if (pipe2(ToExecutor, O_CLOEXEC) < 0)
+      return errnoError("pipe");
+    if (pipe2(FromExecutor, O_CLOEXEC) < 0) {
+      close(ToExecutor[0]);
+      close(ToExecutor[1]);
+      return errnoError("pipe");
+    }
+
+    // Everything the child needs, made before forking
+    std::string Exe = Path.str();
+    std::string InFD = std::to_string(ToExecutor[0]);
+    std::string OutFD = std::to_string(FromExecutor[1]);
+
+    pid_t Pid = fork();
+    if (Pid < 0)
+      return errnoError("fork");
+    if (Pid == 0) {
+      // Keep our ends across exec; stdin and stdout are the compiler's
+      fcntl(ToExecutor[0], F_SETFD, 0);
+      fcntl(FromExecutor[1], F_SETFD, 0);
+      int Null = open("/dev/null", O_RDONLY);
+      dup2(Null, STDIN_FILENO);
+      dup2(STDERR_FILENO, STDOUT_FILENO);
+      execl(Exe.c_str(), Exe.c_str(), InFD.c_str(), OutFD.c_str(), nullptr);
+      static const char Msg[] = "kaleidoscope: cannot run the executor\n";
+      ssize_t Written = write(STDERR_FILENO, Msg, sizeof(Msg) - 1);
+      (void)Written;
+      _exit(127);
+    }
+    close(ToExecutor[0]);
+    close(FromExecutor[1]);
+
+    auto X = std::make_unique<Executor>();
+    X->Pid = Pid;
+    auto EPC = SimpleRemoteEPC::Create<FDSimpleRemoteEPCTransport>(
+        std::make_unique<DynamicThreadPoolTaskDispatcher>(),
+        SimpleRemoteEPC::Setup(), FromExecutor[0], ToExecutor[1]);
+    if (!EPC) {
+      waitpid(Pid, nullptr, 0);
+      return EPC.takeError();
+    }
+    X->ES = std::make_unique<ExecutionSession>(std::move(*EPC));
+    X->ES->setErrorReporter([this](Error Err) {
+      if (OnError)
+        OnError(std::move(Err));
+      else
+        consumeError(std::move(Err));
+    });
+    auto &RemoteEPC = X->ES->getExecutorProcessControl();
+
+    RemoteMemoryManager::SymbolAddrs SAs;
+    if (auto Err = RemoteMemoryManager::lookupSymbolAddrs(RemoteEPC, SAs))
+      return std::move(Err);
+    X->ObjLayer = std::make_unique<RTDyldObjectLinkingLayer>(
+        *X->ES, [&RemoteEPC, SAs]() {
+          return std::make_unique<RemoteMemoryManager>(RemoteEPC, SAs);
+        });
+
+    // Externs resolve to the executor's own libm and friends
+    X->JD = &X->ES->createBareJITDylib("<main>");
+    auto Gen = EPCDynamicLibrarySearchGenerator::GetForTargetProcess(*X->ES);
+    if (!Gen)
+      return Gen.takeError();
+    X->JD->addGenerator(std::move(*Gen));
+    return std::move(X);
+  }
+
+  int pick() {
+    int Best = -1;
+    for (unsigned N = 0; N < Executors.size(); N++) {
+      unsigned I = (Next + N) % Executors.size();
+      if (Executors[I]->Dead)
+        continue;
+      if (Best < 0 || Executors[I]->InFlight < Executors[Best]->InFlight)
+        Best = I;
+    }
+    Next++;
+    return Best;
+  }
+
+  Expected<RemoteExpr::Link> link(Executor &X, RemoteExpr &E) {
+    RemoteExpr::Link L;
+    L.RT = X.JD->createResourceTracker();
+    if (auto Err = X.ObjLayer->add(
+            L.RT, MemoryBuffer::getMemBuffer(E.Obj->getMemBufferRef(), false)))
+      return std::move(Err);
+    MangleAndInterner Mangle(*X.ES, DL);
+    auto Sym = X.ES->lookup({X.JD}, Mangle(E.Wrapper));
+    if (!Sym) {
+      if (auto Err = L.RT->remove())
+        return joinErrors(Sym.takeError(), std::move(Err));
+      return Sym.takeError();
+    }
+    L.Fn = ExecutorAddr(Sym->getAddress());
+    return std::move(L);
+  }
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // KALEIDOSCOPE_EXECUTORPOOL_H
@@ -0,0 +1,57 @@
+//===- FunctionHandle.h - Callable handles to JIT'd functions ---*- C++ -*-===//
+//
+// What a JIT'd function is handed out as: a typed wrapper around its
+// address, which the JIT clears when the code goes away. Kept apart from
+// KaleidoscopeJIT.h so that code only calling functions needs no ORC headers.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KALEIDOSCOPE_FUNCTIONHANDLE_H
+#define KALEIDOSCOPE_FUNCTIONHANDLE_H
+
+#include "llvm/ExecutionEngine/JITSymbol.h"
+#include <atomic>
+#include <cassert>
+#include <memory>
+
+namespace llvm {
+namespace orc {
+
+// Address of a JIT'd function, shared by every handle to it. Cleared (set to
+// 0) when the module that defined the function is removed.
+using EntryPointSlot = std::atomic<JITTargetAddress>;
+
+// A resolved JIT'd function that can be called directly as Sig, e.g.
+// FunctionHandle<double(double, double)>. The signature is not checked
+// against the IR; every Kaleidoscope function is double(double...), with
+// (const double *, int64_t) in place of each array parameter.
+template <typename Sig> class FunctionHandle;
+
+template <typename RetT, typename... ArgTs>
+class FunctionHandle<RetT(ArgTs...)> {
+public:
+  FunctionHandle() = default;
+  explicit FunctionHandle(std::shared_ptr<const EntryPointSlot> Slot)
+      : Slot(std::move(Slot)) {}
+
+  // False once the function has been redefined or its module removed
+  bool valid() const {
+    return Slot && Slot->load(std::memory_order_acquire) != 0;
+  }
+  explicit operator bool() const { return valid(); }
+
+  RetT operator()(ArgTs... Args) const {
+    assert(valid() && "calling a function whose definition was removed");
+    auto *Fn = jitTargetAddressToFunction<RetT (*)(ArgTs...)>(
+        Slot->load(std::memory_order_acquire));
+    return Fn(Args...);
+  }
+
+private:
+  std::shared_ptr<const EntryPointSlot> Slot;
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // KALEIDOSCOPE_FUNCTIONHANDLE_H
@@ -0,0 +1,128 @@
+//===- HostLibrary.h - Shared libraries bound ahead of time -----*- C++ -*-===//
+//
+// A shared library dlopen'ed into this process once, with the addresses of
+// everything it exports, for `--lib` and the `load` directive. A JIT defines
+// the exports as absolute symbols (KaleidoscopeJIT::addHostLibrary), so
+// calls into the library resolve through a symbol table lookup instead of a
+// dlsym over the whole process for each new name.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KALEIDOSCOPE_HOSTLIBRARY_H
+#define KALEIDOSCOPE_HOSTLIBRARY_H
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/Object/ELFObjectFile.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/Error.h"
+#include <dlfcn.h>
+#include <link.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace llvm {
+namespace orc {
+
+class HostLibrary {
+public:
+  struct Export {
+    std::string Name;
+    JITEvaluatedSymbol Sym;
+  };
+
+  // Path is passed to dlopen as is, so "libm.so.6" is found the usual way.
+  // Libraries are loaded and scanned once per process and never unloaded:
+  // JIT'd code may call into them for as long as the process lives.
+  static Expected<std::shared_ptr<const HostLibrary>> open(StringRef Path) {
+    static std::mutex M;
+    static StringMap<std::shared_ptr<const HostLibrary>> Loaded;
+
+    std::lock_guard<std::mutex> Lock(M);
+    auto &Lib = Loaded[Path];
+    if (Lib)
+      return Lib;
+
+    void *Handle = dlopen(Path.str().c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!Handle)
+      return createStringError(inconvertibleErrorCode(), "%s", dlerror());
+
+    auto L = std::make_shared<HostLibrary>();
+    if (auto Err = L->scan(Handle)) {
+      Loaded.erase(Path);
+      return std::move(Err);
+    }
+    Lib = std::move(L);
+    return Lib;
+  }
+
+  // The file dlopen picked
+  const std::string &getFileName() const { return FileName; }
+
+  // Functions and data the library defines, each name once
+  const std::vector<Export> &getExports() const { return Exports; }
+
+private:
+  // The dynamic symbol table says what there is; dlsym where it is, which
+  // resolves IFUNCs and picks the default of several symbol versions
+  Error scan(void *Handle) {
+    link_map *LM = nullptr;
+    if (dlinfo(Handle, RTLD_DI_LINKMAP, &LM) != 0 || !LM)
+      return createStringError(inconvertibleErrorCode(), "%s", dlerror());
+    FileName = LM->l_name;
+
+    auto Bin = object::ObjectFile::createObjectFile(FileName);
+    if (!Bin)
+      return Bin.takeError();
+    auto *Obj = dyn_cast<object::ELFObjectFileBase>(Bin->getBinary());
+    if (!Obj)
+      return createStringError(inconvertibleErrorCode(),
+                               "%s is not an ELF shared library",
+                               FileName.c_str());
+
+    StringMap<bool> Seen;
+    for (auto &Sym : Obj->getDynamicSymbolIterators()) {
+      auto Flags = Sym.getFlags();
+      auto Name = Sym.getName();
+      if (!Flags || !Name) {
+        consumeError(Flags.takeError());
+        consumeError(Name.takeError());
+        continue;
+      }
+      if ((*Flags & object::SymbolRef::SF_Undefined) ||
+          !(*Flags & object::SymbolRef::SF_Exported) || Name->empty())
+        continue;
+
+      // <link.h> brings <elf.h>, whose macros shadow llvm::ELF's names
+      uint8_t Type = Sym.getELFType();
+      bool IsFunction = Type == STT_FUNC || Type == STT_GNU_IFUNC;
+      if (!IsFunction && Type != STT_OBJECT)
+        continue;
+      if (!Seen.insert({*Name, true}).second)
+        continue;
+
+      void *Addr = dlsym(Handle, Name->str().c_str());
+      if (!Addr)
+        continue;
+      JITSymbolFlags SymFlags = JITSymbolFlags::Exported;
+      if (IsFunction)
+        SymFlags |= JITSymbolFlags::Callable;
+      Exports.push_back(
+          {Name->str(),
+           JITEvaluatedSymbol(pointerToJITTargetAddress(Addr), SymFlags)});
+    }
+    return Error::success();
+  }
+
+  std::string FileName;
+  std::vector<Export> Exports;
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // KALEIDOSCOPE_HOSTLIBRARY_H
@@ -0,0 +1,440 @@
+//===- JITMemory.h - Memory for JIT'd code and data -------------*- C++ -*-===//
+//
+// Where the objects KaleidoscopeJIT links end up, for either linker:
+//
+//  - RuntimeDyld: a SectionMemoryManager per object, which maps pages for
+//    each of its section groups and mprotects them when the object is
+//    finalized. Counted through CountingMemoryMapper.
+//  - JITLink: one SlabMemoryManager per JIT, which carves objects out of
+//    shared slabs and maps nothing per object once a slab exists.
+//
+// Both keep JITStats up to date, including the system calls they make.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KALEIDOSCOPE_JITMEMORY_H
+#define KALEIDOSCOPE_JITMEMORY_H
+
+#include "llvm/ExecutionEngine/JITLink/JITLinkMemoryManager.h"
+#include "llvm/ExecutionEngine/Orc/Shared/AllocationActions.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/Memory.h"
+#include "llvm/Support/Process.h"
+#include <atomic>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace llvm {
+namespace orc {
+
+// Running totals of what the JIT has produced, and what of it is still
+// loaded (Live*: freed when the owning resource tracker is removed)
+struct JITStats {
+  std::atomic<uint64_t> ModulesMaterialized{0};
+  std::atomic<uint64_t> CodeBytes{0};
+  std::atomic<uint64_t> DataBytes{0};
+  std::atomic<uint64_t> LiveObjects{0};
+  std::atomic<uint64_t> LiveCodeBytes{0};
+  std::atomic<uint64_t> LiveDataBytes{0};
+
+  // Memory mapped for all of the above, and the calls that did it
+  std::atomic<uint64_t> MappedBytes{0};
+  std::atomic<uint64_t> MMaps{0};
+  std::atomic<uint64_t> MProtects{0};
+  std::atomic<uint64_t> MUnmaps{0};
+};
+
+// sys::Memory, counting; what SectionMemoryManagers map their pages with
+class CountingMemoryMapper : public SectionMemoryManager::MemoryMapper {
+public:
+  CountingMemoryMapper(JITStats &Stats) : Stats(Stats) {}
+
+  sys::MemoryBlock
+  allocateMappedMemory(SectionMemoryManager::AllocationPurpose Purpose,
+                       size_t NumBytes, const sys::MemoryBlock *const NearBlock,
+                       unsigned Flags, std::error_code &EC) override {
+    auto MB = sys::Memory::allocateMappedMemory(NumBytes, NearBlock, Flags, EC);
+    if (!EC) {
+      ++Stats.MMaps;
+      Stats.MappedBytes += MB.allocatedSize();
+    }
+    return MB;
+  }
+
+  std::error_code protectMappedMemory(const sys::MemoryBlock &Block,
+                                      unsigned Flags) override {
+    ++Stats.MProtects;
+    return sys::Memory::protectMappedMemory(Block, Flags);
+  }
+
+  std::error_code releaseMappedMemory(sys::MemoryBlock &M) override {
+    ++Stats.MUnmaps;
+    Stats.MappedBytes -= M.allocatedSize();
+    return sys::Memory::releaseMappedMemory(M);
+  }
+
+private:
+  JITStats &Stats;
+};
+
+// SectionMemoryManager that counts the bytes it is asked for. There is one
+// per loaded object; it lives (and holds the memory) until the object's
+// resource tracker is removed.
+class CountingMemoryManager : public SectionMemoryManager {
+public:
+  CountingMemoryManager(JITStats &Stats, CountingMemoryMapper &Mapper)
+      : SectionMemoryManager(&Mapper), Stats(Stats) {
+    ++Stats.LiveObjects;
+  }
+
+  ~CountingMemoryManager() override {
+    --Stats.LiveObjects;
+    Stats.LiveCodeBytes -= CodeBytes;
+    Stats.LiveDataBytes -= DataBytes;
+  }
+
+  uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID,
+                               StringRef SectionName) override {
+    CodeBytes += Size;
+    Stats.CodeBytes += Size;
+    Stats.LiveCodeBytes += Size;
+    return SectionMemoryManager::allocateCodeSection(Size, Alignment,
+                                                     SectionID, SectionName);
+  }
+
+  uint8_t *allocateDataSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID, StringRef SectionName,
+                               bool IsReadOnly) override {
+    DataBytes += Size;
+    Stats.DataBytes += Size;
+    Stats.LiveDataBytes += Size;
+    return SectionMemoryManager::allocateDataSection(
+        Size, Alignment, SectionID, SectionName, IsReadOnly);
+  }
+
+  uint64_t getCodeBytes() const { return CodeBytes; }
+  uint64_t getDataBytes() const { return DataBytes; }
+
+private:
+  JITStats &Stats;
+  uint64_t CodeBytes = 0;
+  uint64_t DataBytes = 0;
+};
+
+// JITLink memory for every object of one JIT, carved out of slabs that are
+// mapped once and never given back while the JIT lives. Code and read-only
+// data slabs are mapped twice from one memfd: JITLink writes through a
+// writable view, and the code runs from an executable (or read-only) one.
+// So permissions are set once per slab instead of being changed per object,
+// small objects share pages, and ranges freed by removing a resource tracker
+// go to the next objects that fit.
+//
+// Code is built for the small code model and reaches the data of its object
+// with PC32 relocations, so every slab is run from one region reserved up
+// front: all of it is within 2 GiB of the rest, whatever else the process
+// maps in between.
+class SlabMemoryManager : public jitlink::JITLinkMemoryManager {
+public:
+  static constexpr uint64_t SlabSize = 256 * 1024;
+  static constexpr uint64_t ReserveSize = uint64_t(1) << 30;
+
+  SlabMemoryManager(JITStats &Stats)
+      : Stats(Stats), PageSize(sys::Process::getPageSizeEstimate()) {}
+
+  ~SlabMemoryManager() override {
+    for (auto &P : Pools)
+      for (auto &S : P.Slabs)
+        if (S.Work != S.Exec)
+          munmap(S.Work, S.Size);
+    if (Reserved)
+      munmap(Reserved, ReserveSize);
+  }
+
+  void allocate(const jitlink::JITLinkDylib *JD, jitlink::LinkGraph &G,
+                OnAllocatedFunction OnAllocated) override {
+    jitlink::BasicLayout BL(G);
+
+    std::vector<Range> Ranges;
+    for (auto &KV : BL.segments()) {
+      auto &Seg = KV.second;
+      uint64_t Size = Seg.ContentSize + Seg.ZeroFillSize;
+      auto R = allocateRange(kindOf(KV.first.getMemProt()), Size,
+                             Seg.Alignment.value());
+      if (!R) {
+        releaseRanges(Ranges);
+        return OnAllocated(R.takeError());
+      }
+      Ranges.push_back(*R);
+      // Ranges are reused: zero-fill (and padding) must not show old code
+      memset(R->Work, 0, R->Size);
+      Seg.Addr = ExecutorAddr::fromPtr(R->Exec);
+      Seg.WorkingMem = R->Work;
+    }
+
+    if (auto Err = BL.apply()) {
+      releaseRanges(Ranges);
+      return OnAllocated(std::move(Err));
+    }
+
+    OnAllocated(std::make_unique<SlabInFlightAlloc>(
+        *this, std::move(Ranges), std::move(BL.graphAllocActions())));
+  }
+
+  void deallocate(std::vector<FinalizedAlloc> Allocs,
+                  OnDeallocatedFunction OnDeallocated) override {
+    Error Err = Error::success();
+    for (auto &A : Allocs) {
+      auto *Info = A.release().toPtr<FinalizedInfo *>();
+      Err = joinErrors(std::move(Err),
+                       shared::runDeallocActions(Info->DeallocActions));
+      noteLive(Info->Ranges, -1);
+      releaseRanges(Info->Ranges);
+      delete Info;
+    }
+    OnDeallocated(std::move(Err));
+  }
+
+private:
+  enum Kind { Code, ROData, RWData, NumKinds };
+
+  static Kind kindOf(jitlink::MemProt Prot) {
+    if ((Prot & jitlink::MemProt::Exec) != jitlink::MemProt::None)
+      return Code;
+    if ((Prot & jitlink::MemProt::Write) != jitlink::MemProt::None)
+      return RWData;
+    return ROData;
+  }
+
+  // Exec is where the range runs (or is read) from, Work where it is
+  // written; the same address for RWData
+  struct Range {
+    Kind K;
+    char *Exec;
+    char *Work;
+    uint64_t Size;
+  };
+
+  struct Slab {
+    char *Exec;
+    char *Work;
+    uint64_t Size;
+  };
+
+  struct FreeRange {
+    uint64_t Size;
+    unsigned Slab; // ranges of different slabs never merge
+  };
+
+  struct Pool {
+    std::vector<Slab> Slabs;
+    std::map<uint64_t, FreeRange> Free; // by start address
+  };
+
+  // What a finalized allocation hands back on deallocation
+  struct FinalizedInfo {
+    std::vector<Range> Ranges;
+    std::vector<shared::WrapperFunctionCall> DeallocActions;
+  };
+
+  class SlabInFlightAlloc : public InFlightAlloc {
+  public:
+    SlabInFlightAlloc(SlabMemoryManager &MemMgr, std::vector<Range> Ranges,
+                      shared::AllocActions AllocActions)
+        : MemMgr(MemMgr), Ranges(std::move(Ranges)),
+          AllocActions(std::move(AllocActions)) {}
+
+    void finalize(OnFinalizedFunction OnFinalized) override {
+      for (auto &R : Ranges)
+        if (R.K == Code)
+          sys::Memory::InvalidateInstructionCache(R.Exec, R.Size);
+
+      auto DeallocActions = shared::runFinalizeActions(AllocActions);
+      if (!DeallocActions) {
+        MemMgr.releaseRanges(Ranges);
+        return OnFinalized(DeallocActions.takeError());
+      }
+
+      MemMgr.noteLive(Ranges, 1);
+      auto *Info =
+          new FinalizedInfo{std::move(Ranges), std::move(*DeallocActions)};
+      OnFinalized(FinalizedAlloc(ExecutorAddr::fromPtr(Info)));
+    }
+
+    void abandon(OnAbandonedFunction OnAbandoned) override {
+      MemMgr.releaseRanges(Ranges);
+      OnAbandoned(Error::success());
+    }
+
+  private:
+    SlabMemoryManager &MemMgr;
+    std::vector<Range> Ranges;
+    shared::AllocActions AllocActions;
+  };
+
+  Expected<Range> allocateRange(Kind K, uint64_t Size, uint64_t Align) {
+    Size = alignTo(std::max<uint64_t>(Size, 1), Granule);
+    Align = std::max(Align, uint64_t(Granule));
+
+    std::lock_guard<std::mutex> Lock(M);
+    auto &P = Pools[K];
+    for (int Attempt = 0; Attempt < 2; Attempt++) {
+      // First fit, lowest address first: keeps the slabs dense
+      for (auto I = P.Free.begin(); I != P.Free.end(); ++I) {
+        uint64_t Start = alignTo(I->first, Align);
+        uint64_t End = I->first + I->second.Size;
+        if (Start + Size > End)
+          continue;
+        FreeRange F = I->second;
+        uint64_t FreeStart = I->first;
+        P.Free.erase(I);
+        if (Start > FreeStart)
+          P.Free[FreeStart] = {Start - FreeStart, F.Slab};
+        if (Start + Size < End)
+          P.Free[Start + Size] = {End - (Start + Size), F.Slab};
+        auto &S = P.Slabs[F.Slab];
+        char *Exec = reinterpret_cast<char *>(Start);
+        return Range{K, Exec, S.Work + (Exec - S.Exec), Size};
+      }
+      if (auto Err = addSlab(K, alignTo(std::max(uint64_t(SlabSize), Size + Align),
+                                        PageSize)))
+        return std::move(Err);
+    }
+    llvm_unreachable("a new slab always fits");
+  }
+
+  void releaseRanges(ArrayRef<Range> Ranges) {
+    std::lock_guard<std::mutex> Lock(M);
+    for (auto &R : Ranges) {
+      auto &Free = Pools[R.K].Free;
+      uint64_t Start = reinterpret_cast<uint64_t>(R.Exec);
+      uint64_t Size = R.Size;
+      unsigned SlabIdx = slabOf(R.K, R.Exec);
+
+      auto Next = Free.lower_bound(Start);
+      if (Next != Free.end() && Next->first == Start + Size &&
+          Next->second.Slab == SlabIdx) {
+        Size += Next->second.Size;
+        Next = Free.erase(Next);
+      }
+      if (Next != Free.begin()) {
+        auto Prev = std::prev(Next);
+        if (Prev->first + Prev->second.Size == Start &&
+            Prev->second.Slab == SlabIdx) {
+          Prev->second.Size += Size;
+          continue;
+        }
+      }
+      Free[Start] = {Size, SlabIdx};
+    }
+  }
+
+  unsigned slabOf(Kind K, const char *Exec) {
+    auto &Slabs = Pools[K].Slabs;
+    for (unsigned I = 0; I < Slabs.size(); I++)
+      if (Exec >= Slabs[I].Exec && Exec < Slabs[I].Exec + Slabs[I].Size)
+        return I;
+    llvm_unreachable("range outside of every slab");
+  }
+
+  // The next Size bytes of the reservation, which is made on first use
+  Expected<char *> reserve(uint64_t Size) {
+    if (!Reserved) {
+      void *Addr = mmap(nullptr, ReserveSize, PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (Addr == MAP_FAILED)
+        return errorCodeToError(std::error_code(errno, std::generic_category()));
+      ++Stats.MMaps;
+      Reserved = static_cast<char *>(Addr);
+    }
+    if (Size > ReserveSize - ReservedUsed)
+      return createStringError(inconvertibleErrorCode(),
+                               "JIT code and data exceed %llu MiB",
+                               (unsigned long long)(ReserveSize >> 20));
+    char *Addr = Reserved + ReservedUsed;
+    ReservedUsed += Size;
+    return Addr;
+  }
+
+  Error addSlab(Kind K, uint64_t Size) {
+    auto Base = reserve(Size);
+    if (!Base)
+      return Base.takeError();
+
+    Slab S;
+    S.Size = Size;
+    if (K == RWData) {
+      void *Addr = mmap(*Base, Size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+      if (Addr == MAP_FAILED)
+        return errorCodeToError(std::error_code(errno, std::generic_category()));
+      ++Stats.MMaps;
+      S.Exec = S.Work = static_cast<char *>(Addr);
+    } else {
+      int Fd = memfd_create("kaleidoscope-jit", MFD_CLOEXEC);
+      if (Fd < 0 || ftruncate(Fd, Size) != 0) {
+        auto EC = std::error_code(errno, std::generic_category());
+        if (Fd >= 0)
+          close(Fd);
+        return errorCodeToError(EC);
+      }
+      int Prot = K == Code ? PROT_READ | PROT_EXEC : PROT_READ;
+      void *Work = mmap(nullptr, Size, PROT_READ | PROT_WRITE, MAP_SHARED, Fd, 0);
+      void *Exec = Work == MAP_FAILED
+                       ? MAP_FAILED
+                       : mmap(*Base, Size, Prot, MAP_SHARED | MAP_FIXED, Fd, 0);
+      auto EC = std::error_code(errno, std::generic_category());
+      close(Fd);
+      if (Exec == MAP_FAILED) {
+        if (Work != MAP_FAILED)
+          munmap(Work, Size);
+        return errorCodeToError(EC);
+      }
+      Stats.MMaps += 2;
+      S.Exec = static_cast<char *>(Exec);
+      S.Work = static_cast<char *>(Work);
+    }
+    Stats.MappedBytes += S.Work == S.Exec ? Size : 2 * Size;
+
+    auto &P = Pools[K];
+    P.Free[reinterpret_cast<uint64_t>(S.Exec)] = {Size, unsigned(P.Slabs.size())};
+    P.Slabs.push_back(S);
+    return Error::success();
+  }
+
+  void noteLive(ArrayRef<Range> Ranges, int Sign) {
+    uint64_t Code = 0, Data = 0;
+    for (auto &R : Ranges)
+      (R.K == SlabMemoryManager::Code ? Code : Data) += R.Size;
+    if (Sign > 0) {
+      ++Stats.LiveObjects;
+      Stats.CodeBytes += Code;
+      Stats.DataBytes += Data;
+      Stats.LiveCodeBytes += Code;
+      Stats.LiveDataBytes += Data;
+    } else {
+      --Stats.LiveObjects;
+      Stats.LiveCodeBytes -= Code;
+      Stats.LiveDataBytes -= Data;
+    }
+  }
+
+  static constexpr uint64_t Granule = 16;
+
+  JITStats &Stats;
+  uint64_t PageSize;
+  std::mutex M;
+  Pool Pools[NumKinds];
+  char *Reserved = nullptr; // ReserveSize bytes, slabs from the start
+  uint64_t ReservedUsed = 0;
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // KALEIDOSCOPE_JITMEMORY_H
@@ -0,0 +1,110 @@
+//===- Kaleidoscope.h - Embedding the Kaleidoscope compiler -----*- C++ -*-===//
+//
+// The API of libkaleidoscope, for programs that compile and call Kaleidoscope
+// code in-process:
+//
+//   auto C = kaleidoscope::Compiler::create();        // Expected<...>
+//   auto M = (*C)->compile("def hyp(a b) a*a + b*b"); // Expected<Module>
+//   auto Hyp = M->getFunction<double(double, double)>("hyp");
+//   double H = (*Hyp)(3, 4);
+//
+// Nothing is printed and nothing exits the process: every failure comes back
+// as an llvm::Error, with the compiler's messages as its text.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KALEIDOSCOPE_H
+#define KALEIDOSCOPE_H
+
+#include "FunctionHandle.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Error.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+class CompilerSession;
+
+namespace kaleidoscope {
+
+// The -f options of the kaleidoscope driver
+struct Options {
+  bool FastMath = false;         // -ffast-math
+  bool FPContract = false;       // -ffp-contract=fast
+  unsigned SpecializeLimit = 8;  // -fspecialize-limit
+  unsigned ExprCacheSize = 256;  // -fexpr-cache-size
+};
+
+class Compiler;
+
+// What one Compiler::compile() call defined, and what its top level
+// expressions evaluated to, in order. Must not outlive its Compiler.
+class Module {
+public:
+  const std::vector<std::string> &functions() const { return Functions; }
+  const std::vector<double> &results() const { return Results; }
+
+  // A function this module defined
+  template <typename Sig>
+  llvm::Expected<llvm::orc::FunctionHandle<Sig>>
+  getFunction(llvm::StringRef Name) const;
+
+private:
+  friend class Compiler;
+  explicit Module(Compiler &C) : C(&C) {}
+
+  Compiler *C;
+  std::vector<std::string> Functions;
+  std::vector<double> Results;
+};
+
+// A JIT and everything compiled into it so far: later sources can call
+// what earlier ones defined. Not thread safe, but the function handles it
+// gives out can be called from any thread for as long as it is alive.
+class Compiler {
+public:
+  static llvm::Expected<std::unique_ptr<Compiler>>
+  create(const Options &Opts = Options());
+  ~Compiler();
+
+  // Compile Source (definitions, externs and top level expressions, as fed
+  // to the REPL) and run its expressions. On errors, all of the messages
+  // are returned; whatever compiled before an error stays defined.
+  llvm::Expected<Module> compile(llvm::StringRef Source);
+
+  // Any function defined so far, e.g. getFunction<double(double)>("f").
+  // The signature is not checked; Kaleidoscope functions take and return
+  // doubles, except that an array parameter `a[]` takes two arguments, the
+  // data and its length: getFunction<double(const double *, int64_t)>.
+  template <typename Sig>
+  llvm::Expected<llvm::orc::FunctionHandle<Sig>>
+  getFunction(llvm::StringRef Name) {
+    auto Slot = getEntryPoint(Name);
+    if (!Slot)
+      return Slot.takeError();
+    return llvm::orc::FunctionHandle<Sig>(std::move(*Slot));
+  }
+
+private:
+  explicit Compiler(std::unique_ptr<CompilerSession> S);
+
+  llvm::Expected<std::shared_ptr<const llvm::orc::EntryPointSlot>>
+  getEntryPoint(llvm::StringRef Name);
+
+  std::unique_ptr<CompilerSession> S;
+};
+
+template <typename Sig>
+llvm::Expected<llvm::orc::FunctionHandle<Sig>>
+Module::getFunction(llvm::StringRef Name) const {
+  for (const auto &F : Functions)
+    if (F == Name)
+      return C->getFunction<Sig>(Name);
+  return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                 "%s is not defined by this module",
+                                 Name.str().c_str());
+}
+
+} // end namespace kaleidoscope
+
+#endif // KALEIDOSCOPE_H
@@ -13,85 +13,511 @@
 #ifndef LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 #define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 
+#include "FunctionHandle.h"
+#include "HostLibrary.h"
+#include "JITMemory.h"
+#include "PerfMapListener.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/JITLink/EHFrameSupport.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
-#include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Target/TargetMachine.h"
+#include <atomic>
 #include <memory>
+#include <mutex>
 
 namespace llvm {
 namespace orc {
 
-class KaleidoscopeJIT {
+// What one resource tracker holds on to
+struct TrackerMemory {
+  bool IsDefault = false; // the main JITDylib's default tracker (definitions)
+  std::vector<std::string> Functions;
+  unsigned PendingModules = 0; // added, not compiled yet: still hold IR
+  uint64_t PendingInstructions = 0;
+  unsigned Objects = 0;
+  uint64_t CodeBytes = 0;
+  uint64_t DataBytes = 0;
+};
+
+// What links compiled objects into memory: RuntimeDyld, with a
+// SectionMemoryManager per object, or JITLink, with one SlabMemoryManager
+enum class JITLinker { RTDyld, JITLink };
+
+// What any number of KaleidoscopeJITs in a process can share: the host target,
+// detected once, and the symbol string pool. Each JIT still needs its own
+// ExecutionSession: a materialization queued by one session's lookup may be
+// finished by whichever thread looks up next, possibly in the middle of the
+// owning JIT tearing down its layers.
+struct JITTarget {
+  JITTargetMachineBuilder JTMB;
+  DataLayout DL;
+  std::shared_ptr<SymbolStringPool> SSP;
+
+  static Expected<std::shared_ptr<JITTarget>> detectHost() {
+    JITTargetMachineBuilder JTMB((Triple(sys::getProcessTriple())));
+
+    // Code is run on the host, so use its CPU: otherwise contractable FP ops
+    // can never be selected as FMA instructions.
+    JTMB.setCPU(std::string(sys::getHostCPUName()));
+
+    auto DL = JTMB.getDefaultDataLayoutForTarget();
+    if (!DL)
+      return DL.takeError();
+
+    return std::make_shared<JITTarget>(JITTarget{
+        std::move(JTMB), std::move(*DL), std::make_shared<SymbolStringPool>()});
+  }
+};
+
+class KaleidoscopeJIT : public ResourceManager {
 private:
   std::unique_ptr<ExecutionSession> ES;
 
+  JITStats Stats;
+
+  // Only created when asked for; must outlive ObjectLayer
+  std::unique_ptr<PerfMapListener> PerfMap;
+
   DataLayout DL;
   MangleAndInterner Mangle;
 
-  RTDyldObjectLinkingLayer ObjectLayer;
+  // One of these is used, depending on the linker; both must outlive the
+  // object layer
+  CountingMemoryMapper Mapper;
+  std::unique_ptr<SlabMemoryManager> SlabMemory;
+
+  std::unique_ptr<ObjectLayer> ObjLayer;
+  RTDyldObjectLinkingLayer *RTDyldLayer = nullptr; // null with JITLink
+
+  // Same target as the compiler's, for the optimizer's cost models
+  std::unique_ptr<TargetMachine> TM;
   IRCompileLayer CompileLayer;
 
+  // Main links against the libraries loaded ahead of time, then against
+  // the rest of the process, searched with dlsym one new name at a time
   JITDylib &MainJD;
+  JITDylib &LibsJD;
+  JITDylib &ProcessJD;
+  DenseSet<SymbolStringPtr> LibSymbols; // defined in LibsJD
+
+  // Of functions whose code is replaced under their callers, made on first
+  // use
+  std::unique_ptr<IndirectStubsManager> Stubs;
+
+  // Entry points resolved so far, by unmangled name, and what each resource
+  // tracker holds: removing it invalidates the handles to its functions
+  std::mutex EntryPointsMutex;
+  StringMap<std::shared_ptr<EntryPointSlot>> EntryPoints;
+  DenseMap<ResourceKey, TrackerMemory> Trackers;
+  uint64_t Removals = 0; // of trackers; a lookup across one may be stale
+
+  // Modules waiting to be compiled, with the tracker they were added under
+  DenseMap<const Module *, ResourceKey> PendingModules;
+
+  // Memory managers are made and filled by the thread that emits the object,
+  // right before NotifyLoaded, which is how an object is tied to its tracker
+  static CountingMemoryManager *&lastMemoryManager() {
+    static thread_local CountingMemoryManager *Last = nullptr;
+    return Last;
+  }
+
+  // What JITLink objects are attributed to their trackers by: the sizes of
+  // their sections, once laid out
+  class TrackerStatsPlugin : public ObjectLinkingLayer::Plugin {
+  public:
+    TrackerStatsPlugin(KaleidoscopeJIT &J) : J(J) {}
+
+    void modifyPassConfig(MaterializationResponsibility &MR,
+                          jitlink::LinkGraph &,
+                          jitlink::PassConfiguration &Config) override {
+      Config.PostAllocationPasses.push_back([this, &MR](jitlink::LinkGraph &G) {
+        uint64_t Code = 0, Data = 0;
+        for (auto &Sec : G.sections()) {
+          bool IsCode = (Sec.getMemProt() & jitlink::MemProt::Exec) !=
+                        jitlink::MemProt::None;
+          for (auto *B : Sec.blocks())
+            (IsCode ? Code : Data) += B->getSize();
+        }
+        return MR.withResourceKeyDo(
+            [&](ResourceKey K) { J.noteObject(K, Code, Data); });
+      });
+    }
+
+    Error notifyFailed(MaterializationResponsibility &) override {
+      return Error::success();
+    }
+    Error notifyRemovingResources(ResourceKey) override {
+      return Error::success();
+    }
+    void notifyTransferringResources(ResourceKey, ResourceKey) override {}
+
+  private:
+    KaleidoscopeJIT &J;
+  };
+
+  std::unique_ptr<ObjectLayer> createObjectLayer(JITLinker Linker) {
+    if (Linker == JITLinker::JITLink) {
+      SlabMemory = std::make_unique<SlabMemoryManager>(Stats);
+      auto Layer = std::make_unique<ObjectLinkingLayer>(*ES, *SlabMemory);
+      Layer->addPlugin(std::make_unique<EHFrameRegistrationPlugin>(
+          *ES, std::make_unique<jitlink::InProcessEHFrameRegistrar>()));
+      Layer->addPlugin(std::make_unique<TrackerStatsPlugin>(*this));
+      return std::move(Layer);
+    }
+    auto Layer = std::make_unique<RTDyldObjectLinkingLayer>(*ES, [this]() {
+      auto MM = std::make_unique<CountingMemoryManager>(Stats, Mapper);
+      lastMemoryManager() = MM.get();
+      return MM;
+    });
+    RTDyldLayer = Layer.get();
+    return std::move(Layer);
+  }
+
+  // JITLink reaches symbols outside of the small code model (the process'
+  // functions, other slabs) through the GOT and stubs of PIC code
+  static JITTargetMachineBuilder
+  prepareTargetMachineBuilder(JITTargetMachineBuilder JTMB, JITLinker Linker) {
+    if (Linker == JITLinker::JITLink) {
+      JTMB.setRelocationModel(Reloc::PIC_);
+      JTMB.setCodeModel(CodeModel::Small);
+    }
+    return JTMB;
+  }
+
+  static Error needsRTDyld(const char *What) {
+    return createStringError(inconvertibleErrorCode(),
+                             "%s needs the RuntimeDyld linker", What);
+  }
+
+  void noteObject(ResourceKey K, uint64_t CodeBytes, uint64_t DataBytes) {
+    std::lock_guard<std::mutex> Lock(EntryPointsMutex);
+    auto &T = Trackers[K];
+    T.Objects++;
+    T.CodeBytes += CodeBytes;
+    T.DataBytes += DataBytes;
+  }
+
+  // Drop what tracker K held: its entry points are invalidated. Called with
+  // EntryPointsMutex held.
+  void forgetTracker(ResourceKey K) {
+    auto I = Trackers.find(K);
+    if (I == Trackers.end())
+      return;
+    for (auto &Name : I->second.Functions) {
+      auto EP = EntryPoints.find(Name);
+      if (EP != EntryPoints.end()) {
+        EP->second->store(0, std::memory_order_release);
+        EntryPoints.erase(EP);
+      }
+    }
+    if (I->second.PendingModules)
+      for (auto P = PendingModules.begin(); P != PendingModules.end();) {
+        auto Next = std::next(P);
+        if (P->second == K)
+          PendingModules.erase(P);
+        P = Next;
+      }
+    Trackers.erase(I);
+  }
 
 public:
   KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ES,
-                  JITTargetMachineBuilder JTMB, DataLayout DL)
+                  JITTargetMachineBuilder JTMB, DataLayout DL,
+                  JITLinker Linker = JITLinker::RTDyld)
       : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
-        ObjectLayer(*this->ES,
-                    []() { return std::make_unique<SectionMemoryManager>(); }),
-        CompileLayer(*this->ES, ObjectLayer,
-                     std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
-        MainJD(this->ES->createBareJITDylib("<main>")) {
-    MainJD.addGenerator(
+        Mapper(Stats), ObjLayer(createObjectLayer(Linker)),
+        TM(cantFail(
+            prepareTargetMachineBuilder(JTMB, Linker).createTargetMachine())),
+        CompileLayer(*this->ES, *ObjLayer,
+                     std::make_unique<ConcurrentIRCompiler>(
+                         prepareTargetMachineBuilder(std::move(JTMB), Linker))),
+        MainJD(this->ES->createBareJITDylib("<main>")),
+        LibsJD(this->ES->createBareJITDylib("<libs>")),
+        ProcessJD(this->ES->createBareJITDylib("<process>")) {
+    ProcessJD.addGenerator(
         cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
             DL.getGlobalPrefix())));
+    MainJD.addToLinkOrder(LibsJD);
+    MainJD.addToLinkOrder(ProcessJD);
+    this->ES->registerResourceManager(*this);
+    CompileLayer.setNotifyCompiled(
+        [this](MaterializationResponsibility &, ThreadSafeModule TSM) {
+          ++Stats.ModulesMaterialized;
+          TSM.withModuleDo([this](Module &M) {
+            std::lock_guard<std::mutex> Lock(EntryPointsMutex);
+            auto I = PendingModules.find(&M);
+            if (I == PendingModules.end())
+              return;
+            auto &T = Trackers[I->second];
+            T.PendingModules--;
+            T.PendingInstructions -= M.getInstructionCount();
+            PendingModules.erase(I);
+          });
+        });
+    if (!RTDyldLayer)
+      return;
+    RTDyldLayer->setNotifyLoaded([this](MaterializationResponsibility &R,
+                                        const object::ObjectFile &,
+                                        const RuntimeDyld::LoadedObjectInfo &) {
+      auto *MM = lastMemoryManager();
+      lastMemoryManager() = nullptr;
+      if (!MM)
+        return;
+      cantFail(R.withResourceKeyDo([&](ResourceKey K) {
+        noteObject(K, MM->getCodeBytes(), MM->getDataBytes());
+      }));
+    });
   }
 
   ~KaleidoscopeJIT() {
     if (auto Err = ES->endSession())
       ES->reportError(std::move(Err));
+    ES->deregisterResourceManager(*this);
+    sweepSymbolStrings();
   }
 
-  static Expected<std::unique_ptr<KaleidoscopeJIT>> Create() {
-    auto EPC = SelfExecutorProcessControl::Create();
+  static Expected<std::unique_ptr<KaleidoscopeJIT>>
+  Create(std::shared_ptr<JITTarget> Target = nullptr,
+         JITLinker Linker = JITLinker::RTDyld) {
+    if (!Target) {
+      auto Host = JITTarget::detectHost();
+      if (!Host)
+        return Host.takeError();
+      Target = std::move(*Host);
+    }
+
+    auto EPC = SelfExecutorProcessControl::Create(Target->SSP);
     if (!EPC)
       return EPC.takeError();
 
     auto ES = std::make_unique<ExecutionSession>(std::move(*EPC));
 
-    JITTargetMachineBuilder JTMB(
-        ES->getExecutorProcessControl().getTargetTriple());
-
-    auto DL = JTMB.getDefaultDataLayoutForTarget();
-    if (!DL)
-      return DL.takeError();
-
-    return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(JTMB),
-                                             std::move(*DL));
+    return std::make_unique<KaleidoscopeJIT>(std::move(ES), Target->JTMB,
+                                             Target->DL, Linker);
   }
 
   const DataLayout &getDataLayout() const { return DL; }
 
+  // What a function pass manager needs to know of the target, e.g. the
+  // vector width, to optimize for it
+  TargetIRAnalysis getTargetIRAnalysis() const {
+    return TM->getTargetIRAnalysis();
+  }
+
   JITDylib &getMainJITDylib() { return MainJD; }
 
+  const JITStats &getStats() const { return Stats; }
+
+  // Profiler and debugger support. Each registers a listener that is told
+  // about every object loaded from then on, so enable before adding modules.
+  // With none enabled, loading an object costs nothing extra. RuntimeDyld
+  // only: JITLink has no JITEventListeners.
+
+  // Symbolize JIT'd code in `perf report` through /tmp/perf-<pid>.map
+  Error enablePerfMap() {
+    if (!RTDyldLayer)
+      return needsRTDyld("perf map");
+    auto Listener = std::make_unique<PerfMapListener>();
+    if (auto Err = Listener->open())
+      return Err;
+    PerfMap = std::move(Listener);
+    RTDyldLayer->registerJITEventListener(*PerfMap);
+    return Error::success();
+  }
+
+  // jitdump files for `perf inject --jit` (also carries code bytes, and line
+  // info when there is any)
+  Error enableJITDump() {
+    if (!RTDyldLayer)
+      return needsRTDyld("jitdump");
+    auto *Listener = JITEventListener::createPerfJITEventListener();
+    if (!Listener)
+      return createStringError(inconvertibleErrorCode(),
+                               "LLVM was built without perf support");
+    RTDyldLayer->registerJITEventListener(*Listener);
+    return Error::success();
+  }
+
+  // Lets gdb/lldb see JIT'd functions (breakpoints, backtraces)
+  Error enableGDBRegistration() {
+    if (!RTDyldLayer)
+      return needsRTDyld("gdb registration");
+    RTDyldLayer->registerJITEventListener(
+        *JITEventListener::createGDBRegistrationListener());
+    return Error::success();
+  }
+
   Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
     if (!RT)
       RT = MainJD.getDefaultResourceTracker();
+
+    TSM.withModuleDo([&](Module &M) {
+      std::lock_guard<std::mutex> Lock(EntryPointsMutex);
+      auto &T = Trackers[RT->getKeyUnsafe()];
+      for (auto &F : M.functions())
+        if (!F.isDeclaration())
+          T.Functions.push_back(F.getName().str());
+      T.PendingModules++;
+      T.PendingInstructions += M.getInstructionCount();
+      PendingModules[&M] = RT->getKeyUnsafe();
+    });
+
     return CompileLayer.add(RT, std::move(TSM));
   }
 
+  // Make code or data of this process visible to JIT'd code as Name
+  Error defineAbsolute(StringRef Name, JITTargetAddress Addr) {
+    return MainJD.define(absoluteSymbols(
+        {{Mangle(Name.str()),
+          JITEvaluatedSymbol(Addr, JITSymbolFlags::Exported |
+                                       JITSymbolFlags::Callable)}}));
+  }
+
+  // Name becomes a stub that jumps to Addr, until it is redirected again:
+  // code calling Name stays linked to the stub while what it calls is
+  // replaced (--watch). The first redirect defines Name.
+  Error redirect(StringRef Name, JITTargetAddress Addr) {
+    if (!Stubs)
+      Stubs = createLocalIndirectStubsManagerBuilder(
+          Triple(sys::getProcessTriple()))();
+    if (Stubs->findStub(Name, true))
+      return Stubs->updatePointer(Name, Addr);
+    if (auto Err = Stubs->createStub(Name, Addr, JITSymbolFlags::Exported |
+                                                      JITSymbolFlags::Callable))
+      return Err;
+    return MainJD.define(
+        absoluteSymbols({{Mangle(Name.str()), Stubs->findStub(Name, true)}}));
+  }
+
+  // Bind every export of Lib that no library added before defines; returns
+  // how many that was
+  Expected<unsigned> addHostLibrary(const HostLibrary &Lib) {
+    SymbolMap Syms;
+    for (auto &E : Lib.getExports()) {
+      auto Name = ES->intern(E.Name);
+      if (LibSymbols.insert(Name).second)
+        Syms[Name] = E.Sym;
+    }
+    unsigned Count = Syms.size();
+    if (Count)
+      if (auto Err = LibsJD.define(absoluteSymbols(std::move(Syms))))
+        return std::move(Err);
+    return Count;
+  }
+
+  // Name is bound to a library added with addHostLibrary, ahead of the
+  // process's own definition
+  bool isLibrarySymbol(StringRef Name) {
+    return LibSymbols.count(Mangle(Name.str()));
+  }
+
   Expected<JITEvaluatedSymbol> lookup(StringRef Name) {
     return ES->lookup({&MainJD}, Mangle(Name.str()));
   }
+
+  // Resolve Name once; later calls for the same name are a hash lookup until
+  // the defining module is removed
+  template <typename Sig>
+  Expected<FunctionHandle<Sig>> getFunction(StringRef Name) {
+    auto Slot = getEntryPoint(Name);
+    if (!Slot)
+      return Slot.takeError();
+    return FunctionHandle<Sig>(std::move(*Slot));
+  }
+
+  Expected<std::shared_ptr<const EntryPointSlot>> getEntryPoint(StringRef Name) {
+    std::unique_lock<std::mutex> Lock(EntryPointsMutex);
+    while (true) {
+      auto I = EntryPoints.find(Name);
+      if (I != EntryPoints.end())
+        return I->second;
+
+      // Not under the lock: lookup may compile, which takes it. If a tracker
+      // was removed meanwhile, it may have held the code found, and it found
+      // no slot to clear; look again rather than publish that address.
+      uint64_t RemovalsBefore = Removals;
+      Lock.unlock();
+      auto Sym = lookup(Name);
+      Lock.lock();
+      if (!Sym)
+        return Sym.takeError();
+      if (Removals != RemovalsBefore)
+        continue;
+
+      auto &Slot = EntryPoints[Name];
+      if (!Slot)
+        Slot = std::make_shared<EntryPointSlot>(Sym->getAddress());
+      return Slot;
+    }
+  }
+
+  // Live resource trackers and what they hold
+  std::vector<TrackerMemory> getTrackerMemory() {
+    ResourceKey Default = MainJD.getDefaultResourceTracker()->getKeyUnsafe();
+    std::lock_guard<std::mutex> Lock(EntryPointsMutex);
+    std::vector<TrackerMemory> Result;
+    for (auto &KV : Trackers) {
+      Result.push_back(KV.second);
+      Result.back().IsDefault = KV.first == Default;
+    }
+    return Result;
+  }
+
+  // Names of removed code stay interned until swept. A sweep walks the whole
+  // pool, holding its lock, and JITs with the same JITTarget share the pool:
+  // it is done every SweepInterval removals, not after each one, and when
+  // the memory report or the end of the session needs it.
+  static constexpr unsigned SweepInterval = 256;
+  void sweepSymbolStrings() { ES->getSymbolStringPool()->clearDeadEntries(); }
+
+  Error handleRemoveResources(ResourceKey K) override {
+    bool Sweep;
+    {
+      std::lock_guard<std::mutex> Lock(EntryPointsMutex);
+      Sweep = ++Removals % SweepInterval == 0;
+      forgetTracker(K);
+    }
+    if (Sweep)
+      sweepSymbolStrings();
+    return Error::success();
+  }
+
+  void handleTransferResources(ResourceKey DstK, ResourceKey SrcK) override {
+    std::lock_guard<std::mutex> Lock(EntryPointsMutex);
+    auto I = Trackers.find(SrcK);
+    if (I == Trackers.end())
+      return;
+    auto Src = std::move(I->second);
+    Trackers.erase(I);
+    auto &Dst = Trackers[DstK];
+    Dst.Functions.insert(Dst.Functions.end(), Src.Functions.begin(),
+                         Src.Functions.end());
+    Dst.PendingModules += Src.PendingModules;
+    Dst.PendingInstructions += Src.PendingInstructions;
+    Dst.Objects += Src.Objects;
+    Dst.CodeBytes += Src.CodeBytes;
+    Dst.DataBytes += Src.DataBytes;
+    for (auto &P : PendingModules)
+      if (P.second == SrcK)
+        P.second = DstK;
+  }
 };
 
 } // end namespace orc
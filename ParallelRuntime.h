@@ -0,0 +1,243 @@
+//===- ParallelRuntime.h - Work-stealing pool for parallel for --*- C++ -*-===//
+//
+// What `parallel for i = a, b in body` runs on. Codegen outlines the body into
+// a chunk function that sums it over a range of indices, and calls
+// __kparallel_for, which splits the index range into chunks, runs them on a
+// process-wide pool of worker threads, and adds up the chunk sums.
+//
+// Chunking depends only on the length of the range, and chunk sums are
+// combined pairwise in index order, so the result is the same whatever the
+// number of threads and however the chunks were scheduled.
+//
+// Each worker has a deque of chunk ranges. A thread running a range splits
+// it in halves, keeps the lower half and pushes the upper one where idle
+// workers can steal it; it takes work back from its own end of its deque.
+// Threads outside the pool (the ones calling into JIT'd code) push into a
+// shared deque instead, and help run chunks until their loop is done, as do
+// workers whose chunk starts a nested loop.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KALEIDOSCOPE_PARALLELRUNTIME_H
+#define KALEIDOSCOPE_PARALLELRUNTIME_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace llvm {
+namespace orc {
+
+class WorkStealingPool {
+public:
+  // Sum of the body for the indices Start + K, Begin <= K < End
+  typedef double (*ChunkFn)(const void *Env, double Start, int64_t Begin,
+                            int64_t End);
+
+  // Chunks a loop is split into, at most; fewer if it has fewer indices
+  static constexpr int64_t MaxChunks = 1024;
+
+  // The pool of this process, with Threads - 1 workers (the caller of a
+  // loop is the other thread). Threads is only looked at on first use; 0
+  // means one per CPU.
+  static WorkStealingPool &get(unsigned Threads = 0) {
+    static WorkStealingPool Pool(
+        Threads ? Threads : std::max(1u, std::thread::hardware_concurrency()));
+    return Pool;
+  }
+
+  ~WorkStealingPool() {
+    {
+      std::lock_guard<std::mutex> Lock(SleepMutex);
+      Stopping = true;
+    }
+    Wake.notify_all();
+    for (auto &T : Workers)
+      T.join();
+  }
+
+  unsigned threads() const { return Workers.size() + 1; }
+
+  // Indices run from Start while below End: ceil(End - Start) of them
+  double parallelFor(ChunkFn Fn, const void *Env, double Start, double End) {
+    double Count = std::ceil(End - Start);
+    if (!(Count > 0))
+      return 0;
+    int64_t N = Count < 9e18 ? int64_t(Count) : int64_t(9e18);
+
+    Job J;
+    J.Fn = Fn;
+    J.Env = Env;
+    J.Start = Start;
+    J.N = N;
+    J.Grain = (N + MaxChunks - 1) / MaxChunks;
+    int64_t Chunks = (N + J.Grain - 1) / J.Grain;
+    J.Partials.resize(Chunks);
+    J.Pending = Chunks;
+
+    if (Workers.empty()) {
+      runRange({&J, 0, Chunks}, nullptr);
+    } else {
+      push(myQueue(), {&J, 0, Chunks});
+      // Help out until every chunk is done, with this loop's or any other
+      while (J.Pending.load(std::memory_order_acquire)) {
+        Task T;
+        if (findTask(T))
+          runTask(T);
+        else
+          std::this_thread::yield();
+      }
+    }
+    return sum(J.Partials.data(), Chunks);
+  }
+
+private:
+  struct Job {
+    ChunkFn Fn;
+    const void *Env;
+    double Start;
+    int64_t N, Grain;
+    std::vector<double> Partials; // one per chunk
+    std::atomic<int64_t> Pending;
+  };
+
+  // Chunks [Begin, End) of a job
+  struct Task {
+    Job *J;
+    int64_t Begin, End;
+  };
+
+  struct Queue {
+    std::mutex M;
+    std::deque<Task> Tasks;
+  };
+
+  WorkStealingPool(unsigned Threads) {
+    for (unsigned I = 0; I + 1 < Threads; I++)
+      Queues.push_back(std::make_unique<Queue>());
+    Queues.push_back(std::make_unique<Queue>()); // shared, for outsiders
+    for (unsigned I = 0; I + 1 < Threads; I++)
+      Workers.emplace_back([this, I] { work(I); });
+  }
+
+  static Queue *&workerQueue() {
+    static thread_local Queue *Q = nullptr;
+    return Q;
+  }
+
+  Queue &myQueue() {
+    Queue *Q = workerQueue();
+    return Q ? *Q : *Queues.back();
+  }
+
+  // Either a worker going to sleep sees Queued go up, or this sees it
+  // sleeping and wakes it
+  void push(Queue &Q, Task T) {
+    {
+      std::lock_guard<std::mutex> Lock(Q.M);
+      Q.Tasks.push_back(T);
+    }
+    ++Queued;
+    if (Sleeping) {
+      std::lock_guard<std::mutex> Lock(SleepMutex);
+      Wake.notify_one();
+    }
+  }
+
+  // Newest first from our own queue, oldest (largest) first from others
+  bool findTask(Task &T) {
+    Queue &Own = myQueue();
+    {
+      std::lock_guard<std::mutex> Lock(Own.M);
+      if (!Own.Tasks.empty()) {
+        T = Own.Tasks.back();
+        Own.Tasks.pop_back();
+        --Queued;
+        return true;
+      }
+    }
+    for (auto &Q : Queues) {
+      if (Q.get() == &Own)
+        continue;
+      std::lock_guard<std::mutex> Lock(Q->M);
+      if (!Q->Tasks.empty()) {
+        T = Q->Tasks.front();
+        Q->Tasks.pop_front();
+        --Queued;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void runTask(Task T) { runRange(T, &myQueue()); }
+
+  // Split off the upper halves for thieves (when there are any), run the
+  // first chunk here
+  void runRange(Task T, Queue *Q) {
+    while (T.End - T.Begin > 1) {
+      int64_t Mid = T.Begin + (T.End - T.Begin) / 2;
+      if (Q) {
+        push(*Q, {T.J, Mid, T.End});
+        T.End = Mid;
+      } else {
+        runRange({T.J, Mid, T.End}, nullptr);
+        T.End = Mid;
+      }
+    }
+    Job &J = *T.J;
+    int64_t Begin = T.Begin * J.Grain;
+    int64_t End = std::min(J.N, Begin + J.Grain);
+    J.Partials[T.Begin] = J.Fn(J.Env, J.Start, Begin, End);
+    J.Pending.fetch_sub(1, std::memory_order_acq_rel);
+  }
+
+  void work(unsigned I) {
+    workerQueue() = Queues[I].get();
+    while (true) {
+      Task T;
+      if (findTask(T)) {
+        runTask(T);
+        continue;
+      }
+      std::unique_lock<std::mutex> Lock(SleepMutex);
+      ++Sleeping;
+      Wake.wait(Lock, [&] { return Stopping || Queued > 0; });
+      --Sleeping;
+      if (Stopping)
+        return;
+    }
+  }
+
+  // Pairwise, in index order: the same additions for the same chunks
+  static double sum(const double *P, int64_t N) {
+    if (N == 1)
+      return P[0];
+    int64_t Half = N / 2;
+    return sum(P, Half) + sum(P + Half, N - Half);
+  }
+
+  std::vector<std::unique_ptr<Queue>> Queues; // per worker, then the shared one
+  std::vector<std::thread> Workers;
+  std::atomic<int64_t> Queued{0};
+  std::atomic<unsigned> Sleeping{0};
+  std::mutex SleepMutex;
+  std::condition_variable Wake;
+  bool Stopping = false;
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+// The entry point JIT'd code calls, by this name
+extern "C" double __kparallel_for(llvm::orc::WorkStealingPool::ChunkFn Fn,
+                                  const void *Env, double Start, double End);
+
+#endif // KALEIDOSCOPE_PARALLELRUNTIME_H
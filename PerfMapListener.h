@@ -0,0 +1,80 @@
+//===- PerfMapListener.h - perf map files for JIT'd code --------*- C++ -*-===//
+//
+// Writes /tmp/perf-<pid>.map, the plain text format perf(1) reads to name
+// samples in anonymous executable memory: one "START SIZE name" line, in
+// hex, per function of every object the JIT loads.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KALEIDOSCOPE_PERFMAPLISTENER_H
+#define KALEIDOSCOPE_PERFMAPLISTENER_H
+
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/Process.h"
+#include <cstdio>
+#include <mutex>
+#include <string>
+
+namespace llvm {
+namespace orc {
+
+class PerfMapListener : public JITEventListener {
+public:
+  ~PerfMapListener() override {
+    if (File)
+      fclose(File);
+  }
+
+  // Opens (truncating) the map file of this process
+  Error open() {
+    Path = "/tmp/perf-" + std::to_string(sys::Process::getProcessId()) + ".map";
+    File = fopen(Path.c_str(), "w");
+    if (!File)
+      return createStringError(inconvertibleErrorCode(),
+                               "cannot open " + Path);
+    return Error::success();
+  }
+
+  const std::string &getPath() const { return Path; }
+
+  void notifyObjectLoaded(ObjectKey K, const object::ObjectFile &Obj,
+                          const RuntimeDyld::LoadedObjectInfo &L) override {
+    // The debug object has its sections at their load addresses
+    object::OwningBinary<object::ObjectFile> DebugObjOwner =
+        L.getObjectForDebug(Obj);
+    const object::ObjectFile *DebugObj = DebugObjOwner.getBinary();
+    if (!DebugObj)
+      return;
+
+    std::lock_guard<std::mutex> Lock(FileMutex);
+    for (const auto &P : object::computeSymbolSizes(*DebugObj)) {
+      object::SymbolRef Sym = P.first;
+      auto Type = Sym.getType();
+      if (!Type || *Type != object::SymbolRef::ST_Function) {
+        consumeError(Type.takeError());
+        continue;
+      }
+      auto Name = Sym.getName();
+      auto Addr = Sym.getAddress();
+      if (!Name || !Addr) {
+        consumeError(Name.takeError());
+        consumeError(Addr.takeError());
+        continue;
+      }
+      fprintf(File, "%llx %llx %s\n", (unsigned long long)*Addr,
+              (unsigned long long)P.second, Name->str().c_str());
+    }
+    fflush(File);
+  }
+
+private:
+  std::string Path;
+  FILE *File = nullptr;
+  std::mutex FileMutex;
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // KALEIDOSCOPE_PERFMAPLISTENER_H
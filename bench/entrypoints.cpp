@@ -0,0 +1,83 @@
+// Microbenchmark: resolving a JIT'd function through ExecutionSession::lookup
+// every time, versus the cached handles from KaleidoscopeJIT::getFunction.
+//
+// Usage: bench/entrypoints [iterations]
+
+#include "../KaleidoscopeJIT.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/TargetSelect.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace llvm;
+using namespace llvm::orc;
+
+static ExitOnError ExitOnErr;
+
+// double add1(double x) { return x + 1; }
+static ThreadSafeModule makeModule(const DataLayout &DL) {
+	auto Context = std::make_unique<LLVMContext>();
+	auto M = std::make_unique<Module>("bench", *Context);
+	M->setDataLayout(DL);
+
+	IRBuilder<> Builder(*Context);
+	Type *DoubleTy = Builder.getDoubleTy();
+	Function *F = Function::Create(FunctionType::get(DoubleTy, {DoubleTy}, false),
+			Function::ExternalLinkage, "add1", M.get());
+	Builder.SetInsertPoint(BasicBlock::Create(*Context, "entry", F));
+	Builder.CreateRet(Builder.CreateFAdd(F->getArg(0), ConstantFP::get(DoubleTy, 1.0)));
+
+	return ThreadSafeModule(std::move(M), std::move(Context));
+}
+
+template <typename Body>
+static void measure(const char *What, unsigned N, Body B) {
+	auto Start = std::chrono::steady_clock::now();
+	double Sink = 0;
+	for (unsigned i = 0; i < N; i++) {
+		Sink += B(i);
+	}
+	std::chrono::duration<double> Elapsed = std::chrono::steady_clock::now() - Start;
+	printf("%-28s %12.0f /s   (%.1f ns each, checksum %g)\n", What,
+			N / Elapsed.count(), 1e9 * Elapsed.count() / N, Sink);
+}
+
+int main(int argc, char **argv) {
+	unsigned N = argc > 1 ? atoi(argv[1]) : 1000000;
+
+	InitializeNativeTarget();
+	InitializeNativeTargetAsmParser();
+	InitializeNativeTargetAsmPrinter();
+
+	auto JIT = ExitOnErr(KaleidoscopeJIT::Create());
+	ExitOnErr(JIT->addModule(makeModule(JIT->getDataLayout())));
+
+	// Materialize before timing anything
+	auto Add1 = ExitOnErr(JIT->getFunction<double(double)>("add1"));
+
+	measure("ExecutionSession::lookup", N / 10, [&](unsigned i) {
+		auto Sym = ExitOnErr(JIT->lookup("add1"));
+		return (double)(Sym.getAddress() & 1);
+	});
+
+	measure("getFunction (cached)", N, [&](unsigned i) {
+		return (double)ExitOnErr(JIT->getFunction<double(double)>("add1")).valid();
+	});
+
+	measure("lookup + call", N / 10, [&](unsigned i) {
+		auto Sym = ExitOnErr(JIT->lookup("add1"));
+		return jitTargetAddressToFunction<double (*)(double)>(Sym.getAddress())(i);
+	});
+
+	measure("getFunction + call", N, [&](unsigned i) {
+		return ExitOnErr(JIT->getFunction<double(double)>("add1"))(i);
+	});
+
+	measure("call through handle", N, [&](unsigned i) {
+		return Add1(i);
+	});
+
+	return 0;
+}
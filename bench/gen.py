@@ -0,0 +1,91 @@
+#!/usr/bin/env python3
+"""Synthetic Kaleidoscope workloads for the benchmark harness.
+
+A corpus is N definitions arranged in `depth` layers: functions of layer L
+only call functions of layer L-1, so `depth` is the depth of the call
+graph. Bodies are random expression trees of `size` nodes over the
+parameters, literals and calls. After each definition, top-level
+expressions calling already defined functions are emitted so that there
+are `ratio` expressions per definition overall.
+
+Usage: gen.py [--defs N] [--depth D] [--size S] [--ratio R] [--seed X]
+"""
+
+import argparse
+import random
+import sys
+
+OPS = "+-*/"
+
+
+def literal(rng):
+    return "%.*f" % (rng.randint(0, 3), rng.uniform(0, 10))
+
+
+def gen_expr(rng, params, callees, size):
+    if size <= 1:
+        if params and rng.random() < 0.7:
+            return rng.choice(params)
+        return literal(rng)
+
+    if callees and rng.random() < 0.25:
+        name, arity = rng.choice(callees)
+        rest = size - 1
+        args = []
+        for i in range(arity):
+            part = max(1, rest // (arity - i))
+            args.append(gen_expr(rng, params, [], part))
+            rest -= part
+        return "%s(%s)" % (name, ", ".join(args))
+
+    left = rng.randint(1, size - 1)
+    lhs = gen_expr(rng, params, callees, left)
+    rhs = gen_expr(rng, params, callees, size - 1 - left)
+    return "(%s %s %s)" % (lhs, rng.choice(OPS), rhs)
+
+
+def generate(defs=100, depth=3, size=10, ratio=0.5, seed=1):
+    """Returns (source, number of definitions, number of expressions)."""
+    rng = random.Random(seed)
+    out = []
+    layers = [[] for _ in range(max(1, depth))]
+    defined = []
+    exprs = 0
+    owed = 0.0
+
+    for i in range(defs):
+        layer = min(i * len(layers) // max(1, defs), len(layers) - 1)
+        arity = rng.randint(1, 3)
+        name = "f%d" % i
+        params = ["a%d" % j for j in range(arity)]
+        callees = layers[layer - 1] if layer > 0 else []
+        body = gen_expr(rng, params, callees, size)
+        out.append("def %s(%s) %s;" % (name, " ".join(params), body))
+        layers[layer].append((name, arity))
+        defined.append((name, arity))
+
+        owed += ratio
+        while owed >= 1:
+            callee, arity = rng.choice(defined)
+            args = ", ".join(literal(rng) for _ in range(arity))
+            out.append("%s(%s);" % (callee, args))
+            exprs += 1
+            owed -= 1
+
+    return "\n".join(out) + "\n", defs, exprs
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    ap.add_argument("--defs", type=int, default=100)
+    ap.add_argument("--depth", type=int, default=3)
+    ap.add_argument("--size", type=int, default=10)
+    ap.add_argument("--ratio", type=float, default=0.5)
+    ap.add_argument("--seed", type=int, default=1)
+    args = ap.parse_args()
+    source, _, _ = generate(args.defs, args.depth, args.size, args.ratio, args.seed)
+    sys.stdout.write(source)
+
+
+if __name__ == "__main__":
+    main()
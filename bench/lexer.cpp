@@ -0,0 +1,294 @@
+// Microbenchmark: the lexer on number-heavy source, from a string and from
+// a reader in 4 KiB pieces, against the lexer it replaced (a std::string per
+// token, strtod, <cctype> per character).
+//
+// With --verify it is a differential test instead: every number it lexes
+// must come out bit for bit as strtod reads it, and every token as the old
+// lexer saw it, also when the input arrives a few bytes at a time.
+//
+// Usage: bench/lexer [megabytes]
+//        bench/lexer --verify[=cases]
+
+#include "../CompilerSession.h"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+
+// The lexer before DecimalParser.h and the character table, for a text source
+class ReferenceLexer {
+public:
+	explicit ReferenceLexer(StringRef Text) : Cur(Text.begin()), End(Text.end()) {}
+
+	std::string IdentifierString;
+	double NumValue;
+
+	int gettok() {
+		while (isspace(LastChar)) {
+			LastChar = getChar();
+		}
+		if (isalpha(LastChar)) {
+			IdentifierString = "";
+			while (isalnum(LastChar) || LastChar == '_') {
+				IdentifierString += LastChar;
+				LastChar = getChar();
+			}
+			if (IdentifierString == "def") return tok_def;
+			if (IdentifierString == "extern") return tok_extern;
+			if (IdentifierString == "fastmath") return tok_fastmath;
+			if (IdentifierString == "load") return tok_load;
+			if (IdentifierString == "parallel") return tok_parallel;
+			return tok_identifier;
+		}
+		if (isdigit(LastChar) || LastChar == '.') {
+			std::string NumStr = "";
+			bool decimal = false;
+			while (isdigit(LastChar) || (!decimal && LastChar == '.')) {
+				NumStr += LastChar;
+				if (LastChar == '.') {
+					decimal = true;
+				}
+				LastChar = getChar();
+			}
+			if (decimal && LastChar == '.') {
+				return tok_error;
+			}
+			NumValue = strtod(NumStr.c_str(), nullptr);
+			return tok_number;
+		}
+		if (LastChar == '#') {
+			while (LastChar != EOF && LastChar != '\n' && LastChar != '\r') {
+				LastChar = getChar();
+			}
+			if (LastChar != EOF) {
+				return gettok();
+			}
+			return tok_error;
+		}
+		if (LastChar == EOF) {
+			return tok_eof;
+		}
+		int ThisChar = LastChar;
+		LastChar = getChar();
+		return ThisChar;
+	}
+
+private:
+	int getChar() { return Cur == End ? EOF : (unsigned char)*Cur++; }
+
+	const char *Cur, *End;
+	char LastChar = ' ';
+};
+
+// Lexer input from Text, in pieces of at most Piece bytes (random sizes up
+// to that with a generator)
+static Lexer::ReadFn reader(const std::string &Text, size_t Piece,
+		std::mt19937_64 *Random = nullptr) {
+	auto Pos = std::make_shared<size_t>(0);
+	return [&Text, Piece, Random, Pos](char *Buf, size_t Size) {
+		size_t N = std::min({Size, Piece, Text.size() - *Pos});
+		if (Random && N > 1) {
+			N = 1 + (*Random)() % N;
+		}
+		memcpy(Buf, Text.data() + *Pos, N);
+		*Pos += N;
+		return N;
+	};
+}
+
+// Definitions and calls with numbers of all lengths, and a few comments
+static std::string makeSource(size_t Bytes) {
+	std::mt19937_64 Random(42);
+	std::string Source;
+	char Num[64];
+	auto number = [&] {
+		double D = std::ldexp(double(Random() >> 11), -53) * std::pow(10.0, int(Random() % 12) - 4);
+		snprintf(Num, sizeof(Num), "%.*f", int(Random() % 17), D);
+		return Num;
+	};
+	for (unsigned I = 0; Source.size() < Bytes; I++) {
+		Source += "def poly_" + std::to_string(I) + "(x y) x * " + number() + " + y * ";
+		Source += number();
+		Source += " - (x - ";
+		Source += number();
+		Source += ") * (y + ";
+		Source += number();
+		Source += ");\n";
+		if (I % 16 == 0) {
+			Source += "# coefficients fitted for the range of the table\n";
+		}
+		Source += "poly_" + std::to_string(I) + "(";
+		Source += number();
+		Source += ", ";
+		Source += number();
+		Source += ");\n";
+	}
+	return Source;
+}
+
+// Tokens, and the sum of every number and identifier length as a checksum
+template <typename L>
+static std::pair<size_t, double> lexAll(L &Lex) {
+	size_t Tokens = 0;
+	double Sum = 0;
+	for (int Tok; (Tok = Lex.gettok()) != tok_eof; Tokens++) {
+		if (Tok == tok_number) {
+			Sum += Lex.NumValue;
+		}
+		else if (Tok == tok_identifier) {
+			Sum += Lex.IdentifierString.size();
+		}
+	}
+	return {Tokens, Sum};
+}
+
+template <typename Body>
+static void measure(const char *What, size_t Bytes, unsigned Rounds, Body B) {
+	auto Start = std::chrono::steady_clock::now();
+	std::pair<size_t, double> R;
+	for (unsigned i = 0; i < Rounds; i++) {
+		R = B();
+	}
+	std::chrono::duration<double> Elapsed = std::chrono::steady_clock::now() - Start;
+	printf("%-28s %8.1f MB/s   (%zu tokens, checksum %.17g)\n", What,
+			Bytes * Rounds / Elapsed.count() / 1e6, R.first, R.second);
+}
+
+static int bench(size_t Megabytes) {
+	std::string Source = makeSource(Megabytes << 20);
+	unsigned Rounds = 5;
+
+	measure("reference lexer", Source.size(), Rounds, [&] {
+		ReferenceLexer Lex(Source);
+		return lexAll(Lex);
+	});
+	measure("Lexer, from a string", Source.size(), Rounds, [&] {
+		Lexer Lex;
+		Lex.reset(StringRef(Source));
+		return lexAll(Lex);
+	});
+	measure("Lexer, from a reader", Source.size(), Rounds, [&] {
+		Lexer Lex;
+		Lex.reset(reader(Source, 4096));
+		return lexAll(Lex);
+	});
+	return 0;
+}
+
+// Decimal strings that are hard to round: random digits of any length,
+// doubles printed to some precision, and the exact halfway point between
+// two neighbouring doubles (and the numbers just above and below it, at
+// long double precision), which has up to 1075 fractional digits
+static std::string makeCase(std::mt19937_64 &Random) {
+	static char Buf[2048];
+	uint64_t Bits = Random() % (uint64_t(0x7FF) << 52); // positive and finite
+	double D;
+	memcpy(&D, &Bits, sizeof(D));
+
+	switch (Random() % 4) {
+	case 0: {
+		std::string S;
+		for (unsigned N = Random() % 30; N--;) {
+			S += char('0' + Random() % 10);
+		}
+		if (Random() % 2) {
+			S += '.';
+			for (unsigned N = Random() % 30; N--;) {
+				S += char('0' + Random() % 10);
+			}
+		}
+		return S.empty() ? "0" : S;
+	}
+	case 1:
+		snprintf(Buf, sizeof(Buf), "%.*f", int(Random() % 40), D);
+		return Buf;
+	default: {
+		long double Mid = ((long double)D + std::nextafter(D, INFINITY)) / 2;
+		switch (Random() % 3) {
+		case 1: Mid = std::nextafter(Mid, (long double)INFINITY); break;
+		case 2: Mid = std::nextafter(Mid, (long double)0); break;
+		}
+		snprintf(Buf, sizeof(Buf), "%.1200Lf", Mid);
+		std::string S = Buf;
+		S.erase(S.find_last_not_of('0') + 1);
+		return S;
+	}
+	}
+}
+
+static int verify(unsigned Cases) {
+	std::mt19937_64 Random(7);
+	std::vector<std::string> Numbers;
+	std::string Text;
+	for (unsigned I = 0; I < Cases; I++) {
+		Numbers.push_back(makeCase(Random));
+		Text += Numbers.back();
+		Text += I % 8 ? " " : "\n";
+	}
+
+	unsigned Bad = 0;
+	auto check = [&](Lexer &Lex, const char *How) {
+		for (auto &N : Numbers) {
+			double Expected = strtod(N.c_str(), nullptr);
+			int Tok = Lex.gettok();
+			if (Tok != tok_number || memcmp(&Expected, &Lex.NumValue, sizeof(double))) {
+				if (Bad++ < 10) {
+					fprintf(stderr, "%s: %.60s%s: got %a, strtod %a\n", How, N.c_str(),
+							N.size() > 60 ? "..." : "", Lex.NumValue, Expected);
+				}
+			}
+		}
+		if (Lex.gettok() != tok_eof) {
+			fprintf(stderr, "%s: tokens after the last number\n", How);
+			Bad++;
+		}
+	};
+	Lexer Lex;
+	Lex.reset(StringRef(Text));
+	check(Lex, "string");
+	Lex.reset(reader(Text, 7, &Random));
+	check(Lex, "reader");
+
+	// The whole token stream, as the reference lexer has it
+	std::string Source = makeSource(1 << 20);
+	for (int FromReader = 0; FromReader < 2; FromReader++) {
+		ReferenceLexer Ref(Source);
+		if (FromReader) {
+			Lex.reset(reader(Source, 5, &Random));
+		}
+		else {
+			Lex.reset(StringRef(Source));
+		}
+		int Tok;
+		do {
+			Tok = Lex.gettok();
+			int RefTok = Ref.gettok();
+			if (Tok != RefTok ||
+					(Tok == tok_identifier && Lex.IdentifierString != Ref.IdentifierString) ||
+					(Tok == tok_number && memcmp(&Lex.NumValue, &Ref.NumValue, sizeof(double)))) {
+				fprintf(stderr, "%s: token %d, the reference lexer has %d\n",
+						FromReader ? "reader" : "string", Tok, RefTok);
+				Bad++;
+				break;
+			}
+		} while (Tok != tok_eof);
+	}
+
+	printf("%u numbers, each from a string and a reader: %u wrong\n", Cases, Bad);
+	return Bad != 0;
+}
+
+int main(int argc, char **argv) {
+	StringRef Arg = argc > 1 ? argv[1] : "";
+	if (Arg.consume_front("--verify")) {
+		unsigned Cases = 200000;
+		if (Arg.consume_front("=") && Arg.getAsInteger(10, Cases)) {
+			fprintf(stderr, "usage: bench/lexer --verify[=cases]\n");
+			return 2;
+		}
+		return verify(Cases);
+	}
+	return bench(argc > 1 ? atoi(argv[1]) : 16);
+}
@@ -0,0 +1,162 @@
+#!/usr/bin/env python3
+"""Benchmark harness for the Kaleidoscope JIT.
+
+Runs generated corpora (see gen.py) and the fixed kernels in kernels/
+through `kaleidoscope --stats=json`, and reports per workload:
+
+  parse_mb_s     input bytes / (lex + parse time)
+  defs_per_s     definitions / time spent on definitions
+  exprs_per_s    top-level expressions / time spent on them
+  exec_ms        time spent running JIT'd code
+  peak_rss_mb    peak resident set size of the process
+  wall_ms        wall clock time of the whole run
+  mmap_calls     mmaps made for JIT'd code and data (see --linker)
+  mprotect_calls mprotects made for them
+
+Each workload is run --repeat times and the median is kept. Results are
+written as JSON to --out; with --baseline, they are compared against an
+earlier results file and regressions beyond --threshold are flagged.
+"""
+
+import argparse
+import json
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+import gen
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+# name -> gen.generate() arguments
+CORPORA = {
+    "defs-500": dict(defs=500, depth=4, size=12, ratio=0.2),
+    "defs-deep": dict(defs=200, depth=20, size=12, ratio=0.2),
+    "exprs-repl": dict(defs=50, depth=3, size=8, ratio=20),
+    "big-bodies": dict(defs=50, depth=2, size=300, ratio=1),
+}
+
+# (metric, True if higher is better)
+METRICS = [
+    ("parse_mb_s", True),
+    ("defs_per_s", True),
+    ("exprs_per_s", True),
+    ("exec_ms", False),
+    ("peak_rss_mb", False),
+    ("wall_ms", False),
+    ("mmap_calls", False),
+    ("mprotect_calls", False),
+]
+
+
+def run_once(binary, path, flags):
+    with open(path, "rb") as src:
+        start = time.perf_counter()
+        proc = subprocess.Popen([binary, "--stats=json"] + flags, stdin=src,
+                                stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+        out = proc.stdout.read()
+        _, status, usage = os.wait4(proc.pid, 0)
+        wall = time.perf_counter() - start
+    if status != 0:
+        sys.exit("%s failed on %s (status %d)" % (binary, path, status))
+
+    stats = json.loads(out)
+    items = stats["items"]
+    totals = stats["totals"]["seconds"]
+    jit = stats["totals"]
+
+    def spent(kind):
+        return sum(sum(i["seconds"].values()) for i in items if i["kind"] == kind)
+
+    defs = sum(1 for i in items if i["kind"] == "definition")
+    exprs = sum(1 for i in items if i["kind"] == "expression")
+    front = totals["lex"] + totals["parse"]
+    return {
+        "parse_mb_s": os.path.getsize(path) / front / 1e6 if front else 0,
+        "defs_per_s": defs / spent("definition") if defs else 0,
+        "exprs_per_s": exprs / spent("expression") if exprs else 0,
+        "exec_ms": 1e3 * totals["execute"],
+        "peak_rss_mb": usage.ru_maxrss / 1024.0,  # KiB on Linux
+        "wall_ms": 1e3 * wall,
+        "mmap_calls": jit["mmap_calls"],
+        "mprotect_calls": jit["mprotect_calls"],
+    }
+
+
+def run(binary, path, flags, repeat):
+    runs = [run_once(binary, path, flags) for _ in range(repeat)]
+    return {m: statistics.median(r[m] for r in runs) for m, _ in METRICS}
+
+
+def workloads(tmpdir, only):
+    for name, params in sorted(CORPORA.items()):
+        if only and name not in only:
+            continue
+        source, _, _ = gen.generate(seed=1, **params)
+        path = os.path.join(tmpdir, name + ".k")
+        with open(path, "w") as f:
+            f.write(source)
+        yield name, path
+
+    kernels = os.path.join(HERE, "kernels")
+    for kernel in sorted(os.listdir(kernels)):
+        name = "kernel-" + os.path.splitext(kernel)[0]
+        if only and name not in only:
+            continue
+        yield name, os.path.join(kernels, kernel)
+
+
+def compare(results, baseline, threshold):
+    regressions = 0
+    print("\n%-18s %-12s %12s %12s %8s" % ("workload", "metric", "baseline", "now", "change"))
+    for name, metrics in sorted(results.items()):
+        old = baseline.get(name)
+        if not old:
+            continue
+        for metric, higher_better in METRICS:
+            a, b = old.get(metric, 0), metrics[metric]
+            change = (b - a) / a if a else 0
+            worse = -change if higher_better else change
+            flag = "  REGRESSION" if worse > threshold else ""
+            regressions += bool(flag)
+            print("%-18s %-12s %12.2f %12.2f %+7.1f%%%s" % (name, metric, a, b, 100 * change, flag))
+    return regressions
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    ap.add_argument("--binary", default=os.path.join(HERE, "..", "kaleidoscope"))
+    ap.add_argument("--repeat", type=int, default=3)
+    ap.add_argument("--out", help="write results as JSON")
+    ap.add_argument("--baseline", help="compare against an earlier --out file")
+    ap.add_argument("--threshold", type=float, default=0.10,
+                    help="relative change counted as a regression (default 0.10)")
+    ap.add_argument("--flags", default="", help="extra kaleidoscope options")
+    ap.add_argument("workloads", nargs="*", help="only run these workloads")
+    args = ap.parse_args()
+
+    results = {}
+    with tempfile.TemporaryDirectory() as tmpdir:
+        print("%-18s" % "workload" + "".join("%13s" % m for m, _ in METRICS))
+        for name, path in workloads(tmpdir, args.workloads):
+            results[name] = run(args.binary, path, args.flags.split(), args.repeat)
+            print("%-18s" % name + "".join("%13.2f" % results[name][m] for m, _ in METRICS))
+            sys.stdout.flush()
+
+    if args.out:
+        with open(args.out, "w") as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+            f.write("\n")
+
+    if args.baseline and os.path.exists(args.baseline):
+        with open(args.baseline) as f:
+            if compare(results, json.load(f), args.threshold):
+                return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,100 @@
+// Embedding Kaleidoscope through libkaleidoscope: compile sources, read the
+// values of their top level expressions, call what they defined, and get the
+// compiler's errors back as values. Exits non-zero if anything is off.
+//
+// Usage: examples/embed
+
+#include "../Kaleidoscope.h"
+#include <cstdio>
+
+using namespace llvm;
+
+static int Failures = 0;
+
+static void check(bool OK, const char *What) {
+	if (!OK) {
+		fprintf(stderr, "FAILED: %s\n", What);
+		Failures++;
+	}
+}
+
+// The error message of a compile that must fail, "" if it did not
+static std::string errorOf(Expected<kaleidoscope::Module> M) {
+	return M ? "" : toString(M.takeError());
+}
+
+int main() {
+	auto C = kaleidoscope::Compiler::create();
+	if (!C) {
+		fprintf(stderr, "%s\n", toString(C.takeError()).c_str());
+		return 1;
+	}
+	kaleidoscope::Compiler& K = **C;
+
+	auto M = K.compile("extern sqrt(x)\n"
+			"def hyp(a b) sqrt(a*a + b*b)\n"
+			"hyp(3, 4)\n");
+	if (!M) {
+		fprintf(stderr, "%s\n", toString(M.takeError()).c_str());
+		return 1;
+	}
+	check(M->functions() == std::vector<std::string>{"hyp"}, "functions of the module");
+	check(M->results() == std::vector<double>{5}, "results of the module");
+
+	auto Hyp = M->getFunction<double(double, double)>("hyp");
+	check(Hyp && (*Hyp)(6, 8) == 10, "calling hyp");
+	if (!Hyp) {
+		consumeError(Hyp.takeError());
+	}
+
+	// Later sources see earlier definitions
+	auto M2 = K.compile("def twice(x) 2 * hyp(x, 0); twice(21)");
+	check(M2 && M2->results() == std::vector<double>{42}, "calling an earlier definition");
+	if (!M2) {
+		consumeError(M2.takeError());
+	}
+
+	auto Sqrt = M->getFunction<double(double)>("sqrt");
+	check(!Sqrt && toString(Sqrt.takeError()).find("not defined by this module") != std::string::npos,
+			"functions of other modules");
+
+	auto Missing = K.getFunction<double()>("nosuch");
+	check(!Missing, "looking up an undefined function");
+	if (!Missing) {
+		consumeError(Missing.takeError());
+	}
+
+	check(errorOf(K.compile("def f(x) y")).find("Undefined reference: y") != std::string::npos,
+			"undefined variable");
+	check(errorOf(K.compile("nosuch(1)")).find("undefined function: nosuch") != std::string::npos,
+			"undefined function");
+	check(errorOf(K.compile("def (x) x")).find("Expected function name") != std::string::npos,
+			"syntax error");
+
+	// Errors from the JIT come back the same way, and the compiler goes on
+	check(errorOf(K.compile("def hyp(a b) a")).find("Duplicate definition") != std::string::npos,
+			"redefinition");
+	check(errorOf(K.compile("def hyp(a) a")).find("Duplicate definition") != std::string::npos,
+			"redefinition with other parameters");
+	auto M3 = K.compile("hyp(5, 12)");
+	check(M3 && M3->results() == std::vector<double>{13}, "compiling after an error");
+	if (!M3) {
+		consumeError(M3.takeError());
+	}
+
+	// Arrays from the host: the data and the number of elements
+	auto M4 = K.compile("def total(a[]) sum(a * 2)");
+	auto Total = K.getFunction<double(const double *, int64_t)>("total");
+	const double Data[] = {1, 2, 3, 4, 5};
+	check(M4 && Total && (*Total)(Data, 5) == 30 && (*Total)(Data + 1, 2) == 10,
+			"calling with a host array");
+	if (!M4) {
+		consumeError(M4.takeError());
+	}
+	if (!Total) {
+		consumeError(Total.takeError());
+	}
+
+	printf("%s\n", Failures ? "embedding checks failed" : "embedding checks passed");
+	return Failures ? 1 : 0;
+}
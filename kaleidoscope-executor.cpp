@@ -0,0 +1,63 @@
+// The process `kaleidoscope --executors=N` runs JIT'd code in: serves ORC's
+// simple remote executor protocol on the two pipe file descriptors it is
+// given until the compiler disconnects. The compiler links code into it
+// through the memory manager service, and calls it through wrapper functions.
+//
+// Usage: kaleidoscope-executor IN_FD OUT_FD
+
+#include "ArrayArena.h"
+#include "ParallelRuntime.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/Orc/Shared/SimpleRemoteEPCUtils.h"
+#include "llvm/ExecutionEngine/Orc/TargetProcess/SimpleExecutorMemoryManager.h"
+#include "llvm/ExecutionEngine/Orc/TargetProcess/SimpleRemoteEPCServer.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/Signals.h"
+#include <cstdio>
+
+using namespace llvm;
+using namespace llvm::orc;
+
+// Exported (the executor is linked with --export-dynamic) for `parallel for`
+// loops and arrays, which JIT'd code finds with dlsym
+extern "C" double __kparallel_for(WorkStealingPool::ChunkFn Fn, const void *Env,
+		double Start, double End) {
+	return WorkStealingPool::get().parallelFor(Fn, Env, Start, End);
+}
+
+extern "C" void __karena_enter() {
+	ArrayArena::get().enter();
+}
+
+extern "C" void __karena_leave() {
+	ArrayArena::get().leave();
+}
+
+extern "C" void *__karena_alloc(int64_t Bytes) {
+	return ArrayArena::get().allocate(Bytes);
+}
+
+int main(int argc, char **argv) {
+	int InFD, OutFD;
+	if (argc != 3 || StringRef(argv[1]).getAsInteger(10, InFD) ||
+			StringRef(argv[2]).getAsInteger(10, OutFD)) {
+		fprintf(stderr, "Usage: %s IN_FD OUT_FD\n", argv[0]);
+		return 1;
+	}
+
+	// A crash in JIT'd code is reported by the compiler as well, but only
+	// the executor can say where
+	sys::PrintStackTraceOnErrorSignal(argv[0]);
+
+	ExitOnError ExitOnErr("kaleidoscope-executor: ");
+	auto Server = ExitOnErr(SimpleRemoteEPCServer::Create<FDSimpleRemoteEPCTransport>(
+		[](SimpleRemoteEPCServer::Setup& S) -> Error {
+			S.setDispatcher(std::make_unique<SimpleRemoteEPCServer::ThreadDispatcher>());
+			S.bootstrapSymbols() = SimpleRemoteEPCServer::defaultBootstrapSymbols();
+			S.services().push_back(std::make_unique<rt_bootstrap::SimpleExecutorMemoryManager>());
+			return Error::success();
+		},
+		InFD, OutFD));
+	ExitOnErr(Server->waitForDisconnect());
+	return 0;
+}
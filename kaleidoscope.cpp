@@ -1,1013 +1,738 @@
-#include "KaleidoscopeJIT.h"
-#include "llvm/ADT/APFloat.h"
-#include "llvm/ADT/STLExtras.h"
-#include "llvm/IR/BasicBlock.h"
-#include "llvm/IR/Constants.h"
-#include "llvm/IR/DerivedTypes.h"
-#include "llvm/IR/Function.h"
-#include "llvm/IR/IRBuilder.h"
-#include "llvm/IR/LLVMContext.h"
-#include "llvm/IR/LegacyPassManager.h"
-#include "llvm/IR/Module.h"
-#include "llvm/IR/Type.h"
+//===- kaleidoscope.cpp - The Kaleidoscope REPL, stream and server --------===//
+//
+// The command line driver around libkaleidoscope: options, the REPL, the
+// --stream pipeline, the --server/--connect socket mode, and the reports
+// printed at exit.
+//
+//===----------------------------------------------------------------------===//
+
+#include "CompilerSession.h"
+#include "ParallelRuntime.h"
+#include "llvm/IR/PassTimingInfo.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
 #include "llvm/Support/TargetSelect.h"
-#include "llvm/Target/TargetMachine.h"
-#include "llvm/Transforms/InstCombine/InstCombine.h"
-#include "llvm/Transforms/Scalar.h"
-#include "llvm/Transforms/Scalar/GVN.h"
+#include <condition_variable>
+#include <deque>
+#include <future>
 #include <iostream>
-#include <string>
-#include <vector>
-#include <memory>
-#include <map>
-#include <cctype>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
-#include <unordered_map>
-
-using namespace llvm;
-
-using namespace llvm::orc;
-
-#define IRGEN true
-
-// ---Lexer---
-
-typedef enum {
-		// EOF
-		tok_eof = -1,
-
-		// keywords
-		tok_def = -2,
-		tok_extern = -3,
-
-		// things
-		tok_number = -4,
-		tok_identifier = -5,
-
-		tok_error = -6
-}Token_t;
-
-static std::string IdentifierString;
-static double NumValue;
-
-static int gettok(void){
-		static char LastChar = ' ';
-
-		while(isspace(LastChar)){
-				LastChar = getchar();
-		}
-
-		if (isalpha(LastChar)){
-				IdentifierString = "";
-				while(isalnum(LastChar) || LastChar == '_'){
-						IdentifierString += LastChar;
-						LastChar = getchar();
-				}
-				if (IdentifierString == "def"){
-						return tok_def;
-				}
-				else if (IdentifierString == "extern"){
-						return tok_extern;
-				}
-				else{
-						return tok_identifier;
-				}
-		}
-		else if (isdigit(LastChar) || LastChar == '.'){
-				std::string NumStr = "";
-				bool decimal = false;
-				while(isdigit(LastChar) || (!decimal && (LastChar == '.'))){
-						NumStr += LastChar;
-						if (LastChar == '.') {
-								decimal = true;
-						}
-						LastChar = getchar();
-				}
+#include <cstring>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+// Options, shared by every session
+static CompilerOptions Options; // -f options and --profile
+static bool PerfMap, JITDump, GDBRegistration; // Profiler/debugger hooks for JIT'd code
+static JITLinker Linker = JITLinker::RTDyld; // What links JIT'd objects into memory
+static std::vector<std::string> Libs; // Shared libraries every JIT binds up front
+static unsigned Threads; // Threads `parallel for` loops run on, 0 for one per CPU
+static std::string ProfileOut; // Also write the profile there, as JSON
+static bool MemoryReport; // Print the memory report at exit
+enum StreamMode { StreamOff, StreamText, StreamBinary };
+static StreamMode Stream = StreamOff; // Pipeline parsing, compiling and running; results go to stdout
+static unsigned StreamDepth = 64; // Items in flight between two pipeline stages
+static bool Verbose = true; // Echo IR and progress to stderr, off when streaming
+static std::string ServerSocket; // Serve sessions on this Unix socket instead of stdin
+static unsigned ServerWorkers; // Sessions served at once, default one per CPU
+static std::string ConnectSocket; // Send stdin to the server there, print what comes back
+static unsigned Executors; // Run JIT'd code in this many executor processes, 0 for in-process
+static std::string ExecutorPath; // The kaleidoscope-executor binary, default next to ours
+static std::string WatchFile; // Run this program, and again each time it changes
+// Prototypes will be codegened in _each_ module, again and again? TODO: check
+static ExitOnError ExitOnErr;
 
-				if (decimal && LastChar == '.'){
-						return tok_error;
-				}
+// -- Statistics --
 
-				NumValue = strtod(NumStr.c_str(), nullptr);
-				return tok_number;
-		}
-		else if (LastChar == '#'){
-				while(LastChar != EOF && LastChar != '\n' && LastChar != '\r') {
-						LastChar = getchar();
+static void writeStats(json::OStream& J, const ItemStats& S) {
+		J.attributeObject("seconds", [&] {
+				for (int i = 0; i < NumPhases; i++) {
+						J.attribute(PhaseNames[i], S.Seconds[i]);
 				}
+		});
+		J.attribute("tokens", (int64_t)S.Tokens);
+		J.attribute("ast_nodes", (int64_t)S.ASTNodes);
+		J.attribute("ir_insts_before_opt", (int64_t)S.IRBefore);
+		J.attribute("ir_insts_after_opt", (int64_t)S.IRAfter);
+		J.attribute("code_bytes", (int64_t)S.CodeBytes);
+		J.attribute("modules_materialized", (int64_t)S.Modules);
+		J.attribute("mmap_calls", (int64_t)S.MMaps);
+		J.attribute("mprotect_calls", (int64_t)S.MProtects);
+}
 
-				if (LastChar != EOF){
-						return gettok(); // LOL, cheap trick, but well played
-				}
-		}
-		else if (LastChar == EOF){
-				return tok_eof;
+// Per-item records and totals: JSON on stdout, or a summary on stderr
+static void PrintStats() {
+		ItemStats Total;
+		for (const auto& item: Items) {
+				Total.add(item);
 		}
-		else {
-				int ThisChar = LastChar;
-				LastChar = getchar();
-				return ThisChar;
+		Total.add(CurItem); // lexing of the final eof
+
+		if (Stats == StatsJSON) {
+				json::OStream J(outs(), 2);
+				J.object([&] {
+						J.attributeArray("items", [&] {
+								for (const auto& item: Items) {
+										J.object([&] {
+												J.attribute("kind", item.Kind);
+												J.attribute("name", item.Name);
+												writeStats(J, item);
+										});
+								}
+						});
+						J.attributeObject("totals", [&] {
+								J.attribute("items", (int64_t)Items.size());
+								writeStats(J, Total);
+						});
+				});
+				outs() << "\n";
+				outs().flush();
+				return;
 		}
 
-		return tok_error;
+		fprintf(stderr, "\n%zu items\n", Items.size());
+		for (int i = 0; i < NumPhases; i++) {
+				fprintf(stderr, "  %-10s %10.3f ms\n", PhaseNames[i], 1e3 * Total.Seconds[i]);
+		}
+		fprintf(stderr, "  tokens %llu, AST nodes %llu, IR instructions %llu -> %llu\n",
+				(unsigned long long)Total.Tokens, (unsigned long long)Total.ASTNodes,
+				(unsigned long long)Total.IRBefore, (unsigned long long)Total.IRAfter);
+		fprintf(stderr, "  modules materialized %llu, code bytes %llu, mmap calls %llu, mprotect calls %llu\n",
+				(unsigned long long)Total.Modules, (unsigned long long)Total.CodeBytes,
+				(unsigned long long)Total.MMaps, (unsigned long long)Total.MProtects);
 }
 
+// -- Profiling --
 
-// State variables
-static std::unique_ptr<LLVMContext> TheContext; 
-static std::unique_ptr<Module> TheModule; // to hold blocks, definitions? (TODO), TODO: why does this have to be a pointer?
-static std::unique_ptr<IRBuilder<>> Builder; // for creating instructions, constants, etc
-static std::unique_ptr<legacy::FunctionPassManager> TheFPM; // Function pass manager
-static std::unordered_map<std::string, Value *> Symbols; // Maps names inside function context to LLVM "values"
-static std::unique_ptr<KaleidoscopeJIT> TheJIT; // JIT engine for Kaleidoscope
-// Prototypes will be codegened in _each_ module, again and again? TODO: check
-static ExitOnError ExitOnErr;
-
-
+static uint64_t ProfileStartCycles;
+static StatsClock::time_point ProfileStartTime;
 
-// The different types of expressions:
-// 
-// ExprAST an expression a + f(b) + 5
-// 
-// 	NumExprAST a number 5
-//
-// 	VariableExprAST an identifier `a`
-//
-// 	CallExprAST a function call `f(b)
-//
-// 	BinaryExprAST a binary expression a + b
-//
-// PrototypeExprAST a function prototype f(a, b, c, d, e)
-//
-// FunctionExprAST a function declaration prototype
-// - f(a, b)
-//       a + f(b) + 5
-
-// --- AST ---
-
-class ASTVisitor;
-
-class ExprAST {
-		public:
-
-				virtual ~ExprAST() {} // if a base class pointer points to a derived class object
-				// when it goes out of scope, it should be
-				// deallocated properly (TODO: understand properly)
-
-				// TODO: throws "undefined reference to vtable for ExprAST" 
-				// if accept is not declared as pure virtual
-				// Why?
-				// Accept function for visitor pattern
-				virtual void accept(ASTVisitor& visitor) = 0;
-
-				// Generate code for sub-AST
-				virtual Value* codegen() = 0; 
-};
+// Functions that were called, by self time, with cycles converted to time
+// using the cycle rate measured over the whole run
+static void PrintProfile() {
+	double Seconds = std::chrono::duration<double>(StatsClock::now() - ProfileStartTime).count();
+	double CyclesPerMs = (ReadCycles() - ProfileStartCycles) / (1e3 * Seconds);
 
-class NumExprAST;
-class VariableExprAST;
-class BinaryExprAST;
-class CallExprAST;
-class PrototypeAST;
-class FunctionAST;
-
-// Visitor class for ExprAST
-
-class ASTVisitor {
-	public:
-
-		virtual void visit(NumExprAST *p_obj) = 0;
-
-		virtual void visit(VariableExprAST *p_obj) = 0;
+	std::vector<ProfileCounters *> Called;
+	uint64_t TotalSelf = 0;
+	for (const auto& C: ProfiledFunctions) {
+		if (C->Calls) {
+			Called.push_back(C.get());
+			TotalSelf += C->SelfCycles;
+		}
+	}
+	std::sort(Called.begin(), Called.end(), [](ProfileCounters *A, ProfileCounters *B) {
+		return A->SelfCycles > B->SelfCycles;
+	});
+
+	fprintf(stderr, "\n%-24s %12s %12s %7s %12s\n", "function", "calls", "self ms", "self%", "incl ms");
+	for (auto *C: Called) {
+		fprintf(stderr, "%-24s %12llu %12.3f %6.1f%% %12.3f\n", C->Name.c_str(),
+				(unsigned long long)C->Calls, C->SelfCycles / CyclesPerMs,
+				TotalSelf ? 100.0 * C->SelfCycles / TotalSelf : 0.0,
+				C->InclusiveCycles / CyclesPerMs);
+	}
 
-		virtual void visit(CallExprAST *p_obj) = 0;
+	if (ProfileOut.empty()) {
+		return;
+	}
 
-		virtual void visit(FunctionAST *p_obj) = 0;
+	std::error_code EC;
+	raw_fd_ostream OS(ProfileOut, EC);
+	if (EC) {
+		fprintf(stderr, "cannot write profile to %s: %s\n", ProfileOut.c_str(), EC.message().c_str());
+		return;
+	}
+	json::OStream J(OS, 2);
+	J.object([&] {
+		J.attribute("cycles_per_ms", CyclesPerMs);
+		J.attributeArray("functions", [&] {
+			for (auto *C: Called) {
+				J.object([&] {
+					J.attribute("name", C->Name);
+					J.attribute("calls", (int64_t)C->Calls);
+					J.attribute("self_cycles", (int64_t)C->SelfCycles);
+					J.attribute("inclusive_cycles", (int64_t)C->InclusiveCycles);
+				});
+			}
+		});
+	});
+	OS << "\n";
+}
 
-		virtual void visit(PrototypeAST *p_obj) = 0;
+// -- Commands --
 
-		virtual void visit(BinaryExprAST *p_obj) = 0;
+// Resident set size of this process, in bytes
+static uint64_t ProcessRSS() {
+	unsigned long long Pages = 0, Resident = 0;
+	if (FILE *statm = fopen("/proc/self/statm", "r")) {
+		if (fscanf(statm, "%llu %llu", &Pages, &Resident) != 2) {
+			Resident = 0;
+		}
+		fclose(statm);
+	}
+	return Resident * sys::Process::getPageSizeEstimate();
+}
 
-};
+// What is keeping memory alive: LLVM contexts (each module not yet compiled
+// by the JIT still holds its context and IR), JIT'd code and data per resource
+// tracker, and the front end's own caches
+static void PrintMemoryReport(CompilerSession& S, FILE *Out) {
+	S.TheJIT->sweepSymbolStrings();
+	auto Trackers = S.TheJIT->getTrackerMemory();
+	const JITStats& JS = S.TheJIT->getStats();
+
+	unsigned Pending = 0;
+	uint64_t PendingInstructions = 0;
+	for (const auto& T: Trackers) {
+		Pending += T.PendingModules;
+		PendingInstructions += T.PendingInstructions;
+	}
 
-std::unique_ptr<ExprAST> LogError(const char *Str) {
-		fprintf(stderr, "LogError: %s\n", Str);
-		return nullptr;
+	fprintf(Out, "Memory:\n");
+	fprintf(Out, "  process RSS          %llu KiB\n", (unsigned long long)ProcessRSS() / 1024);
+	fprintf(Out, "  contexts alive       %u (%u holding IR not compiled yet, 1 being built)\n",
+			Pending + 1, Pending);
+	fprintf(Out, "  IR instructions      %llu waiting, %u in the module being built\n",
+			(unsigned long long)PendingInstructions, S.TheModule->getInstructionCount());
+	fprintf(Out, "  JIT objects          %llu: %llu code bytes, %llu data bytes\n",
+			(unsigned long long)JS.LiveObjects, (unsigned long long)JS.LiveCodeBytes,
+			(unsigned long long)JS.LiveDataBytes);
+	fprintf(Out, "  JIT mappings         %llu KiB mapped; %llu mmap, %llu mprotect, %llu munmap calls\n",
+			(unsigned long long)JS.MappedBytes / 1024, (unsigned long long)JS.MMaps,
+			(unsigned long long)JS.MProtects, (unsigned long long)JS.MUnmaps);
+	fprintf(Out, "  resource trackers    %zu\n", Trackers.size());
+	for (const auto& T: Trackers) {
+		std::string Name = T.IsDefault ? "<definitions>" : T.Functions.empty() ? "<empty>" : T.Functions[0];
+		fprintf(Out, "    %-20s %4zu functions %4u objects %8llu code %8llu data %4u pending\n",
+				Name.c_str(), T.Functions.size(), T.Objects, (unsigned long long)T.CodeBytes,
+				(unsigned long long)T.DataBytes, T.PendingModules);
+	}
+	fprintf(Out, "  front end            %zu prototypes, %zu definitions kept, %zu specializations,\n",
+			S.FunctionProtos.size(), S.FunctionDefs.size(), S.Specializations.size());
+	fprintf(Out, "                       %zu cached expressions, %zu profiled functions\n",
+			S.ExprCache->size(), ProfiledFunctions.size());
 }
 
-// TODO: what is this for?
-std::unique_ptr<PrototypeAST> LogErrorP(const char *Str) {
-		LogError(Str);
-		return nullptr;
+static void RunCommand(CompilerSession& S, const std::string& Name, FILE *Out) {
+		if (Name == "memory") {
+				PrintMemoryReport(S, Out);
+		} else {
+				S.LogError("unknown command, expected ':memory'");
+		}
 }
 
-// For logging errors while doing codegeneration- returns a `null` value, and prints error
-Value *LogErrorV(const char *Str) {
-  LogError(Str);
-  return nullptr;
+// Where a session's errors go; IR and progress notes go to stderr if Verbose
+static void AttachOutput(CompilerSession& S, FILE *Out) {
+	S.OnError = [Out](const std::string& Msg) {
+		fprintf(Out, "LogError: %s\n", Msg.c_str());
+	};
+	S.Echo = Verbose ? &errs() : nullptr;
 }
 
-class NumExprAST: public ExprAST {
-		private: // default access is private, be explicit
-				double Val; 
-		public:
-				NumExprAST(double Val): Val(Val) {}
-				Value* codegen();
-				void accept(ASTVisitor& visitor) { visitor.visit(this); }
-				double GetVal() { return Val; }
-};
-
-
-
-
-class VariableExprAST: public ExprAST {
-		private:
-				std::string Name;
-		public:
-				VariableExprAST(const std::string &Name): Name(Name) {};
-				Value *codegen();
-				void accept(ASTVisitor& visitor) { visitor.visit(this); }
-				// Reference used because the string is not going to be used later
-				// again, so why waste space? (and it's not going to be modified, so
-				// const
-				std::string& GetName() { return Name; }
-};
-
-
-
-class CallExprAST: public ExprAST {
-		private:
-				std::string Callee;
-		public:
-				// TODO: figure out a way to keep this private
-				std::vector<std::unique_ptr <ExprAST> > Args;
-
-				CallExprAST(std::string &Callee, 
-								std::vector< std::unique_ptr <ExprAST> > Args_):
-						Callee(Callee), Args(std::move(Args_)) {}
-				// TODO: figure out why I need to use move here (because vector itself
-				// is not a unique_ptr!, to get deleted before use)
-				// probably so because moving a vector does not move it's contents, just
-				// it's meta information, while moving a string moves its contents
-				Value *codegen();
-				void accept(ASTVisitor& visitor) { visitor.visit(this); }
-				std::string& GetCallee() { return Callee; }
-};
-
-class BinaryExprAST: public ExprAST {
-		private: 
-				char Op;
-		public:
-				// TODO: figure out a way to keep these private
-				std::unique_ptr<ExprAST> LHS, RHS;
-				BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS,
-								std::unique_ptr<ExprAST> RHS):
-						Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
-				Value *codegen();
-				void accept(ASTVisitor& visitor) { visitor.visit(this); }
-				char GetOp() { return Op; }
-};
-
-// Neither a prototype, nor a function is an "expression"
-
-class PrototypeAST {
-		private:
-				std::string Name;
-				std::vector< std::string > Args;
-		public:
-				PrototypeAST(const std::string &Name, 
-								std::vector< std::string> Args):
-						Name(Name), Args(std::move(Args)) {}
-				Function* codegen();
-
-				void accept(ASTVisitor& visitor) { visitor.visit(this); }
-				std::string& GetName() { return Name; }
-				std::vector<std::string>& GetArgs() { return Args; }
-};
-
-class FunctionAST {
-		private:
-				// this is a tree! these should be pointers to members!
-				// (a function should be an object pointing to these things, not an
-				// object *containing* these things
-		public:
-				// TODO: Figure out a way to make these
-				// unique_ptr members private, and still
-				// access them from the visitor 
-				std::unique_ptr<PrototypeAST> Proto;
-				std::unique_ptr<ExprAST> Body;
-
-				FunctionAST(std::unique_ptr<PrototypeAST> Proto, 
-								std::unique_ptr<ExprAST> Body):
-						Proto(std::move(Proto)), Body(std::move(Body)) {}
-				// probably when I am getting passed a unique_ptr, the compiler sees
-				// that it will get deleted when it goes out of scope- *move* is used to
-				// indicate that I want to be a cannibal
-
-				Function* codegen();
-
-				void accept(ASTVisitor& visitor) { visitor.visit(this); }
-};
-
-
-
-static int CurTok;
+// Feeds the lexer whatever is read from Fd, as soon as it is there
+static Lexer::ReadFn ReadFd(int Fd) {
+	return [Fd](char *Buf, size_t Size) -> size_t {
+		ssize_t N;
+		do {
+			N = read(Fd, Buf, Size);
+		} while (N < 0 && errno == EINTR);
+		return N > 0 ? N : 0;
+	};
+}
 
-static void print_tok() {
-		switch(CurTok) {
-				case tok_number:
-						std::cout << "(" << CurTok << ", " <<  NumValue << ")" << std::endl;
+// top = definition | expression | external | load | command | ;
+// Prompts, results and command output go to Out; Quiet leaves out the
+// prompt and prints results as bare %.17g lines (server sessions)
+static void MainLoop(CompilerSession& S, FILE *Out, bool Quiet) {
+	while(true) {
+		if (!Quiet) {
+			fprintf(Out, "ready>");
+		}
+		switch (S.CurTok) {
+				case tok_eof:
+						return;
 						break;
-				case tok_identifier:
-						std::cout << "(" << CurTok << ", " << IdentifierString << ")" << std::endl;
+				case tok_def:
+						beginItem(S.TheJIT->getStats());
+						S.HandleDefinition();
+						endItem("definition", S.TheJIT->getStats());
 						break;
-				case tok_def: case tok_extern:
-						std::cout << "(" << CurTok << ", " << IdentifierString << ")" << std::endl;
+				case tok_extern:
+						beginItem(S.TheJIT->getStats());
+						S.HandleExtern();
+						endItem("extern", S.TheJIT->getStats());
 						break;
-				case tok_eof:
-						std::cout << "(" << "End" << "," << 0 << ")" << std::endl;
+				case tok_load:
+						S.HandleLoad();
 						break;
-				case tok_error:
-						std::cout << "(" << "Error" << "," << 0 << ")" << std::endl;
+				case ';':
+						S.getNextToken();
+						break;
+				case ':':
+						RunCommand(S, S.ParseCommand(), Out);
 						break;
 				default:
-						std::cout << "(" << (char)CurTok << "," << 0 << ")" << std::endl;
+						beginItem(S.TheJIT->getStats());
+						if (auto val = S.HandleTopLevelExpression()) {
+								if (Quiet) {
+										fprintf(Out, "%.17g\n", *val);
+								} else {
+										fprintf(Out, "Evaluated to %lf\n", *val);
+								}
+						}
+						endItem("expression", S.TheJIT->getStats());
 						break;
 		}
+	}
 }
 
-// -- Parser --
-
-int getNextToken() {
-		CurTok = gettok();
-		//print_tok();
-		return CurTok;
-}
-
-// LISP-like pretty-printer
 
-class LispPrintVisitor : public ASTVisitor {
+// -- Streaming --
+//
+// Parsing, compiling and running are pipeline stages on threads of their
+// own, connected by bounded queues, so a long input runs at the pace of its
+// slowest stage instead of the sum of all three. The parser owns the lexer;
+// the compiler owns the module being built and all of the front end's
+// caches; the executor only calls code that the compiler has materialized.
+
+template <typename T>
+class BoundedQueue {
 	public:
-
-		LispPrintVisitor(): nesting_depth(0) {}
-
-		void visit(NumExprAST *p_obj) {
-				std::cout << std::string(2 * nesting_depth, ' ') << p_obj->GetVal();
-		}
-
-		void visit(VariableExprAST *p_obj) {
-				std::cout << std::string(2 * nesting_depth, ' ') << p_obj->GetName();
+		explicit BoundedQueue(size_t Capacity) : Capacity(Capacity) {}
+
+		// Blocks while the queue is full
+		void push(T Item) {
+				std::unique_lock<std::mutex> Lock(Mutex);
+				NotFull.wait(Lock, [&] { return Items.size() < Capacity; });
+				Items.push_back(std::move(Item));
+				NotEmpty.notify_one();
 		}
 
-		void visit(CallExprAST *p_obj) {
-				std::cout << std::string(2 * nesting_depth, ' ') << '(' << p_obj->GetCallee();
-				++nesting_depth;
-				for (const auto& arg: p_obj->Args) {
-						std::cout << std::endl;
-						arg->accept(*this);
+		// Blocks while the queue is empty; None once it is closed and drained
+		Optional<T> pop() {
+				std::unique_lock<std::mutex> Lock(Mutex);
+				NotEmpty.wait(Lock, [&] { return !Items.empty() || Closed; });
+				if (Items.empty()) {
+						return None;
 				}
-				--nesting_depth;
-				std::cout << ')';
+				T Item = std::move(Items.front());
+				Items.pop_front();
+				NotFull.notify_one();
+				return std::move(Item);
 		}
 
-		void visit(FunctionAST *p_obj) {
-				p_obj->Proto->accept(*this);
-				std::cout << std::endl;
-				++nesting_depth;
-				p_obj->Body->accept(*this);
-				--nesting_depth;
-		}
-
-		void visit(PrototypeAST *p_obj) {
-				std::cout << "(def (" << p_obj->GetName();
-				for (auto arg: p_obj->GetArgs()) {
-						std::cout << ' ' << arg;
-				}
-				std::cout << ')';
-		}
-
-		void visit(BinaryExprAST *p_obj) {
-				std::cout << std::string(2 * nesting_depth, ' ') << '(' << p_obj->GetOp() << std::endl;
-				++nesting_depth;
-				p_obj->LHS->accept(*this);
-				std::cout << std::endl;
-				p_obj->RHS->accept(*this);
-				--nesting_depth;
-				std::cout << ")";
+		// No more pushes
+		void close() {
+				std::lock_guard<std::mutex> Lock(Mutex);
+				Closed = true;
+				NotEmpty.notify_all();
 		}
 
 	private:
-		int nesting_depth;
-
+		size_t Capacity;
+		std::mutex Mutex;
+		std::condition_variable NotEmpty, NotFull;
+		std::deque<T> Items;
+		bool Closed = false;
 };
 
+// Handed from the parser to the compiler
+struct ParsedItem {
+	int Kind; // tok_def, tok_extern, tok_load, ':' for a command, 0 for an expression
+	std::unique_ptr<FunctionAST> Func; // none for an expression that did not parse
+	std::unique_ptr<PrototypeAST> Proto;
+	std::string Command; // or the library to load
+	// Set once the compiler is done with it, for a parser that has to wait
+	std::unique_ptr<std::promise<void>> Done;
+};
 
-static std::unique_ptr<ExprAST> ParseNumberExpr();
-
-static std::unique_ptr<ExprAST> ParseParenExpr();
-
-static std::unique_ptr<ExprAST> ParseIdentifierExpr();
-
-static std::unique_ptr<ExprAST> ParsePrimary();
-
-static std::unique_ptr<ExprAST> ParseExpression();
-
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int, std::unique_ptr<ExprAST>);
-
-
-// numberexpr ::= number
-// the number has already been detected in gettok() and is present in 
-static std::unique_ptr<ExprAST> ParseNumberExpr() {
-		auto numberExpr = std::make_unique<NumExprAST>(NumValue);
-		getNextToken();
-		//fprintf(stderr, "debug: numberexpr\n");
-		return std::move(numberExpr);
-}
-
-// parenexpr:: '(' expression ')'
-static std::unique_ptr<ExprAST> ParseParenExpr() {
-		getNextToken();
-		auto v = ParseExpression();
-
-		if (CurTok != ')') {
-				return LogError("expected: ')'");
-		}
-
-		//fprintf(stderr, "debug: parenexpr\n");
-
-		getNextToken();
-		return v;
+// How the rest of the input parses depends on whether an operator's
+// definition compiles (it is undone if not), so the parser waits for it
+static void PushAndWait(BoundedQueue<ParsedItem>& Out, ParsedItem Item) {
+	Item.Done = std::make_unique<std::promise<void>>();
+	std::future<void> Done = Item.Done->get_future();
+	Out.push(std::move(Item));
+	Done.wait();
 }
 
-// identifierexpr:
-// 	::= identifier
-// 	::= identifier '(' e + expression
-static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-
-		std::string IdName =  IdentifierString; // produced by the tokenizer
-
-		getNextToken(); // MUST EAT UP TOKEN BEFORE RETURNING, CURRENT TOKEN IS ID, GET NEXT TOKEN
-
-		if (CurTok != '(') {
-				//fprintf(stderr, "debug: identifier single\n");
-				return std::make_unique<VariableExprAST>(IdName);
-		}
-
-		getNextToken();
-
-		std::vector< std::unique_ptr<ExprAST> > Args;
-
-		if (CurTok != ')') {
-				while (1) {
-						if (auto v = ParseExpression()) 
-								Args.push_back(std::move(v)); // reuse v
-						else
-								return nullptr; // there should be an expression if parentheses don't close immediately
-
-						if (CurTok == ')') 
-								break;
-
-						if (CurTok != ',') 
-								return LogError("expected ',' or ')' in argument list");
-
-						getNextToken();
+static void StreamParse(CompilerSession& S, BoundedQueue<ParsedItem>& Out) {
+	while (true) {
+		switch (S.CurTok) {
+			case tok_eof:
+				Out.close();
+				return;
+			case tok_def:
+				if (auto def = S.ParseDefinition()) {
+					if (def->Proto->IsOperator()) {
+						PushAndWait(Out, {tok_def, std::move(def), nullptr, ""});
+					} else {
+						Out.push({tok_def, std::move(def), nullptr, ""});
+					}
+				} else {
+					S.getNextToken();
+				}
+				break;
+			case tok_extern:
+				if (auto extn = S.ParseExtern()) {
+					if (extn->IsOperator()) {
+						PushAndWait(Out, {tok_extern, nullptr, std::move(extn), ""});
+					} else {
+						Out.push({tok_extern, nullptr, std::move(extn), ""});
+					}
+				} else {
+					S.getNextToken();
+				}
+				break;
+			case tok_load: {
+				std::string Path = S.ParseLoad();
+				if (!Path.empty()) {
+					Out.push({tok_load, nullptr, nullptr, Path});
+				} else {
+					S.getNextToken();
 				}
+				break;
+			}
+			case ';':
+				S.getNextToken();
+				break;
+			case ':':
+				Out.push({':', nullptr, nullptr, S.ParseCommand()});
+				break;
+			default:
+				if (auto tle = S.ParseTopLevelExpr()) {
+					Out.push({0, std::move(tle), nullptr, ""});
+				} else {
+					Out.push({0, nullptr, nullptr, ""}); // still has a result
+					S.getNextToken();
+				}
+				break;
 		}
-
-		getNextToken(); // eat ')'
-
-		//fprintf(stderr, "debug: identifier two\n");
-
-		return std::make_unique<CallExprAST>(IdName, std::move(Args));
+	}
 }
 
-
-// primary:
-// 	::= identifier
-// 	::= numberexpr
-// 	::= parenexpr
-static std::unique_ptr<ExprAST> ParsePrimary() {
-		// lookahead?
-		switch(CurTok) {
-				case tok_number:
-						return ParseNumberExpr();
-						break;
-				case tok_identifier:
-						return ParseIdentifierExpr();
-						break;
-				case '(':
-						return ParseParenExpr();
-						break;
-				default:
-						return LogError("unknown token while trying to parse expression");
-						break;
-		}
-		//fprintf(stderr, "debug: primary\n");
-		return nullptr;
+// One result per top level expression, in input order: "%.17g\n" text, or
+// the raw 8 byte double. Expressions that fail to parse or compile give a NaN.
+static void WriteResult(double val) {
+	if (Stream == StreamBinary) {
+		fwrite(&val, sizeof(val), 1, stdout);
+	} else {
+		fprintf(stdout, "%.17g\n", val);
+	}
 }
 
-
-static std::map<char, int> BinopPrecedence;
-
-static int getTokPrecedence() {
-		//printf("debug: getting precedence of: ");
-		if (!isascii(CurTok)) // not an operator, stop parsing expression
-				return -1;
-
-		int TokPrec = BinopPrecedence[CurTok];
-
-		if (TokPrec <= 0) return -1;
-
-		return TokPrec;
+static void StreamExecute(CompilerSession& S, BoundedQueue<PreparedExpr>& In) {
+	while (auto E = In.pop()) {
+		WriteResult(S.RunPrepared(*E));
+	}
+	fflush(stdout);
 }
 
-// TODO: install precedence in main()
-// BinopPrecedence['<'] = 10;
-// BinopPrecedence['+'] = 20;
-// BinopPrecedence['-'] = 20;
-// BinopPrecedence['*'] = 40;
-
-
-// expression = 
-// 	::= primary binoprhs
-static std::unique_ptr<ExprAST> ParseExpression() {
-
-		auto LHS = ParsePrimary();
-
-		////fprintf(stderr, "debug: Parsed LHS\n");
-
-		if (!LHS)
-				return nullptr;
+// With --executors the executor stage only hands expressions out, as many at
+// a time as the queue below holds, and a writer prints their results in order
+// as they come back
+struct PendingResult {
+	PreparedExpr E; // pinned until its result is in
+	std::future<Expected<double>> Value;
+};
 
-		////fprintf(stderr, "debug: Calling ParseBinOpRHS\n");
+static void StreamDispatch(CompilerSession& S, BoundedQueue<PreparedExpr>& In) {
+	BoundedQueue<PendingResult> Pending(StreamDepth);
+	std::thread Writer([&] {
+		while (auto P = Pending.pop()) {
+			WriteResult(S.resultOf(P->Value.get()));
+		}
+		fflush(stdout);
+	});
 
-		//fprintf(stderr, "debug: expression\n");
-		return ParseBinOpRHS(0, std::move(LHS));
+	while (auto E = In.pop()) {
+		PendingResult P;
+		if (RemoteExpr *Remote = E->Cached.remote()) {
+			P.Value = S.Pool->run(*Remote, E->Literals);
+		} else {
+			std::promise<Expected<double>> Ready;
+			Ready.set_value(S.RunPrepared(*E));
+			P.Value = Ready.get_future();
+		}
+		P.E = std::move(*E);
+		Pending.push(std::move(P));
+	}
+	Pending.close();
+	Writer.join();
 }
 
-
-// binoprhs = 
-// 	::= (op binoprhs)*
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec, std::unique_ptr<ExprAST> LHS) {
-		while (1) { // parses (op binoprhs)
-
-				int TokPrec = getTokPrecedence();
-
-				if (TokPrec < ExprPrec) {
-						//fprintf(stderr, "debug: less precedence\n");
-						return LHS;
+// The compiler stage runs here, on the thread that set up the JIT
+static void StreamLoop(CompilerSession& S) {
+	BoundedQueue<ParsedItem> Parsed(StreamDepth);
+	BoundedQueue<PreparedExpr> Compiled(StreamDepth);
+
+	std::thread Parser(StreamParse, std::ref(S), std::ref(Parsed));
+	std::thread Executor(S.Pool ? StreamDispatch : StreamExecute, std::ref(S), std::ref(Compiled));
+
+	while (auto Item = Parsed.pop()) {
+		switch (Item->Kind) {
+			case tok_def:
+				S.CompileDefinition(std::move(Item->Func));
+				break;
+			case tok_extern:
+				S.CompileExtern(std::move(Item->Proto));
+				break;
+			case tok_load:
+				S.LoadLibrary(Item->Command);
+				break;
+			case ':':
+				RunCommand(S, Item->Command, stderr);
+				break;
+			default:
+				Optional<PreparedExpr> E;
+				if (Item->Func) {
+					E = S.PrepareTopLevel(std::move(Item->Func));
 				}
-
-				int BinOp = CurTok;
-
-				getNextToken(); // ate op
-
-				//fprintf(stderr, "debug: Parsing RHS");
-				auto RHS = ParsePrimary(); // ate binoprhs
-
-				int NextOpPrec = getTokPrecedence();
-
-				if (!RHS)
-						return nullptr;
-
-				// peek at next operator
-				if (NextOpPrec > TokPrec) {
-						// has larger precedence, eat all the large precedence
-						// operators first
-						RHS = ParseBinOpRHS(TokPrec + 1, std::move(RHS));
-
-						if (!RHS) 
-								return nullptr;
+				if (E) {
+					Compiled.push(std::move(*E));
+				} else {
+					PreparedExpr Failed;
+					Failed.Folded = NAN;
+					Compiled.push(std::move(Failed));
 				}
-
-				// now the precedence of the next operator is less than or equal
-				// to tokprec, so the previous expressions can be safely
-				// combined
-				//
-
-				//std::cerr << "(" << "LHS" << " " << BinOp << " " << "RHS" << std::endl;
-
-				LHS = std::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
-
-				// we have our new LHS, on to the next!
-		}
-}
-
-
-// prototype:
-// 	::= identifier '(' identifier* ')'
-static std::unique_ptr<PrototypeAST> ParsePrototype() {
-
-		if (CurTok != tok_identifier)
-				return LogErrorP("Expected function name in prototype");
-
-		std::string FunctionName = std::move(IdentifierString);
-
-		getNextToken();
-
-		if (CurTok != '(')
-				return LogErrorP("Expected '(' in prototype");
-
-		std::vector<std::string> Args;
-
-		while (getNextToken() == tok_identifier)
-				Args.push_back(std::move(IdentifierString));
-
-		if (CurTok !=  ')')
-				LogErrorP("Expected ',' in prototype");
-
-		getNextToken(); // after parsing is done, fetch next token
-
-		auto prot = std::make_unique<PrototypeAST>(FunctionName, std::move(Args));
-		//fprintf(stderr, "debug: prototype\n");
-		return prot;
-}
-
-// definition:
-// 	::= 'def' prototype expression
-static std::unique_ptr<FunctionAST> ParseDefinition() {
-
-		// eat up "def"
-		getNextToken();
-
-		auto Proto = ParsePrototype();
-
-		if (!Proto) {
-				return nullptr;
+				break;
 		}
-
-		auto E = ParseExpression();
-
-		if (!E) {
-				return nullptr;
-		}else {
-				//fprintf(stderr, "debug: definition\n");
-				return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+		if (Item->Done) {
+			Item->Done->set_value();
 		}
-}
-
-// extern:
-// 	::= 'extern' prototype
-static std::unique_ptr<PrototypeAST> ParseExtern() {
-
-		getNextToken();
+	}
 
-		return ParsePrototype();
+	Compiled.close();
+	Parser.join();
+	Executor.join();
 }
 
-// toplevelexpr:
-// 	::= expr
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
-
-		if (auto E = ParseExpression()) {
-
-				auto Proto = std::make_unique<PrototypeAST>("__anon_expr", std::vector<std::string>());
-
-				//fprintf(stderr, "debug: toplevelexpr\n");
-				return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+// -- Watch Mode --
+//
+// --watch=FILE runs the program in FILE, then looks at FILE every 100 ms and
+// runs it again whenever its contents changed. CompilerSession::Reload
+// compiles only the definitions that are stale; the rest of the JIT'd code
+// stays. Results go to stdout as with --stream, and a line per run to stderr
+// says how many definitions were reused and rebuilt.
+
+static int WatchLoop(CompilerSession& S) {
+	std::string Program;
+	for (bool First = true; ; First = false) {
+		// Read, not mapped: the file may be rewritten while we look
+		auto Buf = MemoryBuffer::getFile(WatchFile, false, false, true);
+		if (!Buf && First) {
+			fprintf(stderr, "cannot read %s: %s\n", WatchFile.c_str(), Buf.getError().message().c_str());
+			return 1;
 		}
-
-		return nullptr;
-}
-
-static std::unordered_map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos; // Function Name -> PrototypeAST Node map
-
-// -- Code Generator --
-
-static void InitializeModuleAndPassManager() {
-	TheContext = std::make_unique<LLVMContext>();
-	TheModule = std::make_unique<Module>("kaleidoscope", *TheContext);
-	TheModule->setDataLayout(TheJIT->getDataLayout());
-
-	Builder = std::make_unique<IRBuilder<>>(*TheContext);
-
-	// Why .get? Ahh- I want to pass a pointer. What about uniqueness?
-	TheFPM = std::make_unique<legacy::FunctionPassManager>(TheModule.get());
-
-	// Peephole optimizations
-	TheFPM->add(createInstructionCombiningPass());
-	
-	// ?
-	TheFPM->add(createReassociatePass());
-
-	// Global value numbering-> common subexpression elimination. Global is actually per-function
-	TheFPM->add(createGVNPass());
-
-	// Dead code elimination pass;
-	TheFPM->add(createCFGSimplificationPass());
-
-	// Run initalizers for all passes added to pass manager
-	TheFPM->doInitialization();
+		if (Buf && (First || (*Buf)->getBuffer() != Program)) {
+			Program = (*Buf)->getBuffer().str();
+			std::vector<double> Results;
+			ReloadReport R = S.Reload(Program, Results);
+			for (double val: Results) {
+				WriteResult(val);
+			}
+			fflush(stdout);
+			fprintf(stderr, "%s: reused %u, rebuilt %u (%u stale dependents), removed %u\n",
+					WatchFile.c_str(), R.Reused, R.Rebuilt, R.Dependents, R.Removed);
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
 }
 
-Function *getOrCreateFunction(const std::string& Name) {
-	// Check whether declaration is present in current module
-	if (auto *F = TheModule->getFunction(Name)) {
-		// Hypothesis: When each function is created in a new module, this will never happen
-		return F;
+// -- Server --
+//
+// Every connection to the socket is a session of its own: the client writes
+// a program (all at once, or as it goes) and reads back one %.17g line per top
+// level expression, error messages, and whatever commands print. A pool of
+// workers serves sessions concurrently. They share the host target setup and
+// the symbol string pool, but each has a JIT (and ExecutionSession) of its
+// own; see JITTarget for why.
+
+// A JIT set up the way the command line asked for
+static std::unique_ptr<KaleidoscopeJIT> CreateJIT(std::shared_ptr<JITTarget> Target = nullptr) {
+	auto JIT = ExitOnErr(KaleidoscopeJIT::Create(std::move(Target), Linker));
+	if (PerfMap) {
+		ExitOnErr(JIT->enablePerfMap());
 	}
-
-	// Check whether this function has been declared previously
-	auto F_itr = FunctionProtos.find(Name);
-	if (F_itr != FunctionProtos.end()) {
-		// If yes, codegen declaration to _this module_.
-		return F_itr->second->codegen();
+	if (JITDump) {
+		ExitOnErr(JIT->enableJITDump());
 	}
-
-	return nullptr;
-}
-
-// Create a new constant of type "double"
-Value* NumExprAST::codegen() {
-	return ConstantFP::get(Builder->getDoubleTy(), Val);
-}
-
-
-// Return a pointer to the value that this variable refers to
-Value* VariableExprAST::codegen() {
-	Value *varval = Symbols[Name];
-	if (!varval) {
-		return LogErrorV((std::string("Undefined reference: ") + Name).c_str());
+	if (GDBRegistration) {
+		ExitOnErr(JIT->enableGDBRegistration());
+	}
+	for (const auto& Path: Libs) {
+		ExitOnErr(JIT->addHostLibrary(*ExitOnErr(HostLibrary::open(Path))));
 	}
-	return varval;
+	if (Options.Profile) {
+		ExitOnErr(JIT->defineAbsolute("__kprof_enter", pointerToJITTargetAddress(&ProfileEnter)));
+		ExitOnErr(JIT->defineAbsolute("__kprof_exit", pointerToJITTargetAddress(&ProfileExit)));
+	}
+	return JIT;
 }
 
-// Generates code for function call, returns `Value` of function call
-Value* CallExprAST::codegen() {
-
-	// Obtain function with name `Callee` from Module
-	Function *func = getOrCreateFunction(Callee);
-	if (!func) {
-		return LogErrorV((std::string("undefined function: ") + Callee).c_str());
+static bool UnixSocketAddress(const std::string& Path, sockaddr_un& Addr) {
+	if (Path.size() >= sizeof(Addr.sun_path)) {
+		fprintf(stderr, "socket path too long: %s\n", Path.c_str());
+		return false;
 	}
+	memset(&Addr, 0, sizeof(Addr));
+	Addr.sun_family = AF_UNIX;
+	strcpy(Addr.sun_path, Path.c_str());
+	return true;
+}
 
-	// "Type Check" call
-	if (Args.size() != func->arg_size()) {
-		return LogErrorV((
-			std::string("Invalid number of arguments in function call to function") 
-			+ Callee).c_str()
-		);
+static void ServeSession(std::shared_ptr<JITTarget> Target, int Fd) {
+	FILE *Out = fdopen(dup(Fd), "w");
+	if (!Out) {
+		perror("fdopen");
+		close(Fd);
+		return;
 	}
-
-	// Generate code for arguments, and get their values
-	std::vector<Value *> Argvec;
-	for (const auto& arg: Args) {
-		Argvec.push_back(arg->codegen());
+	// interactive clients wait for each result
+	setvbuf(Out, nullptr, _IOLBF, 0);
+
+	{
+		CompilerSession S(CreateJIT(std::move(Target)), Options);
+		AttachOutput(S, Out);
+		S.Lex.reset(ReadFd(Fd));
+		S.getNextToken();
+		MainLoop(S, Out, true);
 	}
 
-
-
-	// TODO: why do I need to provide TheContext to getDoubleTy?
-	//std::vector<Type *> ArgTypes = std::vector<Type *>(Args.size(), Builder->getDoubleTy());
-
-	// Create type for call
-	// TODO: this is not needed: CreateCall can be called without a type
-	// Why is this so? Is it because the function does not take variable arguments?
-	//FunctionType *func_type = FunctionType::get(Builder->getDoubleTy(), ArgTypes, false);
-
-	// Create call
-	return Builder->CreateCall(func, Argvec, "call");
+	fclose(Out);
+	close(Fd);
 }
 
-Value* BinaryExprAST::codegen() {
-	Value *L = LHS->codegen();
-	Value *R = RHS->codegen();
+static int Serve() {
+	// a client that goes away must not take the server down with it
+	signal(SIGPIPE, SIG_IGN);
 
-	if (!L || !R) {
-		return nullptr;
+	sockaddr_un Addr;
+	if (!UnixSocketAddress(ServerSocket, Addr)) {
+		return 1;
 	}
-
-	switch(Op) {
-		case '+':
-			return Builder->CreateFAdd(L, R, "add");
-			break;
-		case '-':
-			return Builder->CreateFSub(L, R, "sub");
-			break;
-		case '*':
-			return Builder->CreateFMul(L, R, "mul");
-			break;
-		case '/':
-			// TODO: do static analysis to ensure that RHS is not a 0?
-			return Builder->CreateFDiv(L, R, "div");
-			break;
-		case '<':
-			L = Builder->CreateFCmp(CmpInst::FCMP_OLT, L, R, "lessthan");
-			return Builder->CreateUIToFP(L, Builder->getDoubleTy(), "booltofp");
-			break;
-		case '>':
-			L = Builder->CreateFCmp(CmpInst::FCMP_UGT, L, R, "greaterthan");
-			return Builder->CreateUIToFP(L, Builder->getDoubleTy(), "booltofp");
-		default:
-			return LogErrorV("Invalid Operator");
-			break;
+	int Listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (Listener < 0) {
+		perror("socket");
+		return 1;
 	}
-}
-
-Function* PrototypeAST::codegen() {
-	std::vector<Type *> Argtypes = std::vector<Type *>(Args.size(), Builder->getDoubleTy());
-
-	FunctionType *func_type = FunctionType::get(Builder->getDoubleTy(), Argtypes, false);
-
-	// TODO: why do I use TheModule.get() here? Why not *TheModule? how will things change due to this?
-	Function *func = Function::Create(func_type, Function::ExternalLinkage, Name, TheModule.get());
-	
-	unsigned Idx = 0;
-	for (Argument& x: func->args()) {
-		x.setName(Args[Idx++]);
+	unlink(ServerSocket.c_str());
+	if (bind(Listener, (sockaddr *)&Addr, sizeof(Addr)) < 0 || listen(Listener, SOMAXCONN) < 0) {
+		perror(ServerSocket.c_str());
+		return 1;
 	}
 
-	return func;
-}
-
-Function* FunctionAST::codegen() {
-
-	// TODO: why are we doing this? This codegen method will never be called 
-	// for an extern function, right? Why else do I need to check?
-	const std::string& func_name = Proto->GetName();
-
-	// Make global FunctionProto map the owner of function prototype node 
-	// This ensures that declaration can be codegened in different modules
-	FunctionProtos[func_name] = std::move(Proto);
-
-	Function *func = getOrCreateFunction(func_name);
-
-	if (!func) {
-		return nullptr;
+	auto Target = ExitOnErr(JITTarget::detectHost());
+
+	// Connections wait here (and then in the listen backlog) while every
+	// worker is busy
+	BoundedQueue<int> Connections(ServerWorkers);
+	std::vector<std::thread> Workers;
+	for (unsigned i = 0; i < ServerWorkers; i++) {
+		Workers.emplace_back([&] {
+			while (auto Fd = Connections.pop()) {
+				ServeSession(Target, *Fd);
+			}
+		});
 	}
-
-	BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", func);
-	Builder->SetInsertPoint(BB);
-
-	Symbols.clear();
-	for (auto& arg: func->args()) {
-		// I could have used the AST to find the names- 
-		// but I've already stored this information in the function 
-		// prototype
-		Symbols[std::string(arg.getName())] = &arg;
+	fprintf(stderr, "serving on %s with %u workers\n", ServerSocket.c_str(), ServerWorkers);
+
+	while (true) {
+		int Fd = accept(Listener, nullptr, nullptr);
+		if (Fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			perror("accept");
+			break;
+		}
+		Connections.push(Fd);
 	}
 
-	Value *retval = Body->codegen();
-	if (retval) {
-		Builder->CreateRet(retval);
-		// TODO: Does this mean that my "write head" is at the end of the function-
-		// but I do not need to move it immediately, because the only place where
-		// writes will happen will be while generating code for another function,
-		// and I _will_ call SetInsertPoint in that function anyway?
-
-		// TODO: What if this check fails? Do I still continue?
-		verifyFunction(*func);
-
-		// Run passes on function
-		TheFPM->run(*func);
-
-		return func;
+	Connections.close();
+	for (auto& W: Workers) {
+		W.join();
 	}
-
-	// For recovering from errors- improperly defined functions should not persist.
-	func->eraseFromParent();
-	return nullptr;
+	close(Listener);
+	unlink(ServerSocket.c_str());
+	return 1;
 }
 
-// --- Driver ---
-
-static void HandleDefinition() {
-		if (auto def = ParseDefinition()) {
-
-#if DEBUGPARSE
-				LispPrintVisitor lvt;
-				def->accept(lvt);
-#endif
-
-#if IRGEN
-				if (Function *func = def->codegen()) {
-					func->print(errs());
-
-					ExitOnErr(TheJIT->addModule(
-						ThreadSafeModule(std::move(TheModule), std::move(TheContext))
-					));
-
-					InitializeModuleAndPassManager();
-
-					fprintf(stderr, "\n");
-					fprintf(stderr, "Read a function definition\n");
-				}
-#endif
-
-		}else {
-				getNextToken(); // skip token
+static bool WriteAll(int Fd, const char *Buf, ssize_t Size) {
+	while (Size > 0) {
+		ssize_t N = write(Fd, Buf, Size);
+		if (N < 0 && errno == EINTR) {
+			continue;
 		}
-}
-
-
-static void HandleExtern() {
-		if (auto extn = ParseExtern()) {
-
-#if DEBUGPARSE
-				LispPrintVisitor lvt;
-				extn->accept(lvt);
-#endif
-
-#if IRGEN
-				if (Function *func = extn->codegen()) {
-					func->print(errs());
-					fprintf(stderr, "\n");
-					fprintf(stderr, "Read an extern\n");
-					FunctionProtos[extn->GetName()] = std::move(extn);
-				}
-#endif
-
-		}else {
-				getNextToken();
+		if (N <= 0) {
+			return false;
 		}
+		Buf += N;
+		Size -= N;
+	}
+	return true;
 }
 
-static void HandleTopLevelExpression() {
-		if (const auto tle = ParseTopLevelExpr()) {
-
-#if DEBUGPARSE
-				LispPrintVisitor lvt;
-				tle->accept(lvt);
-#endif
-
-#if IRGEN
-				if (Function *func = tle->codegen()) {
-					func->print(errs());
-					fprintf(stderr, "\n");
-					fprintf(stderr, "Parsed a top level expression\n");
-
-					// TODO: how do I know which functions to call? In this case, I have the 
-					// tutorial for reference. What if I don't know what does what?
-					auto RT = TheJIT->getMainJITDylib().createResourceTracker();
-
-					// TODO: wasn't the context supposed to be unique for the 
-					// program? If this context is now owned by the JIT, then
-					// will each top level expression (and even each function)
-					// be created in a new context?
-					auto TSM = ThreadSafeModule(std::move(TheModule), std::move(TheContext));
-
-					ExitOnErr(TheJIT->addModule(std::move(TSM), RT));
-
-					// Now, the next function will be placed in a new Module?
-					InitializeModuleAndPassManager();
-
-					auto ExprSymbol = ExitOnErr(TheJIT->lookup("__anon_expr"));
-
-					// TODO: why do I need intptr_t
-					double (*Fn)() = (double(*)())(intptr_t)ExprSymbol.getAddress();
-
-					fprintf(stderr, "Evaluated to %lf\n", Fn());
-
-					ExitOnErr(RT->remove());
-
-				}
-#endif
+// Client for --server: sends stdin as the program and copies the replies to
+// stdout
+static int Connect() {
+	sockaddr_un Addr;
+	if (!UnixSocketAddress(ConnectSocket, Addr)) {
+		return 1;
+	}
+	int Fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (Fd < 0 || connect(Fd, (sockaddr *)&Addr, sizeof(Addr)) < 0) {
+		perror(ConnectSocket.c_str());
+		return 1;
+	}
 
-		} else {
-				getNextToken();
+	std::thread Sender([Fd] {
+		char Buf[4096];
+		ssize_t N;
+		while ((N = read(STDIN_FILENO, Buf, sizeof(Buf))) > 0 && WriteAll(Fd, Buf, N)) {
 		}
-}
-
-
-// top = definition | expression | external | ;
-static void MainLoop() {
-	while(true) {
-		fprintf(stderr, "ready>");
-		switch (CurTok) {
-				case tok_eof:
-						return;
-						break;
-				case tok_def:
-						HandleDefinition();
-						break;
-				case tok_extern:
-						HandleExtern();
-						break;
-				case ';':
-						getNextToken();
-						break;
-				default:
-						HandleTopLevelExpression();
-						break;
+		shutdown(Fd, SHUT_WR);
+	});
+	// the server may hang up before all of stdin was read
+	Sender.detach();
+
+	char Buf[4096];
+	ssize_t N;
+	while ((N = read(Fd, Buf, sizeof(Buf))) > 0) {
+		if (!WriteAll(STDOUT_FILENO, Buf, N)) {
+			return 1;
 		}
 	}
+	close(Fd);
+	return N < 0 ? 1 : 0;
 }
 
-
 int oldmain(void) {
+		Lexer Lex;
+		Lex.reset(ReadFd(STDIN_FILENO));
 		int Token;
-		while((Token = gettok())){
+		while((Token = Lex.gettok())){
 				switch(Token) {
 						case tok_number:
-								std::cout << "(" << Token << ", " <<  NumValue << ")" << std::endl;
+								std::cout << "(" << Token << ", " <<  Lex.NumValue << ")" << std::endl;
 								break;
 						case tok_identifier:
-								std::cout << "(" << Token << ", " << IdentifierString << ")" << std::endl;
+								std::cout << "(" << Token << ", " << Lex.IdentifierString << ")" << std::endl;
 								break;
 						case tok_def: case tok_extern:
-								std::cout << "(" << Token << ", " << IdentifierString << ")" << std::endl;
+								std::cout << "(" << Token << ", " << Lex.IdentifierString << ")" << std::endl;
 								break;
 						case tok_eof:
 								std::cout << "(" << "End" << "," << 0 << ")" << std::endl;
@@ -1024,38 +749,282 @@ int oldmain(void) {
 		return 0;
 }
 
-int main(void) {
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [options] < program.k\n", prog);
+	fprintf(stderr, "  -ffast-math          enable all fast-math flags on FP operations\n");
+	fprintf(stderr, "  -ffp-contract=off    never fuse FP operations (default)\n");
+	fprintf(stderr, "  -ffp-contract=fast   allow fusing FP operations, e.g. a*b+c into an FMA\n");
+	fprintf(stderr, "  -fspecialize-limit=N clone a function for constant arguments at most N\n");
+	fprintf(stderr, "                       times (default 8, 0 disables)\n");
+	fprintf(stderr, "  -fexpr-cache-size=N  keep up to N compiled top level expression shapes\n");
+	fprintf(stderr, "                       (default 256, 0 disables)\n");
+	fprintf(stderr, "  --stats[=text|json]  time each phase of every top level item and count\n");
+	fprintf(stderr, "                       tokens, AST nodes, IR and code; json goes to stdout\n");
+	fprintf(stderr, "  -time-passes         report LLVM pass timings (optimizer and backend)\n");
+	fprintf(stderr, "  --profile            count calls and cycles of every function, report at exit\n");
+	fprintf(stderr, "  --profile-out=FILE   --profile, and also write the profile to FILE as JSON\n");
+	fprintf(stderr, "  --memory             print live contexts, IR, JIT memory and RSS at exit\n");
+	fprintf(stderr, "                       (also available at any time as the :memory command)\n");
+	fprintf(stderr, "  --perf-map           name JIT'd functions for perf in /tmp/perf-<pid>.map\n");
+	fprintf(stderr, "  --jitdump            write jitdump files for `perf inject --jit`\n");
+	fprintf(stderr, "                       (in $JITDUMPDIR or ~/.debug/jit)\n");
+	fprintf(stderr, "  --gdb-jit            register JIT'd objects with the GDB JIT interface\n");
+	fprintf(stderr, "  --lib=PATH           dlopen the shared library PATH and bind its exports,\n");
+	fprintf(stderr, "                       like a `load \"PATH\"` at the top of every program\n");
+	fprintf(stderr, "  --linker=rtdyld      link JIT'd objects with RuntimeDyld, pages of their\n");
+	fprintf(stderr, "                       own for each (default)\n");
+	fprintf(stderr, "  --linker=jitlink     link with JITLink, packing objects into shared slabs\n");
+	fprintf(stderr, "  --threads=N          run `parallel for` loops on N threads (default: CPUs)\n");
+	fprintf(stderr, "  --stream[=text|binary]\n");
+	fprintf(stderr, "                       parse, compile and run on separate threads, no IR\n");
+	fprintf(stderr, "                       dumps; results go to stdout in order, one per top\n");
+	fprintf(stderr, "                       level expression, as %%.17g lines or raw doubles\n");
+	fprintf(stderr, "  --stream-depth=N     items queued between two stream stages (default 64)\n");
+	fprintf(stderr, "  --server=PATH        serve sessions on the Unix socket PATH: each connection\n");
+	fprintf(stderr, "                       is a program, answered with --stream style results\n");
+	fprintf(stderr, "  --workers=N          sessions the server runs at once (default: CPUs)\n");
+	fprintf(stderr, "  --connect=PATH       send stdin to the server at PATH, print its replies\n");
+	fprintf(stderr, "  --executors=N        run JIT'd code in N kaleidoscope-executor processes,\n");
+	fprintf(stderr, "                       spreading top level expressions over them; a crash\n");
+	fprintf(stderr, "                       only fails the expressions running in that one\n");
+	fprintf(stderr, "  --executor=PATH      the executor binary (default: next to this one)\n");
+	fprintf(stderr, "  --watch=FILE         run FILE instead of stdin, then again whenever it\n");
+	fprintf(stderr, "                       changes, recompiling only changed definitions and\n");
+	fprintf(stderr, "                       what inlined them; results go to stdout\n");
+}
+
+// Command line options; returns false on anything unrecognised
+static bool ParseOptions(int argc, char **argv) {
+	for (int i = 1; i < argc; i++) {
+		StringRef Arg(argv[i]);
+		if (Arg == "-ffast-math") {
+			Options.FMF.setFast();
+		} else if (Arg == "-ffp-contract=fast") {
+			Options.FMF.setAllowContract();
+		} else if (Arg == "-ffp-contract=off") {
+			Options.FMF.setAllowContract(false);
+		} else if (Arg == "--stats" || Arg == "--stats=text") {
+			Stats = StatsText;
+		} else if (Arg == "--stats=json") {
+			Stats = StatsJSON;
+		} else if (Arg == "-time-passes" || Arg == "--time-passes") {
+			TimePassesIsEnabled = true;
+		} else if (Arg == "--profile") {
+			Options.Profile = true;
+		} else if (Arg.consume_front("--profile-out=")) {
+			Options.Profile = true;
+			ProfileOut = Arg.str();
+		} else if (Arg == "--memory") {
+			MemoryReport = true;
+		} else if (Arg == "--perf-map") {
+			PerfMap = true;
+		} else if (Arg == "--jitdump") {
+			JITDump = true;
+		} else if (Arg == "--gdb-jit") {
+			GDBRegistration = true;
+		} else if (Arg.consume_front("--lib=")) {
+			Libs.push_back(Arg.str());
+		} else if (Arg == "--linker=rtdyld") {
+			Linker = JITLinker::RTDyld;
+		} else if (Arg == "--linker=jitlink") {
+			Linker = JITLinker::JITLink;
+		} else if (Arg.consume_front("--threads=")) {
+			if (Arg.getAsInteger(10, Threads) || Threads == 0) {
+				fprintf(stderr, "invalid number of threads: %s\n", Arg.str().c_str());
+				return false;
+			}
+		} else if (Arg == "--stream" || Arg == "--stream=text") {
+			Stream = StreamText;
+		} else if (Arg == "--stream=binary") {
+			Stream = StreamBinary;
+		} else if (Arg.consume_front("--server=")) {
+			ServerSocket = Arg.str();
+		} else if (Arg.consume_front("--connect=")) {
+			ConnectSocket = Arg.str();
+		} else if (Arg.consume_front("--workers=")) {
+			if (Arg.getAsInteger(10, ServerWorkers) || ServerWorkers == 0) {
+				fprintf(stderr, "invalid number of workers: %s\n", Arg.str().c_str());
+				return false;
+			}
+		} else if (Arg.consume_front("--executors=")) {
+			if (Arg.getAsInteger(10, Executors) || Executors == 0) {
+				fprintf(stderr, "invalid number of executors: %s\n", Arg.str().c_str());
+				return false;
+			}
+		} else if (Arg.consume_front("--executor=")) {
+			ExecutorPath = Arg.str();
+		} else if (Arg.consume_front("--watch=")) {
+			WatchFile = Arg.str();
+		} else if (Arg.consume_front("--stream-depth=")) {
+			if (Arg.getAsInteger(10, StreamDepth) || StreamDepth == 0) {
+				fprintf(stderr, "invalid stream depth: %s\n", Arg.str().c_str());
+				return false;
+			}
+		} else if (Arg.consume_front("-fexpr-cache-size=")) {
+			if (Arg.getAsInteger(10, Options.ExprCacheSize)) {
+				fprintf(stderr, "invalid expression cache size: %s\n", Arg.str().c_str());
+				return false;
+			}
+		} else if (Arg.consume_front("-fspecialize-limit=")) {
+			if (Arg.getAsInteger(10, Options.SpecializeLimit)) {
+				fprintf(stderr, "invalid specialization limit: %s\n", Arg.str().c_str());
+				return false;
+			}
+		} else {
+			fprintf(stderr, "unknown option: %s\n", argv[i]);
+			return false;
+		}
+	}
+
+	// their listeners hook into RuntimeDyld
+	if (Linker == JITLinker::JITLink && (PerfMap || JITDump || GDBRegistration)) {
+		fprintf(stderr, "--linker=jitlink cannot be combined with --perf-map, --jitdump or --gdb-jit\n");
+		return false;
+	}
+
+	if (Stream) {
+		// per item statistics assume one item at a time
+		if (Stats) {
+			fprintf(stderr, "--stats cannot be combined with --stream\n");
+			return false;
+		}
+		// the uncached path reuses one symbol name for every expression
+		if (Options.ExprCacheSize == 0) {
+			fprintf(stderr, "--stream needs the expression cache (-fexpr-cache-size > 0)\n");
+			return false;
+		}
+		Verbose = false;
+	}
+
+	if (Executors) {
+		// everything that looks at or hooks into code in this process, and
+		// the uncached path, which runs its code here
+		if (!ServerSocket.empty() || Options.Profile || MemoryReport || PerfMap || JITDump ||
+				GDBRegistration || Linker != JITLinker::RTDyld || !Libs.empty() || Threads ||
+				Options.ExprCacheSize == 0) {
+			fprintf(stderr, "--executors cannot be combined with --server, --profile, --memory,\n"
+					"--perf-map, --jitdump, --gdb-jit, --linker=jitlink, --lib, --threads\n"
+					"or -fexpr-cache-size=0\n");
+			return false;
+		}
+		if (ExecutorPath.empty()) {
+			SmallString<256> Path(sys::path::parent_path(
+					sys::fs::getMainExecutable(argv[0], (void *)&usage)));
+			sys::path::append(Path, "kaleidoscope-executor");
+			ExecutorPath = Path.str().str();
+		}
+	}
+
+	if (!WatchFile.empty()) {
+		// code is replaced under its callers only in this process
+		if (Stream || !ServerSocket.empty() || !ConnectSocket.empty() || Executors) {
+			fprintf(stderr, "--watch cannot be combined with --stream, --server, --connect\n"
+					"or --executors\n");
+			return false;
+		}
+		Options.Watch = true;
+		Verbose = false;
+	}
+
+	if (!ServerSocket.empty()) {
+		// process-wide reports that would mix up all the sessions
+		if (Stats || TimePassesIsEnabled || Options.Profile || MemoryReport || PerfMap || Stream) {
+			fprintf(stderr, "--server cannot be combined with --stats, -time-passes, --profile,\n"
+					"--memory, --perf-map or --stream\n");
+			return false;
+		}
+		if (ServerWorkers == 0) {
+			ServerWorkers = std::max(1u, std::thread::hardware_concurrency());
+		}
+		Verbose = false;
+	}
+	return true;
+}
+
+int main(int argc, char **argv) {
+
+	if (!ParseOptions(argc, argv)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (!ConnectSocket.empty()) {
+		return Connect();
+	}
+
+	// The pool is created on first use, with the thread count it is given then
+	if (Threads) {
+		WorkStealingPool::get(Threads);
+	}
 
 	InitializeNativeTarget();
 	InitializeNativeTargetAsmParser();
 	InitializeNativeTargetAsmPrinter();
 
-	BinopPrecedence['>'] = 10;
-	BinopPrecedence['<'] = 10;
-	BinopPrecedence['+'] = 20;
-	BinopPrecedence['-'] = 20;
-	BinopPrecedence['*'] = 40;
-	BinopPrecedence['/'] = 40;
+	if (!ServerSocket.empty()) {
+		return Serve();
+	}
 
-	fprintf(stderr, "ready>");
-	getNextToken();
+	auto Target = ExitOnErr(JITTarget::detectHost());
+	CompilerSession S(CreateJIT(Target), Options);
+	AttachOutput(S, stderr);
+	if (Executors) {
+		S.Pool = ExitOnErr(ExecutorPool::Create(ExecutorPath, Executors, Target->JTMB));
+		S.Pool->OnError = [&S](Error Err) { S.reportError(std::move(Err)); };
+	}
+	if (!WatchFile.empty()) {
+		return WatchLoop(S);
+	}
+	S.Lex.reset(ReadFd(STDIN_FILENO));
+	if (Options.Profile) {
+		ProfileStartCycles = ReadCycles();
+		ProfileStartTime = StatsClock::now();
+	}
 
-#if IRGEN
-	TheJIT = ExitOnErr(KaleidoscopeJIT::Create());
-	InitializeModuleAndPassManager();
-#endif
+	if (!Stream) {
+		fprintf(stderr, "ready>");
+	}
+	S.getNextToken();
 
-	MainLoop();
+	if (Stream) {
+		StreamLoop(S);
+	} else {
+		MainLoop(S, stderr, false);
+	}
 	//oldmain();
 
 #if IRGEN
-	verifyModule(*TheModule, &errs());
+	if (Stats) {
+		PrintStats();
+	}
 
-	TheModule->print(errs(), nullptr);
-	fprintf(stderr, "\n");
+	if (Options.Profile) {
+		PrintProfile();
+	}
+
+	if (MemoryReport) {
+		PrintMemoryReport(S, stderr);
+	}
+
+	if (TimePassesIsEnabled) {
+		reportAndResetTimings(&errs());
+	}
+
+	if (S.ExprCache->Hits + S.ExprCache->Misses > 0) {
+		fprintf(stderr, "Expression cache: %u hits, %u misses, %u evictions\n",
+				S.ExprCache->Hits, S.ExprCache->Misses, S.ExprCache->Evictions);
+	}
+
+	verifyModule(*S.TheModule, &errs());
+
+	if (Verbose) {
+		S.TheModule->print(errs(), nullptr);
+		fprintf(stderr, "\n");
+	}
 #endif
 
 	return 0;
 }
 
 
+
@@ -0,0 +1,3225 @@
+//===- libkaleidoscope.cpp - The Kaleidoscope compiler as a library -------===//
+//
+// Lexer, parser, simplifier, code generator and the CompilerSession that ties
+// them to a JIT, plus the embedding API of Kaleidoscope.h on top of them. The
+// kaleidoscope driver (REPL, --stream, --server) is built on the same
+// sessions.
+//
+//===----------------------------------------------------------------------===//
+
+#include "ArrayArena.h"
+#include "CompilerSession.h"
+#include "DecimalParser.h"
+#include "Kaleidoscope.h"
+#include "ParallelRuntime.h"
+#include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/ScopeExit.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/Type.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Vectorize.h"
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+
+// ---Lexer---
+
+void Lexer::reset(StringRef Text) {
+		Read = nullptr;
+		Cur = Text.begin();
+		End = Text.end();
+		LastChar = ' ';
+}
+
+void Lexer::reset(ReadFn Read) {
+		this->Read = std::move(Read);
+		Buf.resize(4096);
+		Cur = End = Buf.data();
+		LastChar = ' ';
+}
+
+bool Lexer::refill() {
+		if (!Read) {
+				return false;
+		}
+		size_t N = Read(Buf.data(), Buf.size());
+		Cur = Buf.data();
+		End = Cur + N;
+		return N > 0;
+}
+
+// Character classes by byte, as in the C locale
+enum : uint8_t { CharSpace = 1, CharAlpha = 2, CharIdentifier = 4, CharDigit = 8 };
+
+struct CharClassTable {
+		uint8_t Of[256] = {};
+
+		constexpr CharClassTable() {
+				for (int C = 0; C < 256; C++) {
+						bool Alpha = (C >= 'a' && C <= 'z') || (C >= 'A' && C <= 'Z');
+						bool Digit = C >= '0' && C <= '9';
+						Of[C] = (C == ' ' || (C >= '\t' && C <= '\r') ? CharSpace : 0) |
+								(Alpha ? CharAlpha : 0) | (Digit ? CharDigit : 0) |
+								(Alpha || Digit || C == '_' ? CharIdentifier : 0);
+				}
+		}
+};
+
+static constexpr CharClassTable CharClasses;
+
+static bool isClass(char C, uint8_t Class) {
+		return CharClasses.Of[(unsigned char)C] & Class;
+}
+
+const char *Lexer::scan(const char *P, uint8_t Class) const {
+		while (P != End && isClass(*P, Class)) {
+				++P;
+		}
+		return P;
+}
+
+// Runs of spaces, identifier characters and digits are scanned in place in
+// the buffer, a table lookup per character; only a token cut by the end of
+// a read buffer is put together from the pieces
+int Lexer::gettok(){
+
+		while(isClass(LastChar, CharSpace)){
+				Cur = scan(Cur, CharSpace);
+				LastChar = getChar();
+		}
+
+		if (isClass(LastChar, CharAlpha)){
+				// LastChar came from getChar, so it is at Cur - 1
+				IdentifierString.clear();
+				do {
+						const char *Start = Cur - 1;
+						Cur = scan(Cur, CharIdentifier);
+						IdentifierString.append(Start, Cur);
+						LastChar = getChar();
+				} while(isClass(LastChar, CharIdentifier));
+
+				if (IdentifierString == "def"){
+						return tok_def;
+				}
+				else if (IdentifierString == "extern"){
+						return tok_extern;
+				}
+				else if (IdentifierString == "fastmath"){
+						return tok_fastmath;
+				}
+				else if (IdentifierString == "load"){
+						return tok_load;
+				}
+				else if (IdentifierString == "parallel"){
+						return tok_parallel;
+				}
+				else{
+						return tok_identifier;
+				}
+		}
+		else if (isClass(LastChar, CharDigit) || LastChar == '.'){
+				const char *Start = Cur - 1;
+				bool decimal = LastChar == '.';
+				Cur = scan(Cur, CharDigit);
+				if (!decimal && Cur != End && *Cur == '.') {
+						decimal = true;
+						Cur = scan(Cur + 1, CharDigit);
+				}
+
+				if (Cur != End || !Read) {
+						NumValue = kaleidoscope::parseDecimal(Start, Cur);
+						LastChar = getChar();
+				}
+				else {
+						// The rest of the token, if any, is in the next buffer
+						NumStr.assign(Start, Cur);
+						LastChar = getChar();
+						while(isClass(LastChar, CharDigit) || (!decimal && (LastChar == '.'))){
+								NumStr += LastChar;
+								if (LastChar == '.') {
+										decimal = true;
+								}
+								LastChar = getChar();
+						}
+						NumValue = kaleidoscope::parseDecimal(NumStr.data(), NumStr.data() + NumStr.size());
+				}
+
+				if (decimal && LastChar == '.'){
+						return tok_error;
+				}
+				return tok_number;
+		}
+		else if (LastChar == '"'){
+				IdentifierString = "";
+				LastChar = getChar();
+				while(LastChar != '"'){
+						if (LastChar == EOF || LastChar == '\n'){
+								return tok_error; // unterminated
+						}
+						IdentifierString += LastChar;
+						LastChar = getChar();
+				}
+				LastChar = getChar(); // eat closing '"'
+				return tok_string;
+		}
+		else if (LastChar == '#'){
+				while(LastChar != EOF && LastChar != '\n' && LastChar != '\r') {
+						LastChar = getChar();
+				}
+
+				if (LastChar != EOF){
+						return gettok(); // LOL, cheap trick, but well played
+				}
+		}
+		else if (LastChar == EOF){
+				return tok_eof;
+		}
+		else {
+				int ThisChar = LastChar;
+				LastChar = getChar();
+				return ThisChar;
+		}
+
+		return tok_error;
+}
+
+
+// -- Errors --
+
+std::unique_ptr<ExprAST> CompilerSession::LogError(const char *Str) {
+		if (OnError) {
+				OnError(Str);
+		}
+		return nullptr;
+}
+
+// TODO: what is this for?
+std::unique_ptr<PrototypeAST> CompilerSession::LogErrorP(const char *Str) {
+		LogError(Str);
+		return nullptr;
+}
+
+// For logging errors while doing codegeneration- returns a `null` value, and prints error
+Value *CompilerSession::LogErrorV(const char *Str) {
+  LogError(Str);
+  return nullptr;
+}
+
+// JIT errors are reported like any other: the item fails, the session goes on
+void CompilerSession::reportError(Error Err) {
+	LogError(toString(std::move(Err)).c_str());
+}
+
+void CompilerSession::print_tok(raw_ostream& OS) {
+		switch(CurTok) {
+				case tok_number:
+						OS << "(" << CurTok << ", " <<  Lex.NumValue << ")" << "\n";
+						break;
+				case tok_identifier:
+						OS << "(" << CurTok << ", " << Lex.IdentifierString << ")" << "\n";
+						break;
+				case tok_def: case tok_extern: case tok_load: case tok_string: case tok_parallel:
+						OS << "(" << CurTok << ", " << Lex.IdentifierString << ")" << "\n";
+						break;
+				case tok_eof:
+						OS << "(" << "End" << "," << 0 << ")" << "\n";
+						break;
+				case tok_error:
+						OS << "(" << "Error" << "," << 0 << ")" << "\n";
+						break;
+				default:
+						OS << "(" << (char)CurTok << "," << 0 << ")" << "\n";
+						break;
+		}
+}
+
+// -- Statistics --
+
+const char *PhaseNames[NumPhases] = {"lex", "parse", "codegen", "optimize", "jit", "execute"};
+
+StatsMode Stats = StatsOff;
+
+ItemStats CurItem;
+std::vector<ItemStats> Items;
+static std::vector<std::pair<Phase, StatsClock::time_point>> PhaseStack;
+static uint64_t ItemCodeBytes, ItemModules, ItemMMaps, ItemMProtects; // JIT counters when CurItem started
+
+void enterPhase(Phase P) {
+		auto Now = StatsClock::now();
+		if (!PhaseStack.empty()) {
+				auto& Outer = PhaseStack.back();
+				CurItem.Seconds[Outer.first] += std::chrono::duration<double>(Now - Outer.second).count();
+		}
+		PhaseStack.push_back({P, Now});
+}
+
+void leavePhase() {
+		auto Now = StatsClock::now();
+		auto& Inner = PhaseStack.back();
+		CurItem.Seconds[Inner.first] += std::chrono::duration<double>(Now - Inner.second).count();
+		PhaseStack.pop_back();
+		if (!PhaseStack.empty()) {
+				PhaseStack.back().second = Now;
+		}
+}
+
+void beginItem(const JITStats& JS) {
+		if (!Stats) {
+				return;
+		}
+		// the lookahead token was lexed before the item started
+		uint64_t Tokens = CurItem.Tokens;
+		double Lex = CurItem.Seconds[PhaseLex];
+		CurItem = ItemStats();
+		CurItem.Tokens = Tokens;
+		CurItem.Seconds[PhaseLex] = Lex;
+		ItemCodeBytes = JS.CodeBytes;
+		ItemModules = JS.ModulesMaterialized;
+		ItemMMaps = JS.MMaps;
+		ItemMProtects = JS.MProtects;
+}
+
+void endItem(const char *Kind, const JITStats& JS) {
+		if (!Stats) {
+				return;
+		}
+		CurItem.Kind = Kind;
+		CurItem.CodeBytes = JS.CodeBytes - ItemCodeBytes;
+		CurItem.Modules = JS.ModulesMaterialized - ItemModules;
+		CurItem.MMaps = JS.MMaps - ItemMMaps;
+		CurItem.MProtects = JS.MProtects - ItemMProtects;
+		Items.push_back(std::move(CurItem));
+		CurItem = ItemStats();
+}
+
+class CountNodesVisitor : public ASTVisitor {
+	public:
+
+		uint64_t Count = 0;
+
+		void visit(NumExprAST *p_obj) { Count++; }
+
+		void visit(VariableExprAST *p_obj) { Count++; }
+
+		void visit(CallExprAST *p_obj) {
+				Count++;
+				for (const auto& arg: p_obj->Args) {
+						arg->accept(*this);
+				}
+		}
+
+		void visit(FunctionAST *p_obj) {
+				Count++;
+				p_obj->Proto->accept(*this);
+				p_obj->Body->accept(*this);
+		}
+
+		void visit(PrototypeAST *p_obj) { Count++; }
+
+		void visit(BinaryExprAST *p_obj) {
+				Count++;
+				p_obj->LHS->accept(*this);
+				p_obj->RHS->accept(*this);
+		}
+
+		void visit(ParallelForExprAST *p_obj) {
+				Count++;
+				p_obj->Start->accept(*this);
+				p_obj->End->accept(*this);
+				p_obj->Body->accept(*this);
+		}
+
+		void visit(IndexExprAST *p_obj) {
+				Count++;
+				p_obj->Array->accept(*this);
+				p_obj->Index->accept(*this);
+		}
+};
+
+template <typename NodeT>
+static void countNodes(NodeT& Node) {
+		if (Stats) {
+				CountNodesVisitor counter;
+				Node.accept(counter);
+				CurItem.ASTNodes += counter.Count;
+		}
+}
+
+// -- Parser --
+
+int CompilerSession::getNextToken() {
+		TimePhase timer(PhaseLex);
+		if (Stats) {
+				CurItem.Tokens++;
+		}
+		CurTok = Lex.gettok();
+		//print_tok();
+		return CurTok;
+}
+
+// LISP-like pretty-printer
+
+class LispPrintVisitor : public ASTVisitor {
+	public:
+
+		LispPrintVisitor(raw_ostream& OS): OS(OS), nesting_depth(0) {}
+
+		void visit(NumExprAST *p_obj) {
+				OS << std::string(2 * nesting_depth, ' ') << p_obj->GetVal();
+		}
+
+		void visit(VariableExprAST *p_obj) {
+				OS << std::string(2 * nesting_depth, ' ') << p_obj->GetName();
+		}
+
+		void visit(CallExprAST *p_obj) {
+				OS << std::string(2 * nesting_depth, ' ') << '(' << p_obj->GetCallee();
+				++nesting_depth;
+				for (const auto& arg: p_obj->Args) {
+						OS << "\n";
+						arg->accept(*this);
+				}
+				--nesting_depth;
+				OS << ')';
+		}
+
+		void visit(FunctionAST *p_obj) {
+				p_obj->Proto->accept(*this);
+				OS << "\n";
+				++nesting_depth;
+				p_obj->Body->accept(*this);
+				--nesting_depth;
+		}
+
+		void visit(PrototypeAST *p_obj) {
+				OS << "(def (" << p_obj->GetName();
+				auto& args = p_obj->GetArgs();
+				for (unsigned i = 0; i < args.size(); i++) {
+						OS << ' ' << args[i] << (p_obj->IsArrayArg(i) ? "[]" : "");
+				}
+				OS << ')';
+		}
+
+		void visit(BinaryExprAST *p_obj) {
+				OS << std::string(2 * nesting_depth, ' ') << '(' << p_obj->GetOp() << "\n";
+				++nesting_depth;
+				p_obj->LHS->accept(*this);
+				OS << "\n";
+				p_obj->RHS->accept(*this);
+				--nesting_depth;
+				OS << ")";
+		}
+
+		void visit(ParallelForExprAST *p_obj) {
+				OS << std::string(2 * nesting_depth, ' ') << "(parallel-for " << p_obj->GetVarName() << "\n";
+				++nesting_depth;
+				p_obj->Start->accept(*this);
+				OS << "\n";
+				p_obj->End->accept(*this);
+				OS << "\n";
+				p_obj->Body->accept(*this);
+				--nesting_depth;
+				OS << ")";
+		}
+
+		void visit(IndexExprAST *p_obj) {
+				OS << std::string(2 * nesting_depth, ' ') << "(index\n";
+				++nesting_depth;
+				p_obj->Array->accept(*this);
+				OS << "\n";
+				p_obj->Index->accept(*this);
+				--nesting_depth;
+				OS << ")";
+		}
+
+	private:
+		raw_ostream& OS;
+		int nesting_depth;
+
+};
+
+
+// numberexpr ::= number
+// the number has already been detected in gettok() and is present in 
+std::unique_ptr<ExprAST> CompilerSession::ParseNumberExpr() {
+		auto numberExpr = std::make_unique<NumExprAST>(Lex.NumValue);
+		getNextToken();
+		//fprintf(stderr, "debug: numberexpr\n");
+		return std::move(numberExpr);
+}
+
+// parenexpr:: '(' expression ')'
+std::unique_ptr<ExprAST> CompilerSession::ParseParenExpr() {
+		getNextToken();
+		auto v = ParseExpression();
+
+		if (CurTok != ')') {
+				return LogError("expected: ')'");
+		}
+
+		//fprintf(stderr, "debug: parenexpr\n");
+
+		getNextToken();
+		return v;
+}
+
+// identifierexpr:
+// 	::= identifier
+// 	::= identifier '(' e + expression
+std::unique_ptr<ExprAST> CompilerSession::ParseIdentifierExpr() {
+
+		std::string IdName =  Lex.IdentifierString; // produced by the tokenizer
+
+		getNextToken(); // MUST EAT UP TOKEN BEFORE RETURNING, CURRENT TOKEN IS ID, GET NEXT TOKEN
+
+		if (CurTok != '(') {
+				//fprintf(stderr, "debug: identifier single\n");
+				return std::make_unique<VariableExprAST>(IdName);
+		}
+
+		getNextToken();
+
+		std::vector< std::unique_ptr<ExprAST> > Args;
+
+		if (CurTok != ')') {
+				while (1) {
+						if (auto v = ParseExpression()) 
+								Args.push_back(std::move(v)); // reuse v
+						else
+								return nullptr; // there should be an expression if parentheses don't close immediately
+
+						if (CurTok == ')') 
+								break;
+
+						if (CurTok != ',') 
+								return LogError("expected ',' or ')' in argument list");
+
+						getNextToken();
+				}
+		}
+
+		getNextToken(); // eat ')'
+
+		//fprintf(stderr, "debug: identifier two\n");
+
+		return std::make_unique<CallExprAST>(IdName, std::move(Args));
+}
+
+
+// parallelexpr:
+// 	::= 'parallel' 'for' identifier '=' expression ',' expression 'in' expression
+// `for` and `in` are only keywords here
+std::unique_ptr<ExprAST> CompilerSession::ParseParallelExpr() {
+		getNextToken(); // eat 'parallel'
+
+		if (CurTok != tok_identifier || Lex.IdentifierString != "for") {
+				return LogError("expected 'for' after 'parallel'");
+		}
+		getNextToken();
+
+		if (CurTok != tok_identifier) {
+				return LogError("expected the index variable after 'parallel for'");
+		}
+		std::string VarName = Lex.IdentifierString;
+		getNextToken();
+
+		if (CurTok != '=') {
+				return LogError("expected '=' after the index variable");
+		}
+		getNextToken();
+
+		auto Start = ParseExpression();
+		if (!Start) {
+				return nullptr;
+		}
+		if (CurTok != ',') {
+				return LogError("expected ',' after the start of the range");
+		}
+		getNextToken();
+
+		auto End = ParseExpression();
+		if (!End) {
+				return nullptr;
+		}
+		if (CurTok != tok_identifier || Lex.IdentifierString != "in") {
+				return LogError("expected 'in' after the end of the range");
+		}
+		getNextToken();
+
+		auto Body = ParseExpression();
+		if (!Body) {
+				return nullptr;
+		}
+		return std::make_unique<ParallelForExprAST>(VarName, std::move(Start), std::move(End), std::move(Body));
+}
+
+// indexexpr:
+// 	::= primary '[' expression ']'
+std::unique_ptr<ExprAST> CompilerSession::ParseIndexExpr(std::unique_ptr<ExprAST> Array) {
+		getNextToken(); // eat '['
+
+		auto Index = ParseExpression();
+		if (!Index) {
+				return nullptr;
+		}
+		if (CurTok != ']') {
+				return LogError("expected: ']'");
+		}
+		getNextToken();
+		return std::make_unique<IndexExprAST>(std::move(Array), std::move(Index));
+}
+
+// primary:
+// 	::= identifier
+// 	::= numberexpr
+// 	::= parenexpr
+// 	::= parallelexpr
+// 	::= indexexpr
+std::unique_ptr<ExprAST> CompilerSession::ParsePrimary() {
+		std::unique_ptr<ExprAST> E;
+		// lookahead?
+		switch(CurTok) {
+				case tok_number:
+						E = ParseNumberExpr();
+						break;
+				case tok_identifier:
+						E = ParseIdentifierExpr();
+						break;
+				case '(':
+						E = ParseParenExpr();
+						break;
+				case tok_parallel:
+						E = ParseParallelExpr();
+						break;
+				default:
+						return LogError("unknown token while trying to parse expression");
+						break;
+		}
+		//fprintf(stderr, "debug: primary\n");
+		while (E && CurTok == '[') {
+				E = ParseIndexExpr(std::move(E));
+		}
+		return E;
+}
+
+
+// unary:
+// 	::= primary
+// 	::= op unary, for an op defined with `def unary`
+std::unique_ptr<ExprAST> CompilerSession::ParseUnary() {
+		// Applied to the operand last one first
+		std::string Ops;
+		while (operatorOf(CurTok).Unary) {
+				Ops += (char)CurTok;
+				getNextToken();
+		}
+
+		auto E = ParsePrimary();
+		for (auto it = Ops.rbegin(); E && it != Ops.rend(); ++it) {
+				std::string Callee = std::string("unary") + *it;
+				std::vector<std::unique_ptr<ExprAST>> Args;
+				Args.push_back(std::move(E));
+				E = std::make_unique<CallExprAST>(Callee, std::move(Args));
+		}
+		return E;
+}
+
+// Precedence of CurTok as a binary operator; -1 if it is not one, which
+// ends the expression
+int CompilerSession::getTokPrecedence() {
+		int TokPrec = operatorOf(CurTok).Precedence;
+
+		if (TokPrec <= 0) return -1;
+
+		return TokPrec;
+}
+
+std::unique_ptr<ExprAST> CompilerSession::MakeBinary(int Op, std::unique_ptr<ExprAST> LHS,
+				std::unique_ptr<ExprAST> RHS) {
+		if (!operatorOf(Op).Defined) {
+				return std::make_unique<BinaryExprAST>(Op, std::move(LHS), std::move(RHS));
+		}
+		std::string Callee = std::string("binary") + (char)Op;
+		std::vector<std::unique_ptr<ExprAST>> Args;
+		Args.push_back(std::move(LHS));
+		Args.push_back(std::move(RHS));
+		return std::make_unique<CallExprAST>(Callee, std::move(Args));
+}
+
+
+// expression =
+// 	::= unary (binop unary)*
+//
+// Operators are resolved with a stack rather than a recursive call per
+// precedence level: OpStack holds the ones still waiting for their right
+// operand, in increasing precedence, and each operand that is parsed goes
+// to the operators above it that bind at least as tightly as the next one.
+// A nested expression (in parentheses, an argument) uses the stack above
+// where it was when it started.
+std::unique_ptr<ExprAST> CompilerSession::ParseExpression() {
+		size_t Base = OpStack.size();
+
+		auto RHS = ParseUnary();
+		while (RHS) {
+				int TokPrec = getTokPrecedence();
+
+				while (OpStack.size() > Base && (OpStack.back().Precedence > TokPrec ||
+								(OpStack.back().Precedence == TokPrec && !operatorOf(CurTok).RightAssoc))) {
+						PendingOperator Op = std::move(OpStack.back());
+						OpStack.pop_back();
+						RHS = MakeBinary(Op.Op, std::move(Op.LHS), std::move(RHS));
+				}
+
+				if (TokPrec < 0) {
+						return RHS;
+				}
+
+				OpStack.push_back({std::move(RHS), CurTok, TokPrec});
+				getNextToken(); // ate op
+				RHS = ParseUnary();
+		}
+
+		OpStack.erase(OpStack.begin() + Base, OpStack.end());
+		return nullptr;
+}
+
+
+// Functions of arrays that codegen implements itself, whose names cannot be
+// defined: reductions to a number, and arrays made from numbers
+static bool IsArrayBuiltin(const std::string& Name) {
+		return Name == "sum" || Name == "min" || Name == "max" || Name == "len" ||
+				Name == "iota" || Name == "fill";
+}
+
+// Characters that can be defined as operators: punctuation that does not
+// already delimit something
+static bool IsOperatorChar(int Tok) {
+		return Tok > 0 && Tok < 128 && ispunct(Tok) && !strchr("()[],;:#\".", Tok);
+}
+
+// prototype:
+// 	::= identifier '(' (identifier ('[' ']')?)* ')'
+// 	::= 'binary' op number? 'right'? '(' identifier identifier ')'
+// 	::= 'unary' op '(' identifier ')'
+// The precedence of a binary operator is 1 to 100, 30 if not given; 'right'
+// makes it right associative. `binary` and `unary` are only keywords here,
+// and the operator can be used from the next token on.
+std::unique_ptr<PrototypeAST> CompilerSession::ParsePrototype() {
+
+		if (CurTok != tok_identifier)
+				return LogErrorP("Expected function name in prototype");
+
+		std::string FunctionName = std::move(Lex.IdentifierString);
+		if (IsArrayBuiltin(FunctionName))
+				return LogErrorP((FunctionName + " is a builtin and cannot be redefined").c_str());
+
+		getNextToken();
+
+		char Operator = 0;
+		OperatorInfo Info;
+		bool Binary = FunctionName == "binary";
+		if ((Binary || FunctionName == "unary") && CurTok != '(') {
+				if (!IsOperatorChar(CurTok))
+						return LogErrorP("Expected an operator character after binary or unary");
+				OperatorInfo Current = operatorOf(CurTok);
+				if (Binary && Current.Precedence && !Current.Defined)
+						return LogErrorP("Built-in operators cannot be redefined");
+				Operator = CurTok;
+				FunctionName += Operator;
+				getNextToken();
+
+				if (Binary) {
+						Info.Precedence = 30;
+						Info.Defined = true;
+						if (CurTok == tok_number) {
+								if (!(Lex.NumValue >= 1 && Lex.NumValue <= 100) || Lex.NumValue != (int)Lex.NumValue)
+										return LogErrorP("Invalid precedence: must be a whole number 1..100");
+								Info.Precedence = (uint8_t)Lex.NumValue;
+								getNextToken();
+						}
+						if (CurTok == tok_identifier && Lex.IdentifierString == "right") {
+								Info.RightAssoc = true;
+								getNextToken();
+						}
+				}
+		}
+
+		if (CurTok != '(')
+				return LogErrorP("Expected '(' in prototype");
+
+		std::vector<std::string> Args;
+		std::vector<bool> ArrayArgs;
+
+		getNextToken();
+		while (CurTok == tok_identifier) {
+				Args.push_back(std::move(Lex.IdentifierString));
+				ArrayArgs.push_back(getNextToken() == '[');
+				if (ArrayArgs.back()) {
+						if (getNextToken() != ']')
+								return LogErrorP("Expected ']' after '[' in prototype");
+						getNextToken();
+				}
+		}
+
+		if (CurTok !=  ')')
+				return LogErrorP("Expected ')' in prototype");
+
+		getNextToken(); // after parsing is done, fetch next token
+
+		auto prot = std::make_unique<PrototypeAST>(FunctionName, std::move(Args), std::move(ArrayArgs));
+		if (Operator) {
+				if (prot->GetArgs().size() != (Binary ? 2 : 1))
+						return LogErrorP("Invalid number of operands for operator");
+				OperatorChange Change;
+				Change.Op = Operator;
+				Change.Before = Change.After = operatorOf((unsigned char)Operator);
+				if (Binary) {
+						Info.Unary = Change.Before.Unary;
+						Change.After = Info;
+				} else {
+						Change.After.Unary = true;
+				}
+				Operators[(unsigned char)Operator].store(Change.After, std::memory_order_relaxed);
+				prot->SetOperator(Change);
+		}
+		//fprintf(stderr, "debug: prototype\n");
+		return prot;
+}
+
+// definition:
+// 	::= 'def' 'fastmath'? prototype expression
+std::unique_ptr<FunctionAST> CompilerSession::ParseDefinition() {
+		TimePhase timer(PhaseParse);
+
+		// eat up "def"
+		getNextToken();
+
+		bool FastMath = false;
+		if (CurTok == tok_fastmath) {
+				FastMath = true;
+				getNextToken();
+		}
+
+		auto Proto = ParsePrototype();
+
+		if (!Proto) {
+				return nullptr;
+		}
+
+		auto E = ParseExpression();
+
+		if (!E) {
+				UndoOperator(Proto->GetOperator());
+				return nullptr;
+		}else {
+				//fprintf(stderr, "debug: definition\n");
+				return std::make_unique<FunctionAST>(std::move(Proto), std::move(E), FastMath);
+		}
+}
+
+// extern:
+// 	::= 'extern' prototype
+std::unique_ptr<PrototypeAST> CompilerSession::ParseExtern() {
+		TimePhase timer(PhaseParse);
+
+		getNextToken();
+
+		return ParsePrototype();
+}
+
+// load:
+// 	::= 'load' string
+// The library to load, empty (and an error reported) if there is no string
+std::string CompilerSession::ParseLoad() {
+		TimePhase timer(PhaseParse);
+
+		getNextToken(); // eat 'load'
+		if (CurTok != tok_string) {
+				LogError("Expected a library path in quotes after load");
+				return "";
+		}
+		std::string Path = Lex.IdentifierString;
+		getNextToken();
+		return Path;
+}
+
+// toplevelexpr:
+// 	::= expr
+std::unique_ptr<FunctionAST> CompilerSession::ParseTopLevelExpr() {
+		TimePhase timer(PhaseParse);
+
+		if (auto E = ParseExpression()) {
+
+				auto Proto = std::make_unique<PrototypeAST>("__anon_expr", std::vector<std::string>());
+
+				//fprintf(stderr, "debug: toplevelexpr\n");
+				return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+		}
+
+		return nullptr;
+}
+
+// -- AST Simplifier --
+
+// Host math functions without side effects: a call with constant arguments
+// can be evaluated at parse time, giving exactly what the JITed call would
+static const std::map<std::string, double (*)(double)> PureUnaryFns = {
+		{"sin", ::sin}, {"cos", ::cos}, {"tan", ::tan},
+		{"asin", ::asin}, {"acos", ::acos}, {"atan", ::atan},
+		{"sinh", ::sinh}, {"cosh", ::cosh}, {"tanh", ::tanh},
+		{"exp", ::exp}, {"log", ::log}, {"log10", ::log10}, {"sqrt", ::sqrt},
+		{"fabs", ::fabs}, {"floor", ::floor}, {"ceil", ::ceil},
+};
+
+static const std::map<std::string, double (*)(double, double)> PureBinaryFns = {
+		{"atan2", ::atan2}, {"pow", ::pow}, {"fmod", ::fmod},
+		{"fmin", ::fmin}, {"fmax", ::fmax},
+};
+
+// Folds constant subtrees and applies algebraic identities in place, before
+// codegen. Only rewrites that keep IEEE results bit-identical are done, unless
+// signed zeros may be ignored (fast-math), which additionally allows x+0 -> x.
+class SimplifyVisitor : public ASTVisitor {
+	public:
+
+		SimplifyVisitor(CompilerSession& S, bool NoSignedZeros): S(S), NoSignedZeros(NoSignedZeros) {}
+
+		virtual ~SimplifyVisitor() {}
+
+		// Simplify the subtree owned by E, replacing E if it changed shape
+		void simplify(std::unique_ptr<ExprAST>& E) {
+				E->accept(*this);
+				if (Replacement) {
+						E = std::move(Replacement);
+				}
+		}
+
+		void visit(NumExprAST *p_obj) {}
+
+		void visit(VariableExprAST *p_obj) {}
+
+		void visit(CallExprAST *p_obj) {
+				std::vector<double> Vals;
+				for (auto& arg: p_obj->Args) {
+						simplify(arg);
+						if (auto *num = dynamic_cast<NumExprAST *>(arg.get())) {
+								Vals.push_back(num->GetVal());
+						}
+				}
+
+				// Must still resolve to the host function, not a user `def`, nor
+				// a library's function of the same name (from `load` or --lib)
+				const std::string& Callee = p_obj->GetCallee();
+				if (Vals.size() != p_obj->Args.size() || !S.ExternFunctions.count(Callee) ||
+								S.TheJIT->isLibrarySymbol(Callee)) {
+						return;
+				}
+
+				auto unary = PureUnaryFns.find(Callee);
+				if (unary != PureUnaryFns.end() && Vals.size() == 1) {
+						Replacement = std::make_unique<NumExprAST>(unary->second(Vals[0]));
+						return;
+				}
+
+				auto binary = PureBinaryFns.find(Callee);
+				if (binary != PureBinaryFns.end() && Vals.size() == 2) {
+						Replacement = std::make_unique<NumExprAST>(binary->second(Vals[0], Vals[1]));
+				}
+		}
+
+		void visit(FunctionAST *p_obj) {
+				simplify(p_obj->Body);
+		}
+
+		void visit(PrototypeAST *p_obj) {}
+
+		void visit(BinaryExprAST *p_obj) {
+				simplify(p_obj->LHS);
+				simplify(p_obj->RHS);
+
+				auto *L = dynamic_cast<NumExprAST *>(p_obj->LHS.get());
+				auto *R = dynamic_cast<NumExprAST *>(p_obj->RHS.get());
+
+				if (L && R) {
+						double a = L->GetVal(), b = R->GetVal();
+						switch (p_obj->GetOp()) {
+								case '+': Replacement = std::make_unique<NumExprAST>(a + b); break;
+								case '-': Replacement = std::make_unique<NumExprAST>(a - b); break;
+								case '*': Replacement = std::make_unique<NumExprAST>(a * b); break;
+								case '/': Replacement = std::make_unique<NumExprAST>(a / b); break;
+								// same predicates as codegen: '<' is ordered, '>' is unordered
+								case '<': Replacement = std::make_unique<NumExprAST>(a < b ? 1.0 : 0.0); break;
+								case '>': Replacement = std::make_unique<NumExprAST>(!(a <= b) ? 1.0 : 0.0); break;
+						}
+						return;
+				}
+
+				switch (p_obj->GetOp()) {
+						case '*':
+								if (isConst(R, 1.0)) {
+										Replacement = std::move(p_obj->LHS); // x*1
+								} else if (isConst(L, 1.0)) {
+										Replacement = std::move(p_obj->RHS); // 1*x
+								}
+								break;
+						case '/':
+								if (isConst(R, 1.0)) {
+										Replacement = std::move(p_obj->LHS); // x/1
+								}
+								break;
+						case '-':
+								if (isPosZero(R) || (NoSignedZeros && isConst(R, 0.0))) {
+										Replacement = std::move(p_obj->LHS); // x-0 (-0-0 is -0)
+								}
+								break;
+						case '+':
+								// x+-0 is always x, x+0 only when the sign of zero does not matter
+								if (isNegZero(R) || (NoSignedZeros && isConst(R, 0.0))) {
+										Replacement = std::move(p_obj->LHS);
+								} else if (isNegZero(L) || (NoSignedZeros && isConst(L, 0.0))) {
+										Replacement = std::move(p_obj->RHS);
+								}
+								break;
+				}
+		}
+
+		void visit(ParallelForExprAST *p_obj) {
+				simplify(p_obj->Start);
+				simplify(p_obj->End);
+				simplify(p_obj->Body);
+		}
+
+		void visit(IndexExprAST *p_obj) {
+				simplify(p_obj->Array);
+				simplify(p_obj->Index);
+		}
+
+	protected:
+		CompilerSession& S;
+		bool NoSignedZeros;
+		std::unique_ptr<ExprAST> Replacement;
+
+		static bool isConst(NumExprAST *N, double V) {
+				return N && N->GetVal() == V;
+		}
+
+		static bool isPosZero(NumExprAST *N) {
+				return isConst(N, 0.0) && !std::signbit(N->GetVal());
+		}
+
+		static bool isNegZero(NumExprAST *N) {
+				return isConst(N, 0.0) && std::signbit(N->GetVal());
+		}
+};
+
+// Deep copy of an expression, with some variables bound to constants
+class CloneVisitor : public ASTVisitor {
+	public:
+
+		CloneVisitor() {}
+
+		CloneVisitor(const std::map<std::string, double>& Bindings): Bindings(&Bindings) {}
+
+		// Variables bound to expressions instead, each use replaced by a copy
+		CloneVisitor(const std::map<std::string, ExprAST *>& Exprs): Exprs(&Exprs) {}
+
+		std::unique_ptr<ExprAST> clone(ExprAST *E) {
+				E->accept(*this);
+				return std::move(Result);
+		}
+
+		void visit(NumExprAST *p_obj) {
+				Result = std::make_unique<NumExprAST>(p_obj->GetVal());
+		}
+
+		void visit(VariableExprAST *p_obj) {
+				const std::string& Name = p_obj->GetName();
+				if (Bindings && Bindings->count(Name)) {
+						Result = std::make_unique<NumExprAST>(Bindings->at(Name));
+				} else if (Exprs && Exprs->count(Name)) {
+						Result = CloneVisitor().clone(Exprs->at(Name));
+				} else {
+						Result = std::make_unique<VariableExprAST>(Name);
+				}
+		}
+
+		void visit(CallExprAST *p_obj) {
+				std::vector<std::unique_ptr<ExprAST>> Args;
+				for (const auto& arg: p_obj->Args) {
+						Args.push_back(clone(arg.get()));
+				}
+				Result = std::make_unique<CallExprAST>(p_obj->GetCallee(), std::move(Args));
+		}
+
+		void visit(FunctionAST *p_obj) {}
+
+		void visit(PrototypeAST *p_obj) {}
+
+		void visit(BinaryExprAST *p_obj) {
+				auto L = clone(p_obj->LHS.get());
+				auto R = clone(p_obj->RHS.get());
+				Result = std::make_unique<BinaryExprAST>(p_obj->GetOp(), std::move(L), std::move(R));
+		}
+
+		void visit(ParallelForExprAST *p_obj) {
+				auto Start = clone(p_obj->Start.get());
+				auto End = clone(p_obj->End.get());
+				// the index shadows a bound variable of the same name
+				std::map<std::string, double> InnerBindings;
+				std::map<std::string, ExprAST *> InnerExprs;
+				CloneVisitor inner;
+				if (Bindings) {
+						InnerBindings = *Bindings;
+						InnerBindings.erase(p_obj->GetVarName());
+						inner.Bindings = &InnerBindings;
+				}
+				if (Exprs) {
+						InnerExprs = *Exprs;
+						InnerExprs.erase(p_obj->GetVarName());
+						inner.Exprs = &InnerExprs;
+				}
+				auto Body = inner.clone(p_obj->Body.get());
+				Result = std::make_unique<ParallelForExprAST>(p_obj->GetVarName(), std::move(Start),
+								std::move(End), std::move(Body));
+		}
+
+		void visit(IndexExprAST *p_obj) {
+				auto Array = clone(p_obj->Array.get());
+				auto Index = clone(p_obj->Index.get());
+				Result = std::make_unique<IndexExprAST>(std::move(Array), std::move(Index));
+		}
+
+	private:
+		const std::map<std::string, double> *Bindings = nullptr;
+		const std::map<std::string, ExprAST *> *Exprs = nullptr;
+		std::unique_ptr<ExprAST> Result;
+};
+
+// How often each variable is used in an expression, and whether it has
+// calls (which may have side effects) or parallel for loops (which bind
+// names of their own), for deciding what can be substituted into what
+class UsesVisitor : public ASTVisitor {
+	public:
+
+		UsesVisitor(ExprAST *E) { E->accept(*this); }
+
+		std::map<std::string, unsigned> Uses;
+		bool Calls = false;
+		bool Parallel = false;
+
+		void visit(NumExprAST *p_obj) {}
+
+		void visit(VariableExprAST *p_obj) {
+				Uses[p_obj->GetName()]++;
+		}
+
+		void visit(CallExprAST *p_obj) {
+				Calls = true;
+				for (auto& arg: p_obj->Args) {
+						arg->accept(*this);
+				}
+		}
+
+		void visit(FunctionAST *p_obj) {}
+
+		void visit(PrototypeAST *p_obj) {}
+
+		void visit(BinaryExprAST *p_obj) {
+				p_obj->LHS->accept(*this);
+				p_obj->RHS->accept(*this);
+		}
+
+		void visit(ParallelForExprAST *p_obj) {
+				Parallel = true;
+				p_obj->Start->accept(*this);
+				p_obj->End->accept(*this);
+				p_obj->Body->accept(*this);
+		}
+
+		void visit(IndexExprAST *p_obj) {
+				p_obj->Array->accept(*this);
+				p_obj->Index->accept(*this);
+		}
+};
+
+// -- Profiling Runtime --
+
+struct ProfileFrame {
+	ProfileCounters *Counters;
+	uint64_t Start;
+	uint64_t ChildCycles;
+};
+
+std::vector<std::unique_ptr<ProfileCounters>> ProfiledFunctions;
+static thread_local std::vector<ProfileFrame> ProfileStack;
+static thread_local std::vector<unsigned> ProfileDepth; // by ProfileCounters::Id
+
+void ProfileEnter(ProfileCounters *C) {
+	C->Calls.fetch_add(1, std::memory_order_relaxed);
+	if (ProfileDepth.size() <= C->Id) {
+		ProfileDepth.resize(C->Id + 1);
+	}
+	ProfileDepth[C->Id]++;
+	ProfileStack.push_back({C, ReadCycles(), 0});
+}
+
+void ProfileExit(ProfileCounters *C) {
+	uint64_t Elapsed = ReadCycles() - ProfileStack.back().Start;
+	C->SelfCycles.fetch_add(Elapsed - ProfileStack.back().ChildCycles, std::memory_order_relaxed);
+	if (--ProfileDepth[C->Id] == 0) {
+		C->InclusiveCycles.fetch_add(Elapsed, std::memory_order_relaxed);
+	}
+	ProfileStack.pop_back();
+	if (!ProfileStack.empty()) {
+		ProfileStack.back().ChildCycles += Elapsed;
+	}
+}
+
+static ProfileCounters *NewProfileCounters(const std::string& Name) {
+	ProfiledFunctions.push_back(std::make_unique<ProfileCounters>());
+	ProfileCounters *C = ProfiledFunctions.back().get();
+	C->Id = ProfiledFunctions.size() - 1;
+	C->Name = Name;
+	return C;
+}
+
+// call void @__kprof_enter/exit(i8* <counters>)
+void CompilerSession::EmitProfileCall(const char *Hook, ProfileCounters *C) {
+	Type *PtrTy = Builder->getInt8PtrTy();
+	FunctionCallee Fn = TheModule->getOrInsertFunction(Hook, Builder->getVoidTy(), PtrTy);
+	Value *Counters = ConstantExpr::getIntToPtr(Builder->getInt64((uint64_t)(uintptr_t)C), PtrTy);
+	Builder->CreateCall(Fn, {Counters});
+}
+
+// -- Parallel Runtime --
+
+extern "C" double __kparallel_for(WorkStealingPool::ChunkFn Fn, const void *Env,
+		double Start, double End) {
+	return WorkStealingPool::get().parallelFor(Fn, Env, Start, End);
+}
+
+// -- Array Runtime --
+
+extern "C" void __karena_enter() {
+	ArrayArena::get().enter();
+}
+
+extern "C" void __karena_leave() {
+	ArrayArena::get().leave();
+}
+
+extern "C" void *__karena_alloc(int64_t Bytes) {
+	return ArrayArena::get().allocate(Bytes);
+}
+
+// -- Code Generator --
+
+void CompilerSession::InitializeModuleAndPassManager() {
+	// With --executors the old module was only compiled, not handed over,
+	// and must go before its context
+	TheFPM.reset();
+	TheModule.reset();
+	TheContext = std::make_unique<LLVMContext>();
+	TheModule = std::make_unique<Module>("kaleidoscope", *TheContext);
+	TheModule->setDataLayout(TheJIT->getDataLayout());
+
+	Builder = std::make_unique<IRBuilder<>>(*TheContext);
+
+	// Why .get? Ahh- I want to pass a pointer. What about uniqueness?
+	TheFPM = std::make_unique<legacy::FunctionPassManager>(TheModule.get());
+
+	// The target's cost models, for every pass after; first, or the first
+	// pass needing them would get the generic ones
+	TheFPM->add(createTargetTransformInfoWrapperPass(TheJIT->getTargetIRAnalysis()));
+
+	// Peephole optimizations
+	TheFPM->add(createInstructionCombiningPass());
+	
+	// ?
+	TheFPM->add(createReassociatePass());
+
+	// Global value numbering-> common subexpression elimination. Global is actually per-function
+	TheFPM->add(createGVNPass());
+
+	// Dead code elimination pass;
+	TheFPM->add(createCFGSimplificationPass());
+
+	// Loops over arrays: vectorized, then cleaned up after
+	TheFPM->add(createLoopVectorizePass());
+	TheFPM->add(createInstructionCombiningPass());
+	TheFPM->add(createCFGSimplificationPass());
+
+	// Run initalizers for all passes added to pass manager
+	TheFPM->doInitialization();
+}
+
+Function *CompilerSession::getOrCreateFunction(const std::string& Name) {
+	// Check whether declaration is present in current module
+	if (auto *F = TheModule->getFunction(Name)) {
+		// Hypothesis: When each function is created in a new module, this will never happen
+		return F;
+	}
+
+	// Check whether this function has been declared previously
+	auto F_itr = FunctionProtos.find(Name);
+	if (F_itr != FunctionProtos.end()) {
+		// If yes, codegen declaration to _this module_.
+		return F_itr->second->codegen(*this);
+	}
+
+	return nullptr;
+}
+
+// Create a new constant of type "double"
+Value* NumExprAST::codegen(CompilerSession& S) {
+	return ConstantFP::get(S.Builder->getDoubleTy(), Val);
+}
+
+
+static Value *ArrayWhereNumber(CompilerSession& S, const std::string& What) {
+	return S.LogErrorV((What + " is an array where a number is expected; index it, "
+				"or reduce it with sum, min, max or len").c_str());
+}
+
+// Return a pointer to the value that this variable refers to
+Value* VariableExprAST::codegen(CompilerSession& S) {
+	if (S.ArraySymbols.count(Name)) {
+		return ArrayWhereNumber(S, Name);
+	}
+	Value *varval = S.Symbols[Name];
+	if (!varval) {
+		return S.LogErrorV((std::string("Undefined reference: ") + Name).c_str());
+	}
+	return varval;
+}
+
+static Value *EmitBinaryOp(CompilerSession& S, char Op, Value *L, Value *R) {
+	switch(Op) {
+		case '+':
+			return S.Builder->CreateFAdd(L, R, "add");
+			break;
+		case '-':
+			return S.Builder->CreateFSub(L, R, "sub");
+			break;
+		case '*':
+			return S.Builder->CreateFMul(L, R, "mul");
+			break;
+		case '/':
+			// TODO: do static analysis to ensure that RHS is not a 0?
+			return S.Builder->CreateFDiv(L, R, "div");
+			break;
+		case '<':
+			L = S.Builder->CreateFCmp(CmpInst::FCMP_OLT, L, R, "lessthan");
+			return S.Builder->CreateUIToFP(L, S.Builder->getDoubleTy(), "booltofp");
+			break;
+		case '>':
+			L = S.Builder->CreateFCmp(CmpInst::FCMP_UGT, L, R, "greaterthan");
+			return S.Builder->CreateUIToFP(L, S.Builder->getDoubleTy(), "booltofp");
+		default:
+			return S.LogErrorV("Invalid Operator");
+			break;
+	}
+}
+
+// -- Arrays --
+
+// An array expression, lowered for loops over its elements: Element(I)
+// emits element I (an i64 below Length) at the insert point. What does not
+// depend on I, numbers and the data and lengths of arrays, is emitted once,
+// when the expression is lowered, so that a loop only holds the element-wise
+// operations. A number has no Length, and stands for every element of the
+// arrays it is combined with.
+struct LoweredArray {
+	Value *Length = nullptr;
+	std::function<Value *(Value *I)> Element;
+};
+
+// for (i = 0; i < Length; i++) Acc = Step(i, Acc), Acc starting as Init;
+// returns the last Acc. Without an Init, Step only has to return non-null.
+// Null if Step failed.
+static Value *EmitElementLoop(CompilerSession& S, Value *Length, Value *Init,
+		std::function<Value *(Value *I, Value *Acc)> Step) {
+	Type *Int64Ty = S.Builder->getInt64Ty();
+	BasicBlock *Entry = S.Builder->GetInsertBlock();
+	Function *F = Entry->getParent();
+	BasicBlock *Loop = BasicBlock::Create(*S.TheContext, "elements", F);
+	BasicBlock *Exit = BasicBlock::Create(*S.TheContext, "elements.done", F);
+	S.Builder->CreateCondBr(S.Builder->CreateICmpNE(Length, ConstantInt::get(Int64Ty, 0)), Loop, Exit);
+
+	S.Builder->SetInsertPoint(Loop);
+	PHINode *I = S.Builder->CreatePHI(Int64Ty, 2, "i");
+	I->addIncoming(ConstantInt::get(Int64Ty, 0), Entry);
+	PHINode *Acc = nullptr;
+	if (Init) {
+		Acc = S.Builder->CreatePHI(Init->getType(), 2, "acc");
+		Acc->addIncoming(Init, Entry);
+	}
+
+	Value *Next = Step(I, Acc);
+	if (!Next) {
+		return nullptr;
+	}
+	Value *INext = S.Builder->CreateAdd(I, ConstantInt::get(Int64Ty, 1), "i.next", true, true);
+	BasicBlock *LoopEnd = S.Builder->GetInsertBlock();
+	I->addIncoming(INext, LoopEnd);
+	if (Acc) {
+		Acc->addIncoming(Next, LoopEnd);
+	}
+	S.Builder->CreateCondBr(S.Builder->CreateICmpULT(INext, Length), Loop, Exit);
+
+	S.Builder->SetInsertPoint(Exit);
+	if (!Acc) {
+		return Next;
+	}
+	PHINode *Result = S.Builder->CreatePHI(Init->getType(), 2, "reduced");
+	Result->addIncoming(Init, Entry);
+	Result->addIncoming(Next, LoopEnd);
+	return Result;
+}
+
+// Generates code for expressions that may be arrays. Element-wise operations
+// are fused: `sum(a * b + 1)` is one loop, with no array in between. Arrays
+// are only computed into memory (the arena) to be passed to an array
+// parameter.
+class LowerArrayVisitor : public ASTVisitor {
+	public:
+
+		LowerArrayVisitor(CompilerSession& S): S(S) {}
+
+		// False if there is no code; the reason was reported
+		bool lower(ExprAST *E, LoweredArray& Out) {
+				E->accept(*this);
+				Out = std::move(Result);
+				Result = LoweredArray();
+				return bool(Out.Element);
+		}
+
+		// The data and length of E, for the array parameter What: an array
+		// variable as it is, anything else computed into the arena
+		bool materialize(ExprAST *E, const std::string& What, ArrayValue& Out) {
+				if (auto *var = dynamic_cast<VariableExprAST *>(E)) {
+						auto A = S.ArraySymbols.find(var->GetName());
+						if (A != S.ArraySymbols.end()) {
+								Out = A->second;
+								return true;
+						}
+				}
+
+				LoweredArray A;
+				if (!lower(E, A)) {
+						return false;
+				}
+				if (!A.Length) {
+						S.LogError(("expected an array for " + What).c_str());
+						return false;
+				}
+
+				Type *DoubleTy = S.Builder->getDoubleTy();
+				S.Arena.Used = true;
+				Value *Bytes = S.Builder->CreateMul(A.Length, S.Builder->getInt64(sizeof(double)), "bytes");
+				Value *Data = S.Builder->CreateBitCast(S.Builder->CreateCall(arenaAlloc(), {Bytes}),
+								DoubleTy->getPointerTo(), "array");
+				Out = {Data, A.Length};
+				return EmitElementLoop(S, A.Length, nullptr, [&](Value *I, Value *) -> Value * {
+						Value *X = A.Element(I);
+						if (!X) {
+								return nullptr;
+						}
+						return S.Builder->CreateAlignedStore(X,
+										S.Builder->CreateInBoundsGEP(DoubleTy, Data, I), Align(8));
+				});
+		}
+
+		void visit(NumExprAST *p_obj) {
+				broadcast(p_obj->codegen(S));
+		}
+
+		void visit(VariableExprAST *p_obj) {
+				auto A = S.ArraySymbols.find(p_obj->GetName());
+				if (A == S.ArraySymbols.end()) {
+						broadcast(p_obj->codegen(S));
+						return;
+				}
+				Value *Data = A->second.Data;
+				Result.Length = A->second.Length;
+				Result.Element = [&S = S, Data](Value *I) -> Value * {
+						Type *DoubleTy = S.Builder->getDoubleTy();
+						return S.Builder->CreateAlignedLoad(DoubleTy,
+										S.Builder->CreateInBoundsGEP(DoubleTy, Data, I), Align(8));
+				};
+		}
+
+		void visit(CallExprAST *p_obj) {
+				const std::string& Callee = p_obj->GetCallee();
+				auto& Args = p_obj->Args;
+
+				if (Callee == "sum" || Callee == "min" || Callee == "max" || Callee == "len") {
+						broadcast(reduce(p_obj));
+						return;
+				}
+
+				// iota(n) is 0, 1, ..., fill(n, x) is x, x, ...; n elements
+				if (Callee == "iota" || Callee == "fill") {
+						bool Iota = Callee == "iota";
+						if (Args.size() != (Iota ? 1u : 2u)) {
+								fail(Iota ? "iota takes a length" : "fill takes a length and a value");
+								return;
+						}
+						Value *N = Args[0]->codegen(S);
+						Value *X = Iota ? nullptr : Args[1]->codegen(S);
+						if (!N || (!Iota && !X)) {
+								fail();
+								return;
+						}
+						Result.Length = lengthOf(N);
+						if (Iota) {
+								Result.Element = [&S = S](Value *I) -> Value * {
+										return S.Builder->CreateUIToFP(I, S.Builder->getDoubleTy(), "iota");
+								};
+						} else {
+								Result.Element = [X](Value *) -> Value * { return X; };
+						}
+						return;
+				}
+
+				Function *func = S.getOrCreateFunction(Callee);
+				if (!func) {
+						fail(("undefined function: " + Callee).c_str());
+						return;
+				}
+				auto P = S.FunctionProtos.find(Callee);
+				PrototypeAST *Proto = P != S.FunctionProtos.end() ? P->second.get() : nullptr;
+
+				if (Args.size() != (Proto ? Proto->GetArgs().size() : func->arg_size())) {
+						fail(("Invalid number of arguments in function call to function" + Callee).c_str());
+						return;
+				}
+
+				// The arguments of every call, with a hole for each array passed
+				// to a number parameter, which is Mapped over
+				std::vector<Value *> Argvec;
+				std::vector<std::pair<unsigned, LoweredArray>> Mapped;
+				Value *Length = nullptr;
+				for (unsigned i = 0; i < Args.size(); i++) {
+						if (Proto && Proto->IsArrayArg(i)) {
+								ArrayValue A;
+								if (!materialize(Args[i].get(), Proto->GetArgs()[i] + "[] of " + Callee, A)) {
+										fail();
+										return;
+								}
+								Argvec.push_back(A.Data);
+								Argvec.push_back(A.Length);
+								continue;
+						}
+
+						LoweredArray A;
+						if (!lower(Args[i].get(), A)) {
+								fail();
+								return;
+						}
+						if (A.Length) {
+								Length = minLength(Length, A.Length);
+								Mapped.emplace_back(Argvec.size(), std::move(A));
+								Argvec.push_back(nullptr);
+						} else {
+								Argvec.push_back(A.Element(nullptr));
+						}
+				}
+
+				if (Mapped.empty()) {
+						broadcast(S.Builder->CreateCall(func, Argvec, "call"));
+						return;
+				}
+
+				// f(a) for an array a is the array of the f(a[i])
+				Result.Length = Length;
+				Result.Element = [&S = S, func, Argvec, Mapped](Value *I) -> Value * {
+						std::vector<Value *> Elements(Argvec);
+						for (auto& M: Mapped) {
+								if (!(Elements[M.first] = M.second.Element(I))) {
+										return nullptr;
+								}
+						}
+						return S.Builder->CreateCall(func, Elements, "call");
+				};
+		}
+
+		void visit(FunctionAST *p_obj) {
+				fail();
+		}
+
+		void visit(PrototypeAST *p_obj) {
+				fail();
+		}
+
+		// Element-wise if either side is an array; the shorter one decides
+		// the length
+		void visit(BinaryExprAST *p_obj) {
+				LoweredArray L, R;
+				if (!lower(p_obj->LHS.get(), L) || !lower(p_obj->RHS.get(), R)) {
+						fail();
+						return;
+				}
+				char Op = p_obj->GetOp();
+				if (!L.Length && !R.Length) {
+						broadcast(EmitBinaryOp(S, Op, L.Element(nullptr), R.Element(nullptr)));
+						return;
+				}
+				Result.Length = minLength(L.Length, R.Length);
+				Result.Element = [&S = S, Op, L, R](Value *I) -> Value * {
+						Value *A = L.Element(I), *B = R.Element(I);
+						return A && B ? EmitBinaryOp(S, Op, A, B) : nullptr;
+				};
+		}
+
+		void visit(ParallelForExprAST *p_obj) {
+				broadcast(p_obj->codegen(S));
+		}
+
+		void visit(IndexExprAST *p_obj) {
+				broadcast(p_obj->codegen(S));
+		}
+
+	private:
+		CompilerSession& S;
+		LoweredArray Result;
+
+		void broadcast(Value *V) {
+				if (!V) {
+						fail();
+						return;
+				}
+				Result.Length = nullptr;
+				Result.Element = [V](Value *) -> Value * { return V; };
+		}
+
+		void fail(const char *Msg = nullptr) {
+				if (Msg) {
+						S.LogError(Msg);
+				}
+				Result = LoweredArray();
+		}
+
+		// Either length when the other is a number's
+		Value *minLength(Value *A, Value *B) {
+				if (!A || !B) {
+						return A ? A : B;
+				}
+				return S.Builder->CreateSelect(S.Builder->CreateICmpULT(A, B), A, B, "len");
+		}
+
+		// Counted like parallel for indices: ceil(N), none for N <= 0 or NaN
+		Value *lengthOf(Value *N) {
+				Type *DoubleTy = S.Builder->getDoubleTy();
+				Value *Zero = ConstantFP::get(DoubleTy, 0.0);
+				N = S.Builder->CreateSelect(S.Builder->CreateFCmpOGT(N, Zero), N, Zero);
+				N = S.Builder->CreateMinNum(N, ConstantFP::get(DoubleTy, std::ldexp(1.0, 48)));
+				N = S.Builder->CreateUnaryIntrinsic(Intrinsic::ceil, N);
+				return S.Builder->CreateFPToUI(N, S.Builder->getInt64Ty(), "len");
+		}
+
+		// sum(a), min(a), max(a) and len(a). The sum is in index order
+		// unless fast-math lets the vectorizer reorder it; min and max skip
+		// NaNs.
+		Value *reduce(CallExprAST *p_obj) {
+				const std::string& Callee = p_obj->GetCallee();
+				if (p_obj->Args.size() != 1) {
+						return S.LogErrorV((Callee + " takes one array").c_str());
+				}
+				LoweredArray A;
+				if (!lower(p_obj->Args[0].get(), A)) {
+						return nullptr;
+				}
+				if (!A.Length) {
+						return S.LogErrorV((Callee + " takes an array, not a number").c_str());
+				}
+
+				Type *DoubleTy = S.Builder->getDoubleTy();
+				if (Callee == "len") {
+						return S.Builder->CreateUIToFP(A.Length, DoubleTy, "len");
+				}
+				double Init = Callee == "sum" ? 0.0 : Callee == "min" ? INFINITY : -INFINITY;
+				return EmitElementLoop(S, A.Length, ConstantFP::get(DoubleTy, Init),
+								[&](Value *I, Value *Acc) -> Value * {
+						Value *X = A.Element(I);
+						if (!X) {
+								return nullptr;
+						}
+						if (Callee == "sum") {
+								return S.Builder->CreateFAdd(Acc, X, "sum");
+						}
+						return Callee == "min" ? S.Builder->CreateMinNum(Acc, X) : S.Builder->CreateMaxNum(Acc, X);
+				});
+		}
+
+		// i8 *__karena_alloc(i64 Bytes), telling the optimizer that what it
+		// returns is fresh memory, aligned for any vector
+		Function *arenaAlloc() {
+				if (Function *F = S.TheModule->getFunction("__karena_alloc")) {
+						return F;
+				}
+				Function *F = Function::Create(
+						FunctionType::get(S.Builder->getInt8PtrTy(), {S.Builder->getInt64Ty()}, false),
+						Function::ExternalLinkage, "__karena_alloc", S.TheModule.get());
+				F->addRetAttr(Attribute::NoAlias);
+				F->addRetAttr(Attribute::getWithAlignment(*S.TheContext, Align(ArrayArena::Alignment)));
+				return F;
+		}
+};
+
+// Put __karena_enter at the start of the arena scope and __karena_leave at
+// the insert point, if anything in the scope allocated
+void CompilerSession::CloseArenaScope() {
+	if (!Arena.Used) {
+		return;
+	}
+	Type *VoidTy = Builder->getVoidTy();
+	IRBuilder<> StartBuilder(Arena.Start, Arena.Start->getFirstInsertionPt());
+	StartBuilder.CreateCall(TheModule->getOrInsertFunction("__karena_enter", VoidTy));
+	Builder->CreateCall(TheModule->getOrInsertFunction("__karena_leave", VoidTy));
+	Arena.Used = false;
+}
+
+// Only the element asked for is computed: (a * b)[i] is one multiplication
+Value* IndexExprAST::codegen(CompilerSession& S) {
+	LoweredArray A;
+	if (!LowerArrayVisitor(S).lower(Array.get(), A)) {
+		return nullptr;
+	}
+	if (!A.Length) {
+		return S.LogErrorV("only arrays can be indexed");
+	}
+	Value *I = Index->codegen(S);
+	if (!I) {
+		return nullptr;
+	}
+
+	Type *DoubleTy = S.Builder->getDoubleTy();
+	Value *InBounds = S.Builder->CreateAnd(
+		S.Builder->CreateFCmpOGE(I, ConstantFP::get(DoubleTy, 0.0)),
+		S.Builder->CreateFCmpOLT(I, S.Builder->CreateUIToFP(A.Length, DoubleTy)), "inbounds");
+
+	BasicBlock *Entry = S.Builder->GetInsertBlock();
+	Function *F = Entry->getParent();
+	BasicBlock *Get = BasicBlock::Create(*S.TheContext, "element", F);
+	BasicBlock *Done = BasicBlock::Create(*S.TheContext, "indexed", F);
+	S.Builder->CreateCondBr(InBounds, Get, Done);
+
+	S.Builder->SetInsertPoint(Get);
+	Value *Elem = A.Element(S.Builder->CreateFPToUI(I, S.Builder->getInt64Ty()));
+	if (!Elem) {
+		return nullptr;
+	}
+	BasicBlock *GetEnd = S.Builder->GetInsertBlock();
+	S.Builder->CreateBr(Done);
+
+	S.Builder->SetInsertPoint(Done);
+	PHINode *Result = S.Builder->CreatePHI(DoubleTy, 2, "index");
+	Result->addIncoming(ConstantFP::getNaN(DoubleTy), Entry);
+	Result->addIncoming(Elem, GetEnd);
+	return Result;
+}
+
+// A call with arrays for number parameters is an array, as are iota and fill:
+// a number is expected here
+Value* CallExprAST::codegen(CompilerSession& S) {
+	LoweredArray Call;
+	if (!LowerArrayVisitor(S).lower(this, Call)) {
+		return nullptr;
+	}
+	if (Call.Length) {
+		return ArrayWhereNumber(S, Callee + "(...)");
+	}
+	return Call.Element(nullptr);
+}
+
+Value* BinaryExprAST::codegen(CompilerSession& S) {
+	Value *L = LHS->codegen(S);
+	Value *R = RHS->codegen(S);
+
+	if (!L || !R) {
+		return nullptr;
+	}
+	return EmitBinaryOp(S, Op, L, R);
+}
+
+// The body becomes an internal function summing it over a chunk of the
+// range, `double chunk(i8 *Env, double Start, i64 Begin, i64 End)`, which
+// __kparallel_for calls from the pool's threads. The variables the body can
+// see are copied into Env, a struct of the numbers and then the data and
+// length of the arrays, each by name order.
+Value* ParallelForExprAST::codegen(CompilerSession& S) {
+	Value *StartV = Start->codegen(S);
+	Value *EndV = End->codegen(S);
+	if (!StartV || !EndV) {
+		return nullptr;
+	}
+
+	std::vector<std::string> Captured, CapturedArrays;
+	for (const auto& Sym: S.Symbols) {
+		if (Sym.second && Sym.first != VarName) {
+			Captured.push_back(Sym.first);
+		}
+	}
+	for (const auto& Sym: S.ArraySymbols) {
+		if (Sym.first != VarName) {
+			CapturedArrays.push_back(Sym.first);
+		}
+	}
+	std::sort(Captured.begin(), Captured.end());
+	std::sort(CapturedArrays.begin(), CapturedArrays.end());
+
+	Type *DoubleTy = S.Builder->getDoubleTy();
+	Type *PtrTy = S.Builder->getInt8PtrTy();
+	Type *Int64Ty = S.Builder->getInt64Ty();
+	BasicBlock *ParentBB = S.Builder->GetInsertBlock();
+	Function *Parent = ParentBB->getParent();
+
+	std::vector<Type *> EnvFields(Captured.size(), DoubleTy);
+	for (unsigned i = 0; i < CapturedArrays.size(); i++) {
+		EnvFields.push_back(DoubleTy->getPointerTo());
+		EnvFields.push_back(Int64Ty);
+	}
+	StructType *EnvTy = StructType::get(*S.TheContext, EnvFields);
+
+	// In the entry block, so that loops nested in a body do not grow the stack
+	Value *Env = ConstantPointerNull::get(cast<PointerType>(PtrTy));
+	if (!EnvFields.empty()) {
+		IRBuilder<> EntryBuilder(&Parent->getEntryBlock(), Parent->getEntryBlock().begin());
+		Value *EnvV = EntryBuilder.CreateAlloca(EnvTy, nullptr, "env");
+		unsigned Field = 0;
+		for (const auto& Name: Captured) {
+			S.Builder->CreateStore(S.Symbols[Name], S.Builder->CreateStructGEP(EnvTy, EnvV, Field++));
+		}
+		for (const auto& Name: CapturedArrays) {
+			ArrayValue& A = S.ArraySymbols[Name];
+			S.Builder->CreateStore(A.Data, S.Builder->CreateStructGEP(EnvTy, EnvV, Field++));
+			S.Builder->CreateStore(A.Length, S.Builder->CreateStructGEP(EnvTy, EnvV, Field++));
+		}
+		Env = S.Builder->CreateBitCast(EnvV, PtrTy);
+	}
+
+	Function *Chunk = Function::Create(
+		FunctionType::get(DoubleTy, {PtrTy, DoubleTy, Int64Ty, Int64Ty}, false),
+		Function::InternalLinkage, Parent->getName() + ".parallel", S.TheModule.get());
+	Argument *EnvArg = Chunk->getArg(0), *StartArg = Chunk->getArg(1);
+	Argument *BeginArg = Chunk->getArg(2), *EndArg = Chunk->getArg(3);
+	EnvArg->setName("env");
+	StartArg->setName("start");
+	BeginArg->setName("begin");
+	EndArg->setName("end");
+
+	auto OuterSymbols = std::move(S.Symbols);
+	auto OuterArraySymbols = std::move(S.ArraySymbols);
+	auto OuterArena = S.Arena;
+	S.Symbols.clear();
+	S.ArraySymbols.clear();
+
+	BasicBlock *Entry = BasicBlock::Create(*S.TheContext, "entry", Chunk);
+	BasicBlock *Loop = BasicBlock::Create(*S.TheContext, "loop", Chunk);
+	BasicBlock *Exit = BasicBlock::Create(*S.TheContext, "exit", Chunk);
+
+	S.Builder->SetInsertPoint(Entry);
+	Value *EnvV = S.Builder->CreateBitCast(EnvArg, EnvTy->getPointerTo());
+	unsigned Field = 0;
+	for (const auto& Name: Captured) {
+		S.Symbols[Name] = S.Builder->CreateLoad(DoubleTy,
+				S.Builder->CreateStructGEP(EnvTy, EnvV, Field++), Name);
+	}
+	for (const auto& Name: CapturedArrays) {
+		Value *Data = S.Builder->CreateLoad(DoubleTy->getPointerTo(),
+				S.Builder->CreateStructGEP(EnvTy, EnvV, Field++), Name);
+		Value *Length = S.Builder->CreateLoad(Int64Ty,
+				S.Builder->CreateStructGEP(EnvTy, EnvV, Field++), Name + ".len");
+		S.ArraySymbols[Name] = {Data, Length};
+	}
+	S.Builder->CreateCondBr(S.Builder->CreateICmpSLT(BeginArg, EndArg), Loop, Exit);
+
+	// for (k = begin; k < end; k++) sum += body(start + k)
+	S.Builder->SetInsertPoint(Loop);
+	PHINode *K = S.Builder->CreatePHI(Int64Ty, 2, "k");
+	PHINode *Acc = S.Builder->CreatePHI(DoubleTy, 2, "acc");
+	K->addIncoming(BeginArg, Entry);
+	Acc->addIncoming(ConstantFP::get(DoubleTy, 0.0), Entry);
+	S.Symbols[VarName] = S.Builder->CreateFAdd(StartArg, S.Builder->CreateSIToFP(K, DoubleTy), VarName);
+
+	// Arrays computed by the body are freed after each index
+	S.Arena = ArenaScope{Loop, false};
+	Value *BodyV = Body->codegen(S);
+	if (!BodyV) {
+		Chunk->eraseFromParent();
+		S.Symbols = std::move(OuterSymbols);
+		S.ArraySymbols = std::move(OuterArraySymbols);
+		S.Arena = OuterArena;
+		S.Builder->SetInsertPoint(ParentBB);
+		return nullptr;
+	}
+	S.CloseArenaScope();
+
+	Value *Sum = S.Builder->CreateFAdd(Acc, BodyV, "sum");
+	Value *Next = S.Builder->CreateAdd(K, ConstantInt::get(Int64Ty, 1), "next");
+	BasicBlock *LoopEnd = S.Builder->GetInsertBlock();
+	K->addIncoming(Next, LoopEnd);
+	Acc->addIncoming(Sum, LoopEnd);
+	S.Builder->CreateCondBr(S.Builder->CreateICmpSLT(Next, EndArg), Loop, Exit);
+
+	S.Builder->SetInsertPoint(Exit);
+	PHINode *Result = S.Builder->CreatePHI(DoubleTy, 2, "result");
+	Result->addIncoming(ConstantFP::get(DoubleTy, 0.0), Entry);
+	Result->addIncoming(Sum, LoopEnd);
+	S.Builder->CreateRet(Result);
+
+	verifyFunction(*Chunk);
+	{
+		TimePhase timer(PhaseOptimize);
+		S.TheFPM->run(*Chunk);
+	}
+
+	S.Symbols = std::move(OuterSymbols);
+	S.ArraySymbols = std::move(OuterArraySymbols);
+	S.Arena = OuterArena;
+	S.Builder->SetInsertPoint(ParentBB);
+
+	FunctionCallee Runtime = S.TheModule->getOrInsertFunction("__kparallel_for",
+			DoubleTy, PtrTy, PtrTy, DoubleTy, DoubleTy);
+	return S.Builder->CreateCall(Runtime,
+			{S.Builder->CreateBitCast(Chunk, PtrTy), Env, StartV, EndV}, "parallel");
+}
+
+Function* PrototypeAST::codegen(CompilerSession& S) {
+	TimePhase timer(PhaseCodegen);
+
+	Type *DoubleTy = S.Builder->getDoubleTy();
+	std::vector<Type *> Argtypes;
+	for (unsigned i = 0; i < Args.size(); i++) {
+		Argtypes.push_back(IsArrayArg(i) ? DoubleTy->getPointerTo() : DoubleTy);
+		if (IsArrayArg(i)) {
+			Argtypes.push_back(S.Builder->getInt64Ty());
+		}
+	}
+
+	FunctionType *func_type = FunctionType::get(DoubleTy, Argtypes, false);
+
+	// TODO: why do I use TheModule.get() here? Why not *TheModule? how will things change due to this?
+	Function *func = Function::Create(func_type, Function::ExternalLinkage, Name, S.TheModule.get());
+	
+	auto x = func->arg_begin();
+	for (unsigned i = 0; i < Args.size(); i++) {
+		(x++)->setName(Args[i]);
+		if (IsArrayArg(i)) {
+			(x++)->setName(Args[i] + ".len");
+		}
+	}
+
+	return func;
+}
+
+Function* FunctionAST::codegen(CompilerSession& S) {
+	TimePhase timer(PhaseCodegen);
+
+	// TODO: why are we doing this? This codegen method will never be called 
+	// for an extern function, right? Why else do I need to check?
+	const std::string& func_name = Proto->GetName();
+
+	// Make global FunctionProto map the owner of function prototype node 
+	// This ensures that declaration can be codegened in different modules
+	S.FunctionProtos[func_name] = std::move(Proto);
+	S.ExternFunctions.erase(func_name);
+
+	Function *func = S.getOrCreateFunction(func_name);
+
+	if (!func) {
+		return nullptr;
+	}
+
+	BasicBlock *BB = BasicBlock::Create(*S.TheContext, "entry", func);
+	S.Builder->SetInsertPoint(BB);
+	S.Arena = ArenaScope{BB, false};
+
+	// Top-level expressions are not worth a line in the profile each
+	ProfileCounters *Counters = nullptr;
+	if (S.Opts.Profile && !StringRef(func_name).startswith("__anon_expr")) {
+		Counters = NewProfileCounters(func_name);
+		S.EmitProfileCall("__kprof_enter", Counters);
+	}
+
+	// Every FP instruction created for this body carries these flags, which is
+	// what lets reassociate/instcombine and the backend (FMA) touch them
+	FastMathFlags FMF = S.Opts.FMF;
+	if (FastMath) {
+		FMF.setFast();
+	}
+	S.Builder->setFastMathFlags(FMF);
+
+	// Kaleidoscope code only reads arrays it is given, and what it computes
+	// goes to fresh memory, so array arguments alias nothing it writes
+	PrototypeAST& P = *S.FunctionProtos[func_name];
+	S.Symbols.clear();
+	S.ArraySymbols.clear();
+	auto arg = func->arg_begin();
+	for (unsigned i = 0; i < P.GetArgs().size(); i++) {
+		Argument *A = &*arg++;
+		if (P.IsArrayArg(i)) {
+			A->addAttr(Attribute::NoAlias);
+			S.ArraySymbols[P.GetArgs()[i]] = {A, &*arg++};
+		} else {
+			S.Symbols[P.GetArgs()[i]] = A;
+		}
+	}
+
+	Value *retval = Body->codegen(S);
+	if (retval) {
+		S.CloseArenaScope();
+		if (Counters) {
+			S.EmitProfileCall("__kprof_exit", Counters);
+		}
+		S.Builder->CreateRet(retval);
+		// TODO: Does this mean that my "write head" is at the end of the function-
+		// but I do not need to move it immediately, because the only place where
+		// writes will happen will be while generating code for another function,
+		// and I _will_ call SetInsertPoint in that function anyway?
+
+		// TODO: What if this check fails? Do I still continue?
+		verifyFunction(*func);
+
+		// Run passes on function
+		{
+			TimePhase timer(PhaseOptimize);
+			if (Stats) {
+				CurItem.IRBefore += func->getInstructionCount();
+			}
+			S.TheFPM->run(*func);
+			if (Stats) {
+				CurItem.IRAfter += func->getInstructionCount();
+			}
+		}
+
+		return func;
+	}
+
+	// For recovering from errors- improperly defined functions should not persist.
+	func->eraseFromParent();
+	return nullptr;
+}
+
+// Hand the current module over to the JIT, for good unless RT is given,
+// and start a new one
+bool CompilerSession::CommitModule(ResourceTrackerSP RT) {
+	TimePhase timer(PhaseJIT);
+	Error Err = Pool ? Pool->addModule(*TheModule) : TheJIT->addModule(
+		ThreadSafeModule(std::move(TheModule), std::move(TheContext)), std::move(RT)
+	);
+
+	InitializeModuleAndPassManager();
+
+	if (Err) {
+		reportError(std::move(Err));
+		return false;
+	}
+	return true;
+}
+
+// -- Watch Mode --
+
+// What callers are compiled against, the kind of each parameter: "(#,[])"
+// for f(x a[])
+static std::string SignatureOf(PrototypeAST& P) {
+	std::string Sig = "(";
+	for (unsigned i = 0; i < P.GetArgs().size(); i++) {
+		Sig += i ? "," : "";
+		Sig += P.IsArrayArg(i) ? "[]" : "#";
+	}
+	return Sig + ")";
+}
+
+// Hashes what a definition says rather than how it is written (names,
+// operators, numbers by their bits, and the shape of the tree), so that
+// layout and comments do not count, and collects the functions it calls
+class DefinitionHash : public ASTVisitor {
+	public:
+
+		size_t Hash = 0;
+		std::set<std::string> Callees;
+
+		DefinitionHash(FunctionAST& F) { F.accept(*this); }
+		DefinitionHash(ExprAST& E) { E.accept(*this); }
+
+		void visit(NumExprAST *p_obj) {
+				mix(hash_combine('#', DoubleToBits(p_obj->GetVal())));
+		}
+
+		void visit(VariableExprAST *p_obj) {
+				mix(hash_combine('v', p_obj->GetName()));
+		}
+
+		void visit(CallExprAST *p_obj) {
+				mix(hash_combine('(', p_obj->GetCallee(), p_obj->Args.size()));
+				for (const auto& arg: p_obj->Args) {
+						arg->accept(*this);
+				}
+				Callees.insert(p_obj->GetCallee());
+		}
+
+		void visit(FunctionAST *p_obj) {
+				mix(hash_combine('f', p_obj->FastMath));
+				p_obj->Proto->accept(*this);
+				p_obj->Body->accept(*this);
+		}
+
+		void visit(PrototypeAST *p_obj) {
+				mix(hash_combine('p', p_obj->GetName(), SignatureOf(*p_obj)));
+		}
+
+		void visit(BinaryExprAST *p_obj) {
+				mix(hash_combine('b', p_obj->GetOp()));
+				p_obj->LHS->accept(*this);
+				p_obj->RHS->accept(*this);
+		}
+
+		void visit(ParallelForExprAST *p_obj) {
+				mix(hash_combine('P', p_obj->GetVarName()));
+				p_obj->Start->accept(*this);
+				p_obj->End->accept(*this);
+				p_obj->Body->accept(*this);
+		}
+
+		void visit(IndexExprAST *p_obj) {
+				mix(hash_code('['));
+				p_obj->Array->accept(*this);
+				p_obj->Index->accept(*this);
+		}
+
+	private:
+		void mix(hash_code H) {
+				Hash = hash_combine(Hash, H);
+		}
+};
+
+// Where the stub of a definition points while it has no code: between
+// dropping a stale body and compiling the new one, or when that failed
+static double DroppedDefinition() {
+	return std::nan("");
+}
+
+// -- Function Specialization --
+
+// Clones of clones are named after, and counted against, the original
+static std::string rootName(const std::string& Callee) {
+	return Callee.substr(0, Callee.find('.'));
+}
+
+// Forget the clones of a function that is being (re)defined, and every clone
+// that folded, cloned or inlined it, so it can be specialized anew
+void CompilerSession::InvalidateSpecializations(const std::string& Callee) {
+	for (auto it = Specializations.begin(); it != Specializations.end(); ) {
+		if (it->second.Specialized.count(Callee)) {
+			it = Specializations.erase(it);
+		} else {
+			++it;
+		}
+	}
+	SpecializationCount.erase(rootName(Callee));
+}
+
+// Simplifier that also rewrites calls to defined functions with some constant
+// arguments into calls to a clone that has those arguments bound, so the
+// constants propagate through the callee's body. Clones are compiled (into
+// their own module) the first time they are needed, then reused. Calls to
+// user-defined operators are inlined instead where that keeps their meaning.
+class SpecializeVisitor : public SimplifyVisitor {
+	public:
+
+		// FastMath: the code being simplified is the body of a `def fastmath`
+		SpecializeVisitor(CompilerSession& S, bool NoSignedZeros, bool FastMath = false):
+				SimplifyVisitor(S, NoSignedZeros), FastMath(FastMath) {}
+
+		std::set<std::string> Specialized; // callees folded, cloned or inlined into the code
+
+		using SimplifyVisitor::visit;
+
+		void visit(CallExprAST *p_obj) {
+				SimplifyVisitor::visit(p_obj);
+				if (Replacement || inlineOperator(p_obj)) {
+						return;
+				}
+
+				const std::string& Callee = p_obj->GetCallee();
+				auto def = S.FunctionDefs.find(Callee);
+				if (def == S.FunctionDefs.end()) {
+						return;
+				}
+
+				auto& Params = S.FunctionProtos[Callee]->GetArgs();
+				if (Params.size() != p_obj->Args.size()) {
+						return; // codegen reports it
+				}
+
+				// Key on the exact bits, so that -0/0 and NaNs stay distinct. A
+				// number for an array is left for codegen to report.
+				auto *Proto = S.FunctionProtos[Callee].get();
+				std::map<std::string, double> Bindings;
+				std::string Key = Callee + "(";
+				for (unsigned i = 0; i < Params.size(); i++) {
+						auto *num = dynamic_cast<NumExprAST *>(p_obj->Args[i].get());
+						if (num && !Proto->IsArrayArg(i)) {
+								Bindings[Params[i]] = num->GetVal();
+								Key += utohexstr(DoubleToBits(num->GetVal()));
+						}
+						Key += ",";
+				}
+				Key += ")";
+
+				if (Bindings.empty()) {
+						return;
+				}
+
+				auto spec = S.Specializations.find(Key);
+				if (spec == S.Specializations.end()) {
+						if (S.SpecializationCount[rootName(Callee)] >= S.Opts.SpecializeLimit) {
+								return;
+						}
+						auto made = specialize(Callee, def->second.get(), Params, Bindings);
+						if (!made) {
+								return;
+						}
+						spec = S.Specializations.emplace(Key, std::move(*made)).first;
+				}
+				Specialized.insert(spec->second.Specialized.begin(), spec->second.Specialized.end());
+
+				if (spec->second.Name.empty()) {
+						Replacement = std::make_unique<NumExprAST>(spec->second.Value);
+						return;
+				}
+
+				std::vector<std::unique_ptr<ExprAST>> Args;
+				for (unsigned i = 0; i < Params.size(); i++) {
+						if (!Bindings.count(Params[i])) {
+								Args.push_back(std::move(p_obj->Args[i]));
+						}
+				}
+				Replacement = std::make_unique<CallExprAST>(spec->second.Name, std::move(Args));
+		}
+
+	private:
+
+		bool FastMath;
+		std::vector<std::string> Inlining; // operators whose body is being simplified, innermost last
+
+		// Replace a call to an operator from `def binary` or `def unary` by its
+		// body, the operands in place of the parameters, if both bodies have
+		// the same FP semantics (`fastmath` or not). An operand other than
+		// a number or a variable must be used exactly once and have no calls,
+		// so that nothing is computed twice, dropped, or run out of order.
+		bool inlineOperator(CallExprAST *p_obj) {
+				const std::string& Callee = p_obj->GetCallee();
+				auto def = S.FunctionDefs.find(Callee);
+				if (def == S.FunctionDefs.end() || def->second->FastMath != FastMath ||
+								std::find(Inlining.begin(), Inlining.end(), Callee) != Inlining.end()) {
+						return false;
+				}
+
+				auto *Proto = S.FunctionProtos[Callee].get();
+				auto& Params = Proto->GetArgs();
+				if (!Proto->IsOperator() || Params.size() != p_obj->Args.size()) {
+						return false;
+				}
+
+				UsesVisitor Body(def->second->Body.get());
+				if (Body.Parallel) {
+						return false; // its index could capture an operand's variable
+				}
+
+				std::map<std::string, ExprAST *> Operands;
+				for (unsigned i = 0; i < Params.size(); i++) {
+						ExprAST *Arg = p_obj->Args[i].get();
+						if (Proto->IsArrayArg(i)) {
+								return false;
+						}
+						if (!dynamic_cast<NumExprAST *>(Arg) && !dynamic_cast<VariableExprAST *>(Arg)) {
+								UsesVisitor Uses(Arg);
+								if (Uses.Calls || Uses.Parallel || Body.Uses[Params[i]] != 1) {
+										return false;
+								}
+						}
+						Operands[Params[i]] = Arg;
+				}
+
+				CloneVisitor cloner(Operands);
+				auto Inlined = cloner.clone(def->second->Body.get());
+				Inlining.push_back(Callee);
+				simplify(Inlined);
+				Inlining.pop_back();
+
+				Specialized.insert(Callee);
+				Replacement = std::move(Inlined);
+				return true;
+		}
+
+		Optional<Specialization> specialize(const std::string& Callee, FunctionAST *Def,
+						const std::vector<std::string>& Params,
+						const std::map<std::string, double>& Bindings) {
+				// Counted before the clone is simplified: a clone of a recursive
+				// function specializes its own calls, and this bounds that
+				std::string Root = rootName(Callee);
+				S.SpecializationCount[Root]++;
+
+				CloneVisitor cloner(Bindings);
+				auto Body = cloner.clone(Def->Body.get());
+				SpecializeVisitor specializer(S, S.Opts.FMF.noSignedZeros() || Def->FastMath, Def->FastMath);
+				specializer.simplify(Body);
+
+				// A clone of a clone has what that one specialized, from
+				// calls no longer in the body
+				std::set<std::string> Specialized = std::move(specializer.Specialized);
+				Specialized.insert(Callee);
+				for (const auto& spec: S.Specializations) {
+						if (spec.second.Name == Callee) {
+								Specialized.insert(spec.second.Specialized.begin(), spec.second.Specialized.end());
+						}
+				}
+
+				if (auto *num = dynamic_cast<NumExprAST *>(Body.get())) {
+						return Specialization{"", num->GetVal(), std::move(Specialized)};
+				}
+
+				auto *Proto = S.FunctionProtos[Callee].get();
+				std::vector<std::string> Args;
+				std::vector<bool> ArrayArgs;
+				for (unsigned i = 0; i < Params.size(); i++) {
+						if (!Bindings.count(Params[i])) {
+								Args.push_back(Params[i]);
+								ArrayArgs.push_back(Proto->IsArrayArg(i));
+						}
+				}
+
+				std::string Name = Root + ".spec" + std::to_string(++S.NextClone);
+				auto Clone = std::make_unique<FunctionAST>(
+								std::make_unique<PrototypeAST>(Name, std::move(Args), std::move(ArrayArgs)),
+								std::move(Body), Def->FastMath);
+
+				CompiledFunction Compiled;
+				if (S.Opts.Watch) {
+						Compiled.Clone = true;
+						Compiled.Calls = DefinitionHash(*Clone->Body).Callees;
+						Compiled.Inlined = Specialized;
+						Compiled.RT = S.TheJIT->getMainJITDylib().createResourceTracker();
+				}
+
+				Function *func = Clone->codegen(S);
+				if (!func) {
+						return None;
+				}
+
+				if (S.Echo) {
+						func->print(*S.Echo);
+						*S.Echo << "\nSpecialized " << Callee << "\n";
+				}
+
+				if (!S.CommitModule(Compiled.RT)) {
+						return None;
+				}
+				if (S.Opts.Watch) {
+						S.CallGraph[Name] = std::move(Compiled);
+				}
+
+				// A clone can itself be specialized further (e.g. from inside
+				// another clone that binds its remaining arguments)
+				S.FunctionDefs[Name] = std::move(Clone);
+				return Specialization{Name, 0, std::move(Specialized)};
+		}
+};
+
+// -- Compiled Expression Cache --
+
+// Replaces every numeric literal of an expression with a parameter (named
+// ".0", ".1", ... so it cannot capture a user variable), and builds the
+// resulting shape as a string: `fib(30)` and `fib(31)` both become "fib(#)"
+class HoistLiteralsVisitor : public ASTVisitor {
+	public:
+
+		std::string Shape;
+		std::vector<double> Literals;
+		std::set<std::string> Callees;
+
+		void hoist(std::unique_ptr<ExprAST>& E) {
+				E->accept(*this);
+				if (Replacement) {
+						E = std::move(Replacement);
+				}
+		}
+
+		void visit(NumExprAST *p_obj) {
+				Shape += '#';
+				Replacement = std::make_unique<VariableExprAST>("." + std::to_string(Literals.size()));
+				Literals.push_back(p_obj->GetVal());
+		}
+
+		void visit(VariableExprAST *p_obj) {
+				Shape += p_obj->GetName();
+		}
+
+		void visit(CallExprAST *p_obj) {
+				Shape += p_obj->GetCallee();
+				Shape += '(';
+				for (auto& arg: p_obj->Args) {
+						hoist(arg);
+						Shape += ',';
+				}
+				Shape += ')';
+				Callees.insert(p_obj->GetCallee());
+		}
+
+		void visit(FunctionAST *p_obj) {
+				hoist(p_obj->Body);
+		}
+
+		void visit(PrototypeAST *p_obj) {}
+
+		void visit(BinaryExprAST *p_obj) {
+				Shape += '(';
+				Shape += p_obj->GetOp();
+				hoist(p_obj->LHS);
+				Shape += ' ';
+				hoist(p_obj->RHS);
+				Shape += ')';
+		}
+
+		void visit(ParallelForExprAST *p_obj) {
+				Shape += "(parallel " + p_obj->GetVarName() + " ";
+				hoist(p_obj->Start);
+				Shape += ' ';
+				hoist(p_obj->End);
+				Shape += ' ';
+				hoist(p_obj->Body);
+				Shape += ')';
+		}
+
+		void visit(IndexExprAST *p_obj) {
+				Shape += '[';
+				hoist(p_obj->Array);
+				Shape += ' ';
+				hoist(p_obj->Index);
+				Shape += ']';
+		}
+
+		std::vector<std::string> paramNames() const {
+				std::vector<std::string> Names;
+				for (unsigned i = 0; i < Literals.size(); i++) {
+						Names.push_back("." + std::to_string(i));
+				}
+				return Names;
+		}
+
+	private:
+		std::unique_ptr<ExprAST> Replacement;
+};
+
+// Compiled top-level expressions by shape, least recently used first out.
+// Each entry owns the resource tracker of its module, or its code in the
+// executors, so eviction frees the code.
+std::list<CompiledExprCache::Entry>::iterator CompiledExprCache::evict(std::list<Entry>::iterator it) {
+		if (it->Remote) {
+				if (Error Err = S.Pool->remove(*it->Remote)) {
+						S.reportError(std::move(Err));
+				}
+		} else if (!it->RT->isDefunct()) {
+				if (Error Err = it->RT->remove()) {
+						S.reportError(std::move(Err));
+				}
+		}
+		S.FunctionProtos.erase(it->Name);
+		if (!it->Stale) {
+				Index.erase(it->Shape);
+		}
+		Evictions++;
+		return Entries.erase(it);
+}
+
+// -- Compiler Session --
+
+CompilerSession::CompilerSession(std::unique_ptr<KaleidoscopeJIT> JIT, const CompilerOptions& Opts)
+		: Opts(Opts), TheJIT(std::move(JIT)),
+		  ExprCache(std::make_unique<CompiledExprCache>(*this, Opts.ExprCacheSize)) {
+	const std::pair<char, uint8_t> Builtins[] = {
+		{'>', 10}, {'<', 10}, {'+', 20}, {'-', 20}, {'*', 40}, {'/', 40},
+	};
+	for (const auto& Builtin: Builtins) {
+		OperatorInfo Op;
+		Op.Precedence = Builtin.second;
+		Operators[(unsigned char)Builtin.first].store(Op);
+	}
+
+	// Code run by --executors finds the executor's own, by dlsym
+	const std::pair<const char *, JITTargetAddress> Runtime[] = {
+		{"__kparallel_for", pointerToJITTargetAddress(&__kparallel_for)},
+		{"__karena_enter", pointerToJITTargetAddress(&__karena_enter)},
+		{"__karena_leave", pointerToJITTargetAddress(&__karena_leave)},
+		{"__karena_alloc", pointerToJITTargetAddress(&__karena_alloc)},
+	};
+	for (const auto& Fn: Runtime) {
+		if (Error Err = TheJIT->defineAbsolute(Fn.first, Fn.second)) {
+			reportError(std::move(Err));
+		}
+	}
+
+	InitializeModuleAndPassManager();
+}
+
+CompilerSession::~CompilerSession() = default;
+
+// Evaluate a top-level expression through the cache: on a miss the
+// expression is compiled once as `__anon_expr.N(literals...)` plus a thunk
+// taking the literals as an array, and kept until evicted
+Optional<PreparedExpr> CompilerSession::PrepareCached(FunctionAST& tle) {
+	HoistLiteralsVisitor hoister;
+	tle.accept(hoister);
+
+	PreparedExpr E;
+	if ((E.Cached = ExprCache->lookup(hoister.Shape))) {
+		E.Literals = std::move(hoister.Literals);
+		if (Echo) {
+			*Echo << "Reused a compiled top level expression\n";
+		}
+		return E;
+	}
+
+	std::string Name = "__anon_expr." + std::to_string(NextExpr++);
+
+	FunctionAST Expr(std::make_unique<PrototypeAST>(Name, hoister.paramNames()),
+					std::move(tle.Body));
+	E.Literals = std::move(hoister.Literals);
+
+	// No constants are left to specialize on, but callees may still fold
+	{
+		TimePhase timer(PhaseOptimize);
+		SpecializeVisitor simplifier(*this, Opts.FMF.noSignedZeros());
+		Expr.accept(simplifier);
+	}
+
+	TimePhase codegenTimer(PhaseCodegen);
+
+	Function *func = Expr.codegen(*this);
+	if (!func) {
+		return None;
+	}
+
+	// double thunk(double *Literals) { return expr(Literals[0], ...); }
+	Type *DoubleTy = Builder->getDoubleTy();
+	Function *thunk = Function::Create(
+		FunctionType::get(DoubleTy, {DoubleTy->getPointerTo()}, false),
+		Function::ExternalLinkage, Name + ".thunk", TheModule.get());
+	Builder->SetInsertPoint(BasicBlock::Create(*TheContext, "entry", thunk));
+
+	std::vector<Value *> Argvec;
+	for (unsigned i = 0; i < E.Literals.size(); i++) {
+		Value *ptr = Builder->CreateConstInBoundsGEP1_32(DoubleTy, thunk->getArg(0), i);
+		Argvec.push_back(Builder->CreateLoad(DoubleTy, ptr, "literal"));
+	}
+	Builder->CreateRet(Builder->CreateCall(func, Argvec, "call"));
+	verifyFunction(*thunk);
+
+	if (Pool) {
+		// {i64, i64} wrapper(i8 *Args, i64 Size) { return {bits of thunk(Args), 8}; }
+		// is an ORC wrapper function returning the double inline, which is
+		// how the executors are called
+		Type *Int64Ty = Builder->getInt64Ty();
+		StructType *ResultTy = StructType::get(*TheContext, {Int64Ty, Int64Ty});
+		Function *wrapper = Function::Create(
+			FunctionType::get(ResultTy, {Builder->getInt8PtrTy(), Int64Ty}, false),
+			Function::ExternalLinkage, Name + ".wrapper", TheModule.get());
+		Builder->SetInsertPoint(BasicBlock::Create(*TheContext, "entry", wrapper));
+		Value *Literals = Builder->CreateBitCast(wrapper->getArg(0), DoubleTy->getPointerTo());
+		Value *Bits = Builder->CreateBitCast(Builder->CreateCall(thunk, {Literals}), Int64Ty);
+		Value *Result = Builder->CreateInsertValue(UndefValue::get(ResultTy), Bits, 0);
+		Builder->CreateRet(Builder->CreateInsertValue(Result, Builder->getInt64(sizeof(double)), 1));
+		verifyFunction(*wrapper);
+	}
+
+	if (Echo) {
+		func->print(*Echo);
+		*Echo << "\nCompiled a top level expression\n";
+	}
+
+	TimePhase jitTimer(PhaseJIT);
+
+	// Compiled once here, linked into an executor when it first runs it
+	if (Pool) {
+		auto Remote = Pool->addExpression(*TheModule, Name + ".wrapper");
+		InitializeModuleAndPassManager();
+		if (!Remote) {
+			reportError(Remote.takeError());
+			return None;
+		}
+		E.Cached = ExprCache->insert(hoister.Shape, Name, CompiledExprCache::Thunk(), nullptr,
+				std::move(*Remote), std::move(hoister.Callees));
+		return E;
+	}
+
+	auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+	Error Err = TheJIT->addModule(
+		ThreadSafeModule(std::move(TheModule), std::move(TheContext)), RT
+	);
+	InitializeModuleAndPassManager();
+	if (Err) {
+		reportError(std::move(Err));
+		return None;
+	}
+
+	// Looking it up materializes it here, so that running it is only a call
+	auto Fn = TheJIT->getFunction<double(const double *)>(Name + ".thunk");
+	if (!Fn) {
+		reportError(Fn.takeError());
+		if (Error Err = RT->remove()) {
+			reportError(std::move(Err));
+		}
+		return None;
+	}
+
+	E.Cached = ExprCache->insert(hoister.Shape, Name, *Fn, RT, nullptr, std::move(hoister.Callees));
+	return E;
+}
+
+// Simplify, then fold or compile a top level expression; None if it does not
+// compile
+Optional<PreparedExpr> CompilerSession::PrepareTopLevel(std::unique_ptr<FunctionAST> tle) {
+	countNodes(*tle);
+	if (Stats) {
+		CurItem.Name = "__anon_expr";
+	}
+
+	// With the cache on, literals become parameters of a reusable
+	// thunk, so they must not be specialized into the expression
+	if (Opts.ExprCacheSize > 0) {
+		TimePhase timer(PhaseOptimize);
+		SimplifyVisitor simplifier(*this, Opts.FMF.noSignedZeros());
+		tle->accept(simplifier);
+	} else {
+		TimePhase timer(PhaseOptimize);
+		SpecializeVisitor simplifier(*this, Opts.FMF.noSignedZeros());
+		tle->accept(simplifier);
+	}
+
+	// Known at parse time: no need to build, compile and run anything
+	if (auto *num = dynamic_cast<NumExprAST *>(tle->Body.get())) {
+		if (Echo) {
+			*Echo << "Folded a top level expression\n";
+		}
+		PreparedExpr E;
+		E.Folded = num->GetVal();
+		return E;
+	}
+
+	if (Opts.ExprCacheSize > 0) {
+		return PrepareCached(*tle);
+	}
+
+	Function *func = tle->codegen(*this);
+	if (!func) {
+		return None;
+	}
+
+	if (Echo) {
+		func->print(*Echo);
+		*Echo << "\nParsed a top level expression\n";
+	}
+
+	// TODO: how do I know which functions to call? In this case, I have the 
+	// tutorial for reference. What if I don't know what does what?
+	TimePhase jitTimer(PhaseJIT);
+	PreparedExpr E;
+	E.RT = TheJIT->getMainJITDylib().createResourceTracker();
+
+	// TODO: wasn't the context supposed to be unique for the 
+	// program? If this context is now owned by the JIT, then
+	// will each top level expression (and even each function)
+	// be created in a new context?
+	auto TSM = ThreadSafeModule(std::move(TheModule), std::move(TheContext));
+
+	Error Err = TheJIT->addModule(std::move(TSM), E.RT);
+
+	// Now, the next function will be placed in a new Module?
+	InitializeModuleAndPassManager();
+
+	if (Err) {
+		reportError(std::move(Err));
+		return None;
+	}
+
+	auto Fn = TheJIT->getFunction<double()>("__anon_expr");
+	if (!Fn) {
+		reportError(Fn.takeError());
+		if (Error Err = E.RT->remove()) {
+			reportError(std::move(Err));
+		}
+		return None;
+	}
+	E.Fn = *Fn;
+	return E;
+}
+
+// Only calls into code that is materialized already, so it may run on a
+// thread of its own
+double CompilerSession::RunPrepared(PreparedExpr& E) {
+	if (E.Folded) {
+		return *E.Folded;
+	}
+
+	double val;
+	{
+		TimePhase timer(PhaseExecute);
+		if (RemoteExpr *Remote = E.Cached.remote()) {
+			val = resultOf(Pool->run(*Remote, E.Literals).get());
+		} else {
+			val = E.Cached ? E.Cached(E.Literals.data()) : E.Fn();
+		}
+	}
+	E.Cached.release();
+
+	if (E.RT) {
+		if (Error Err = E.RT->remove()) {
+			reportError(std::move(Err));
+		}
+	}
+	return val;
+}
+
+// The value of an expression run by an executor; NaN if it could not be run,
+// the reason went to OnError
+double CompilerSession::resultOf(Expected<double> Value) {
+	if (!Value) {
+		reportError(Value.takeError());
+		return std::nan("");
+	}
+	return *Value;
+}
+
+// Back to how the operator parsed before Change, unless a prototype parsed
+// since (with --stream, while this one was compiled) changed it again
+void CompilerSession::UndoOperator(const OperatorChange& Change) {
+	if (Change.Op) {
+		OperatorInfo Expected = Change.After;
+		Operators[(unsigned char)Change.Op].compare_exchange_strong(Expected, Change.Before);
+	}
+}
+
+// Both return false if nothing was defined; the reason went to OnError
+bool CompilerSession::CompileDefinition(std::unique_ptr<FunctionAST> def) {
+	countNodes(*def);
+
+	std::string name = def->Proto->GetName();
+
+	// An operator whose definition fails parses as it did before
+	OperatorChange Operator = def->Proto->GetOperator();
+	bool Defined = false;
+	auto UndoIfFailed = make_scope_exit([&] {
+		if (!Defined) {
+			UndoOperator(Operator);
+		}
+	});
+
+	// The JIT would refuse the symbol when committing; say so before the
+	// session takes on the new prototype
+	if (!Opts.Watch && FunctionDefs.count(name)) {
+		LogError(("Duplicate definition of symbol '" + name + "'").c_str());
+		return false;
+	}
+
+	CompiledFunction Compiled;
+	if (Opts.Watch) {
+		// Callers link against the stub, which points at the latest body that
+		// compiled, or at DroppedDefinition
+		Compiled.Hash = DefinitionHash(*def).Hash;
+		Compiled.Signature = SignatureOf(*def->Proto);
+		Compiled.RT = TheJIT->getMainJITDylib().createResourceTracker();
+		if (Error Err = TheJIT->redirect(name, pointerToJITTargetAddress(&DroppedDefinition))) {
+			reportError(std::move(Err));
+			return false;
+		}
+	}
+
+	{
+		TimePhase timer(PhaseOptimize);
+		SpecializeVisitor simplifier(*this, Opts.FMF.noSignedZeros() || def->FastMath, def->FastMath);
+		def->accept(simplifier);
+		Compiled.Inlined = std::move(simplifier.Specialized);
+	}
+
+	if (Stats) {
+		CurItem.Name = name;
+	}
+	InvalidateSpecializations(name);
+	ExprCache->invalidate(name);
+
+	if (Opts.Watch) {
+		Compiled.Calls = DefinitionHash(*def->Body).Callees;
+	}
+
+	// codegen takes the place of whatever prototype (an extern's) the name
+	// had; put it back if nothing gets defined
+	std::unique_ptr<PrototypeAST> OldProto;
+	auto old = FunctionProtos.find(name);
+	if (old != FunctionProtos.end()) {
+		OldProto = std::move(old->second);
+	}
+	bool WasExtern = ExternFunctions.count(name);
+	auto Restore = [&] {
+		if (Opts.Watch) {
+			return;
+		}
+		if (OldProto) {
+			FunctionProtos[name] = std::move(OldProto);
+		} else {
+			FunctionProtos.erase(name);
+		}
+		if (WasExtern) {
+			ExternFunctions.insert(name);
+		}
+	};
+
+	Function *func = def->codegen(*this);
+	if (!func) {
+		Restore();
+		return false;
+	}
+
+	if (Echo) {
+		func->print(*Echo);
+	}
+
+	std::string body = name;
+	if (Opts.Watch) {
+		body = name + ".v" + std::to_string(NextVersion++);
+		func->setName(body);
+	}
+
+	if (!CommitModule(Compiled.RT)) {
+		Restore();
+		return false;
+	}
+
+	if (Opts.Watch) {
+		// Looking the body up compiles it now, before anything can call it
+		auto Sym = TheJIT->lookup(body);
+		Error Err = Sym ? TheJIT->redirect(name, Sym->getAddress()) : Sym.takeError();
+		if (Err) {
+			reportError(std::move(Err));
+			if (Error Err = Compiled.RT->remove()) {
+				reportError(std::move(Err));
+			}
+			return false;
+		}
+		CallGraph[name] = std::move(Compiled);
+	}
+
+	if (Echo) {
+		*Echo << "\nRead a function definition\n";
+	}
+
+	FunctionDefs[name] = std::move(def);
+	Defined = true;
+	return true;
+}
+
+bool CompilerSession::CompileExtern(std::unique_ptr<PrototypeAST> extn) {
+	countNodes(*extn);
+	if (Stats) {
+		CurItem.Name = extn->GetName();
+	}
+
+	Function *func = extn->codegen(*this);
+	if (!func) {
+		UndoOperator(extn->GetOperator());
+		return false;
+	}
+
+	if (Echo) {
+		func->print(*Echo);
+		*Echo << "\nRead an extern\n";
+	}
+	ExternFunctions.insert(extn->GetName());
+	FunctionProtos[extn->GetName()] = std::move(extn);
+	return true;
+}
+
+// Bind the exports of a shared library in the JIT, ahead of the externs
+// that call them
+bool CompilerSession::LoadLibrary(const std::string& Path) {
+	if (Pool) {
+		LogError("load cannot be used with --executors");
+		return false;
+	}
+
+	auto Lib = HostLibrary::open(Path);
+	if (!Lib) {
+		reportError(Lib.takeError());
+		return false;
+	}
+	auto Count = TheJIT->addHostLibrary(**Lib);
+	if (!Count) {
+		reportError(Count.takeError());
+		return false;
+	}
+
+	if (Echo) {
+		*Echo << "Loaded " << *Count << " symbols from " << (*Lib)->getFileName() << "\n";
+	}
+	return true;
+}
+
+// Remove the code of Name, a definition or a clone, and what was derived
+// from it: its clones and folded calls, and the expressions calling it. The
+// stub of a definition stays, pointing at DroppedDefinition.
+void CompilerSession::DropCompiled(const std::string& Name) {
+	auto it = CallGraph.find(Name);
+	if (it == CallGraph.end()) {
+		return;
+	}
+
+	if (it->second.Clone) {
+		for (auto spec = Specializations.begin(); spec != Specializations.end(); ) {
+			if (spec->second.Name == Name) {
+				spec = Specializations.erase(spec);
+			} else {
+				++spec;
+			}
+		}
+	} else {
+		if (Error Err = TheJIT->redirect(Name, pointerToJITTargetAddress(&DroppedDefinition))) {
+			reportError(std::move(Err));
+		}
+		// Its clones inline it, so they are all being dropped too
+		SpecializationCount.erase(Name);
+	}
+
+	if (Error Err = it->second.RT->remove()) {
+		reportError(std::move(Err));
+	}
+	FunctionProtos.erase(Name);
+	FunctionDefs.erase(Name);
+	InvalidateSpecializations(Name);
+	ExprCache->invalidate(Name);
+	CallGraph.erase(it);
+}
+
+static bool Intersects(const std::set<std::string>& A, const std::set<std::string>& B) {
+	for (const auto& Name: A) {
+		if (B.count(Name)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+ReloadReport CompilerSession::Reload(StringRef Source, std::vector<double>& Results) {
+	// All of it is parsed first: what is stale depends on every definition
+	struct Item {
+		int Kind; // tok_def, tok_extern, tok_load, or 0 for an expression
+		std::unique_ptr<FunctionAST> Func;
+		std::unique_ptr<PrototypeAST> Proto;
+		std::string Path;
+	};
+	std::vector<Item> Items;
+	std::map<std::string, FunctionAST *> Defs;
+
+	Lex.reset(Source);
+	getNextToken();
+	while (CurTok != tok_eof) {
+		switch (CurTok) {
+			case tok_def:
+				if (auto def = ParseDefinition()) {
+					const std::string& Name = def->Proto->GetName();
+					if (Defs.emplace(Name, def.get()).second) {
+						Items.push_back({tok_def, std::move(def), nullptr, ""});
+					} else {
+						LogError(("Duplicate definition of " + Name).c_str());
+					}
+				} else {
+					getNextToken();
+				}
+				break;
+			case tok_extern:
+				if (auto extn = ParseExtern()) {
+					Items.push_back({tok_extern, nullptr, std::move(extn), ""});
+				} else {
+					getNextToken();
+				}
+				break;
+			case tok_load: {
+				std::string Path = ParseLoad();
+				if (!Path.empty()) {
+					Items.push_back({tok_load, nullptr, nullptr, Path});
+				} else {
+					getNextToken();
+				}
+				break;
+			}
+			case ';':
+				getNextToken();
+				break;
+			case ':':
+				ParseCommand();
+				LogError("commands are only available in the REPL");
+				break;
+			default:
+				if (auto tle = ParseTopLevelExpr()) {
+					Items.push_back({0, std::move(tle), nullptr, ""});
+				} else {
+					getNextToken();
+				}
+				break;
+		}
+	}
+
+	// Stale: definitions that changed or are gone, then, until there are no
+	// more, code that inlined something stale or calls something its callers
+	// must be linked to again (a clone, or a definition that is gone or has
+	// a new signature)
+	ReloadReport Report;
+	std::set<std::string> Stale, Relink;
+	for (const auto& F: CallGraph) {
+		if (F.second.Clone) {
+			continue;
+		}
+		auto def = Defs.find(F.first);
+		if (def == Defs.end()) {
+			Stale.insert(F.first);
+			Relink.insert(F.first);
+			Report.Removed++;
+		} else if (DefinitionHash(*def->second).Hash != F.second.Hash) {
+			Stale.insert(F.first);
+			if (SignatureOf(*def->second->Proto) != F.second.Signature) {
+				Relink.insert(F.first);
+			}
+		}
+	}
+	for (bool More = true; More; ) {
+		More = false;
+		for (const auto& F: CallGraph) {
+			if (!Stale.count(F.first) &&
+					(Intersects(F.second.Inlined, Stale) || Intersects(F.second.Calls, Relink))) {
+				Stale.insert(F.first);
+				if (F.second.Clone) {
+					Relink.insert(F.first);
+				} else if (Defs.count(F.first)) {
+					Report.Dependents++;
+				}
+				More = true;
+			}
+		}
+	}
+	for (const auto& Name: Stale) {
+		DropCompiled(Name);
+	}
+
+	// In program order; definitions that were kept are all there already
+	for (auto& I: Items) {
+		switch (I.Kind) {
+			case tok_def:
+				if (CallGraph.count(I.Func->Proto->GetName())) {
+					Report.Reused++;
+				} else {
+					CompileDefinition(std::move(I.Func));
+					Report.Rebuilt++;
+				}
+				break;
+			case tok_extern:
+				CompileExtern(std::move(I.Proto));
+				break;
+			case tok_load:
+				LoadLibrary(I.Path);
+				break;
+			default: {
+				auto E = PrepareTopLevel(std::move(I.Func));
+				Results.push_back(E ? RunPrepared(*E) : std::nan(""));
+				break;
+			}
+		}
+	}
+	return Report;
+}
+
+// -- Top Level Items --
+
+void CompilerSession::HandleDefinition() {
+		if (auto def = ParseDefinition()) {
+
+#if DEBUGPARSE
+				LispPrintVisitor lvt(Echo ? *Echo : nulls());
+				def->accept(lvt);
+#endif
+
+#if IRGEN
+				CompileDefinition(std::move(def));
+#endif
+
+		}else {
+				getNextToken(); // skip token
+		}
+}
+
+
+void CompilerSession::HandleExtern() {
+		if (auto extn = ParseExtern()) {
+
+#if DEBUGPARSE
+				LispPrintVisitor lvt(Echo ? *Echo : nulls());
+				extn->accept(lvt);
+#endif
+
+#if IRGEN
+				CompileExtern(std::move(extn));
+#endif
+
+		}else {
+				getNextToken();
+		}
+}
+
+void CompilerSession::HandleLoad() {
+		std::string Path = ParseLoad();
+		if (!Path.empty()) {
+				LoadLibrary(Path);
+		} else {
+				getNextToken();
+		}
+}
+
+// None if the expression did not compile
+Optional<double> CompilerSession::HandleTopLevelExpression() {
+		if (auto tle = ParseTopLevelExpr()) {
+
+#if DEBUGPARSE
+				LispPrintVisitor lvt(Echo ? *Echo : nulls());
+				tle->accept(lvt);
+#endif
+
+#if IRGEN
+				if (auto E = PrepareTopLevel(std::move(tle))) {
+						return RunPrepared(*E);
+				}
+#endif
+
+		} else {
+				getNextToken();
+		}
+		return None;
+}
+
+// command:
+// 	::= ':' 'memory'
+// The name after ':', empty if it is not an identifier
+std::string CompilerSession::ParseCommand() {
+		getNextToken(); // eat ':'
+
+		std::string Name = CurTok == tok_identifier ? Lex.IdentifierString : "";
+		getNextToken();
+		return Name;
+}
+
+// -- Embedding API --
+
+namespace kaleidoscope {
+
+Compiler::Compiler(std::unique_ptr<CompilerSession> S): S(std::move(S)) {}
+
+Compiler::~Compiler() = default;
+
+Expected<std::unique_ptr<Compiler>> Compiler::create(const Options& Opts) {
+	static std::once_flag NativeTarget;
+	std::call_once(NativeTarget, [] {
+		InitializeNativeTarget();
+		InitializeNativeTargetAsmParser();
+		InitializeNativeTargetAsmPrinter();
+	});
+
+	auto JIT = KaleidoscopeJIT::Create();
+	if (!JIT) {
+		return JIT.takeError();
+	}
+
+	CompilerOptions CO;
+	if (Opts.FastMath) {
+		CO.FMF.setFast();
+	}
+	if (Opts.FPContract) {
+		CO.FMF.setAllowContract();
+	}
+	CO.SpecializeLimit = Opts.SpecializeLimit;
+	CO.ExprCacheSize = Opts.ExprCacheSize;
+
+	return std::unique_ptr<Compiler>(new Compiler(std::make_unique<CompilerSession>(std::move(*JIT), CO)));
+}
+
+Expected<Module> Compiler::compile(StringRef Source) {
+	std::string Errors;
+	S->OnError = [&](const std::string& Msg) {
+		if (!Errors.empty()) {
+			Errors += '\n';
+		}
+		Errors += Msg;
+	};
+
+	Module M(*this);
+	S->Lex.reset(Source);
+	S->getNextToken();
+	while (S->CurTok != tok_eof) {
+		switch (S->CurTok) {
+			case tok_def:
+				if (auto def = S->ParseDefinition()) {
+					std::string Name = def->Proto->GetName();
+					if (S->CompileDefinition(std::move(def))) {
+						M.Functions.push_back(Name);
+					}
+				} else {
+					S->getNextToken();
+				}
+				break;
+			case tok_extern:
+				S->HandleExtern();
+				break;
+			case tok_load:
+				S->HandleLoad();
+				break;
+			case ';':
+				S->getNextToken();
+				break;
+			case ':':
+				S->ParseCommand();
+				S->LogError("commands are only available in the REPL");
+				break;
+			default:
+				if (auto val = S->HandleTopLevelExpression()) {
+					M.Results.push_back(*val);
+				}
+				break;
+		}
+	}
+	S->OnError = nullptr;
+
+	if (!Errors.empty()) {
+		return createStringError(inconvertibleErrorCode(), Errors);
+	}
+	return std::move(M);
+}
+
+Expected<std::shared_ptr<const EntryPointSlot>> Compiler::getEntryPoint(StringRef Name) {
+	return S->TheJIT->getEntryPoint(Name);
+}
+
+} // end namespace kaleidoscope
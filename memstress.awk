@@ -0,0 +1,22 @@
+# Memory stress input for `make test-memory`: N top-level expressions, mostly
+# repeating shapes (expression cache hits) with a new shape every 50th, so
+# code is also compiled and evicted all along. Prints :memory after N/5
+# expressions and at the end.
+BEGIN {
+	print "def f(a b) a*b+a;"
+	for (i = 0; i < N; i++) {
+		if (i % 50 == 0) {
+			# a new shape: the bits of j pick the operators
+			j = int(i / 50) % 4096
+			e = "f(" i ", 2)"
+			for (k = 0; k < 12; k++) {
+				e = "(" e (int(j / 2^k) % 2 ? " + " : " * ") (k + 1) ")"
+			}
+			print e ";"
+		} else {
+			print "f(" i % 1000 ", " i % 7 ") + " i % 13 ";"
+		}
+		if (i == N / 5 || i == N - 1)
+			print ":memory"
+	}
+}